@@ -0,0 +1,503 @@
+/*
+ * Throughput of the link between a running wsd and its backend, plain
+ * or deflated (see -c). Plays the backend, accepting wsd's offer of
+ * compression if it makes one, while a child process keeps a number of
+ * websockets busy. First the websockets send JSON messages as fast as
+ * wsd takes them, then the backend sends as fast as wsd takes, round
+ * robin to every websocket; the websockets drain whatever arrives. For
+ * either direction, reports messages per second, the megabytes per
+ * second of records and of what they took on the wire, and octets on
+ * the wire per message. A batch (see -B) counts as many messages as it
+ * carries entries; given a last argument other than 0, the backend
+ * sends batches too. Run wsd with and without -c and -B to compare.
+ *
+ * Usage: backend [port [forward port [websockets [seconds [batch]]]]]
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <zlib.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#define BUF_LEN      (4 * 1048576)
+#define BATCH        64         /* Records the backend writes at once     */
+#define MAX_MSG_LEN  256
+
+#define REQUEST                                         \
+     "GET /chat HTTP/1.1\r\n"                           \
+     "Host: localhost\r\n"                              \
+     "Upgrade: websocket\r\n"                           \
+     "Connection: Upgrade\r\n"                          \
+     "Origin: http://localhost\r\n"                     \
+     "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"  \
+     "Sec-WebSocket-Version: 13\r\n\r\n"
+
+/* As in pp2.c and pp2z.h */
+static const unsigned char sig[] =
+{ 0x0d, 0x0a, 0x0d, 0x0a, 0x00, 0x0d, 0x0a, 0x51, 0x55, 0x49, 0x54, 0x0a };
+static const unsigned char accept_deflate[] =
+{ 0x20, 0x00, 0x00, 0x0a, 0xe3, 0x00, 0x07, 'd', 'e', 'f', 'l', 'a', 't', 'e' };
+
+static const unsigned char batch_hdr[] =
+{ 0x20, 0x00, 0x00, 0x0a, 0xe5, 0x00, 0x00, 0xe1, 0x00, 0x04 };
+
+static struct sockaddr_in addr;
+static volatile sig_atomic_t draining = 0;
+
+struct link {
+     int             fd;
+     bool            deflate;
+     z_stream        tx;
+     z_stream        rx;
+};
+
+struct count {
+     unsigned long   wire;      /* Octets on the wire                     */
+     unsigned long   plain;     /* Octets of records                      */
+     unsigned long   records;
+};
+
+static double
+elapsed_s(const struct timespec *start, const struct timespec *end)
+{
+     return (end->tv_sec - start->tv_sec)
+          + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void
+die(const char *s)
+{
+     perror(s);
+     exit(EXIT_FAILURE);
+}
+
+static void
+on_sigusr1(int sig)
+{
+     (void)sig;
+     draining = 1;
+}
+
+static unsigned int
+make_msg(char *dst, unsigned int seed)
+{
+     seed = seed * 1103515245 + 12345;
+     return snprintf(dst,
+                     MAX_MSG_LEN,
+                     "{\"ts\":%u,\"sensor\":\"temp-%u\",\"value\":%u.%u,"
+                     "\"unit\":\"celsius\",\"ok\":true}",
+                     1586000000 + seed % 1000,
+                     seed % 16,
+                     seed % 100,
+                     (seed >> 8) % 10);
+}
+
+static int
+upgrade(int fd)
+{
+     if (sizeof(REQUEST) - 1 != write(fd, REQUEST, sizeof(REQUEST) - 1))
+          return (-1);
+
+     char buf[512];
+     unsigned int len = 0;
+     while (len < sizeof(buf) - 1) {
+          ssize_t n = read(fd, &buf[len], sizeof(buf) - 1 - len);
+          if (0 >= n)
+               return (-1);
+          len += n;
+          buf[len] = '\0';
+          if (strstr(buf, "\r\n\r\n"))
+               return strncmp(buf, "HTTP/1.1 101", 12) ? -1 : 0;
+     }
+     return (-1);
+}
+
+/* Sends messages round robin until told to drain, then drains */
+static void
+clients(unsigned int num)
+{
+     struct sigaction sac;
+     memset(&sac, 0, sizeof(sac));
+     sac.sa_handler = on_sigusr1;
+     if (0 > sigaction(SIGUSR1, &sac, NULL))
+          die("sigaction");
+
+     int *fds = calloc(num, sizeof(int)), on = 1;
+     if (!fds)
+          die("clients");
+     for (unsigned int i = 0; i < num; i++) {
+          fds[i] = socket(AF_INET, SOCK_STREAM, 0);
+          setsockopt(fds[i], IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+          if (0 > fds[i]
+              || 0 > connect(fds[i], (struct sockaddr *)&addr, sizeof(addr))
+              || 0 > upgrade(fds[i]))
+               die("upgrade");
+     }
+
+     /* Masked with a key of zero, which leaves payload as is */
+     char frame[6 + MAX_MSG_LEN];
+     for (unsigned int i = 0; !draining; i++) {
+          unsigned int len = make_msg(&frame[6], i);
+          frame[0] = (char)0x81;
+          frame[1] = (char)(0x80 | len);
+          memset(&frame[2], 0, 4);
+          if (0 > write(fds[i % num], frame, 6 + len) && EINTR != errno)
+               die("write");
+     }
+
+     int efd = epoll_create(1);
+     struct epoll_event ev, evs[64];
+     ev.events = EPOLLIN;
+     for (unsigned int i = 0; i < num; i++) {
+          ev.data.fd = fds[i];
+          if (0 > epoll_ctl(efd, EPOLL_CTL_ADD, fds[i], &ev))
+               die("epoll_ctl");
+     }
+
+     static char buf[65536];
+     for (;;) {
+          int n = epoll_wait(efd, evs, 64, -1);
+          for (int i = 0; i < n; i++)
+               if (0 >= read(evs[i].data.fd, buf, sizeof(buf)))
+                    exit(EXIT_SUCCESS);
+     }
+}
+
+/* Reads first record; accepts an offer of compression if there is one */
+static unsigned int
+handshake(struct link *l, char *buf)
+{
+     unsigned int len = 0;
+     while (len < 16 || len < 16U + (((unsigned char)buf[14] << 8)
+                                     | (unsigned char)buf[15])) {
+          ssize_t n = read(l->fd, &buf[len], BUF_LEN - len);
+          if (0 >= n)
+               die("read");
+          len += n;
+     }
+
+     unsigned int hdr = 16 + (((unsigned char)buf[14] << 8)
+                              | (unsigned char)buf[15]);
+     l->deflate = 0x20 == (unsigned char)buf[12]
+          && 0xe3 == (unsigned char)buf[16];
+     if (!l->deflate)
+          return len;
+
+     char reply[sizeof(sig) + sizeof(accept_deflate)];
+     memcpy(reply, sig, sizeof(sig));
+     memcpy(&reply[sizeof(sig)], accept_deflate, sizeof(accept_deflate));
+     if (sizeof(reply) != write(l->fd, reply, sizeof(reply)))
+          die("write");
+
+     if (Z_OK != deflateInit2(&l->tx, 6, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY)
+         || Z_OK != inflateInit2(&l->rx, -15))
+          die("zlib");
+
+     memmove(buf, &buf[hdr], len - hdr);
+     return len - hdr;
+}
+
+static void
+remember(unsigned long id,
+         unsigned long *ids,
+         unsigned int *num_ids,
+         unsigned int max_ids)
+{
+     bool known = false;
+     for (unsigned int i = 0; i < *num_ids && !known; i++)
+          known = ids[i] == id;
+     if (!known && *num_ids < max_ids)
+          ids[(*num_ids)++] = id;
+}
+
+/* Counts complete records in buf, remembering connection ids */
+static unsigned int
+parse(struct count *c,
+      char *buf,
+      unsigned int len,
+      unsigned long *ids,
+      unsigned int *num_ids,
+      unsigned int max_ids)
+{
+     unsigned int pos = 0;
+     while (len - pos >= 16) {
+          unsigned char *p = (unsigned char*)&buf[pos];
+          unsigned int hdr = 16 + (p[14] << 8 | p[15]);
+          unsigned int payload = 0;
+          unsigned long id = 0;
+          bool batch = false;
+          if (len - pos < hdr)
+               break;
+          unsigned int t = 0x20 == p[12] ? 16 : 28;
+          for (; t + 3 <= hdr; t += 3 + (p[t + 1] << 8 | p[t + 2])) {
+               if (0xe0 == p[t])
+                    memcpy(&id, &p[t + 3], sizeof(id));
+               if (0xe1 == p[t])
+                    memcpy(&payload, &p[t + 3], sizeof(payload));
+               if (0xe5 == p[t])
+                    batch = true;
+          }
+          if (len - pos < hdr + payload)
+               break;
+
+          pos += hdr + payload;
+          c->plain += hdr + payload;
+          if (!batch) {
+               c->records++;
+               remember(id, ids, num_ids, max_ids);
+               continue;
+          }
+
+          /* Entries of id, length and first byte of frame */
+          for (unsigned int e = hdr; e + 13 <= hdr + payload;) {
+               unsigned int n;
+               memcpy(&id, &p[e], sizeof(id));
+               memcpy(&n, &p[e + 8], sizeof(n));
+               c->records++;
+               remember(id, ids, num_ids, max_ids);
+               e += 13 + n;
+          }
+     }
+
+     memmove(buf, &buf[pos], len - pos);
+     return len - pos;
+}
+
+/* Reads what the websockets send for secs seconds */
+static void
+upstream(struct link *l,
+         struct count *c,
+         char *buf,
+         unsigned int len,
+         char *wire,
+         double secs,
+         unsigned long *ids,
+         unsigned int *num_ids,
+         unsigned int max_ids)
+{
+     struct timespec start, now;
+     clock_gettime(CLOCK_MONOTONIC, &start);
+     do {
+          ssize_t n = read(l->fd, l->deflate ? wire : &buf[len], BUF_LEN - len);
+          if (0 >= n)
+               die("read");
+          c->wire += n;
+
+          if (l->deflate) {
+               l->rx.next_in = (Bytef*)wire;
+               l->rx.avail_in = n;
+               while (l->rx.avail_in) {
+                    l->rx.next_out = (Bytef*)&buf[len];
+                    l->rx.avail_out = BUF_LEN - len;
+                    int rv = inflate(&l->rx, Z_SYNC_FLUSH);
+                    if (Z_OK != rv && Z_BUF_ERROR != rv)
+                         die("inflate");
+                    len = BUF_LEN - l->rx.avail_out;
+                    len = parse(c, buf, len, ids, num_ids, max_ids);
+               }
+          } else {
+               len += n;
+               len = parse(c, buf, len, ids, num_ids, max_ids);
+          }
+          clock_gettime(CLOCK_MONOTONIC, &now);
+     } while (elapsed_s(&start, &now) < secs);
+}
+
+/* Puts record of msg for connection id into dst, as wsd would */
+static unsigned int
+put_record(char *dst, unsigned long id, const char *msg, unsigned int len)
+{
+     unsigned char *p = (unsigned char*)dst;
+     memcpy(p, sig, sizeof(sig));
+     p[12] = 0x21;
+     p[13] = 0x11;
+     p[14] = 0;
+     p[15] = 12 + 3 + sizeof(id) + 3 + sizeof(len);
+     memset(&p[16], 0, 12);
+     unsigned int pos = 28;
+     p[pos++] = 0xe0;
+     p[pos++] = 0;
+     p[pos++] = sizeof(id);
+     memcpy(&p[pos], &id, sizeof(id));
+     pos += sizeof(id);
+     p[pos++] = 0xe1;
+     p[pos++] = 0;
+     p[pos++] = sizeof(len);
+     memcpy(&p[pos], &len, sizeof(len));
+     pos += sizeof(len);
+     memcpy(&p[pos], msg, len);
+     return pos + len;
+}
+
+/* Puts BATCH messages into dst as one batch, as wsd would with -B */
+static unsigned int
+put_batch(char *dst,
+          const unsigned long *ids,
+          unsigned int num_ids,
+          unsigned int seq)
+{
+     unsigned int len = sizeof(sig) + sizeof(batch_hdr) + sizeof(len);
+     for (unsigned int i = 0; i < BATCH; i++, seq++) {
+          char *p = &dst[len];
+          unsigned int n = make_msg(&p[13], seq);
+          memcpy(p, &ids[seq % num_ids], sizeof(unsigned long));
+          memcpy(&p[8], &n, sizeof(n));
+          p[12] = (char)0x81;
+          len += 13 + n;
+     }
+
+     unsigned int entries = len - sizeof(sig) - sizeof(batch_hdr)
+          - sizeof(entries);
+     memcpy(dst, sig, sizeof(sig));
+     memcpy(&dst[sizeof(sig)], batch_hdr, sizeof(batch_hdr));
+     memcpy(&dst[sizeof(sig) + sizeof(batch_hdr)], &entries, sizeof(entries));
+     return len;
+}
+
+/* Sends to the websockets round robin for secs seconds */
+static void
+downstream(struct link *l,
+           struct count *c,
+           char *buf,
+           char *wire,
+           double secs,
+           const unsigned long *ids,
+           unsigned int num_ids,
+           bool batch)
+{
+     struct timespec start, now;
+     clock_gettime(CLOCK_MONOTONIC, &start);
+     unsigned int seq = 0;
+     do {
+          unsigned int len = 0;
+          if (batch) {
+               len = put_batch(buf, ids, num_ids, seq);
+               seq += BATCH;
+          }
+          for (unsigned int i = 0; !batch && i < BATCH; i++, seq++) {
+               char msg[MAX_MSG_LEN];
+               unsigned int n = make_msg(msg, seq);
+               len += put_record(&buf[len], ids[seq % num_ids], msg, n);
+          }
+          c->records += BATCH;
+          c->plain += len;
+
+          char *out = buf;
+          if (l->deflate) {
+               l->tx.next_in = (Bytef*)buf;
+               l->tx.avail_in = len;
+               l->tx.next_out = (Bytef*)wire;
+               l->tx.avail_out = BUF_LEN;
+               if (Z_OK != deflate(&l->tx, Z_SYNC_FLUSH) || l->tx.avail_in)
+                    die("deflate");
+               out = wire;
+               len = BUF_LEN - l->tx.avail_out;
+          }
+
+          for (unsigned int pos = 0; pos < len;) {
+               ssize_t n = write(l->fd, &out[pos], len - pos);
+               if (0 >= n)
+                    die("write");
+               pos += n;
+          }
+          c->wire += len;
+          clock_gettime(CLOCK_MONOTONIC, &now);
+     } while (elapsed_s(&start, &now) < secs);
+}
+
+static void
+report(const char *way, const struct link *l, const struct count *c, double secs)
+{
+     printf("%-8s %-6s %12.0f %12.1f %12.1f %9.1f%% %10.1f\n",
+            l->deflate ? "deflate" : "plain",
+            way,
+            c->records / secs,
+            c->plain / secs / 1e6,
+            c->wire / secs / 1e6,
+            c->plain ? 100.0 * c->wire / c->plain : 0,
+            c->records ? (double)c->wire / c->records : 0);
+}
+
+int
+main(int argc, char **argv)
+{
+     int port = 1 < argc ? atoi(argv[1]) : 6084;
+     int fport = 2 < argc ? atoi(argv[2]) : 6085;
+     unsigned int num = 3 < argc ? atoi(argv[3]) : 100;
+     double secs = 4 < argc ? atof(argv[4]) : 3;
+     bool batch = 5 < argc && atoi(argv[5]);
+     if (0 == num || 0 >= secs) {
+          fprintf(stderr,
+                  "Usage: %s [port [forward port [websockets [seconds "
+                  "[batch]]]]]\n",
+                  argv[0]);
+          exit(EXIT_FAILURE);
+     }
+
+     memset(&addr, 0, sizeof(addr));
+     addr.sin_family = AF_INET;
+     addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+     int lfd = socket(AF_INET, SOCK_STREAM, 0), on = 1;
+     setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+     addr.sin_port = htons(fport);
+     if (0 > lfd
+         || 0 > bind(lfd, (struct sockaddr *)&addr, sizeof(addr))
+         || 0 > listen(lfd, 1))
+          die("backend");
+
+     /* wsd connects to its backend once a websocket has something to say */
+     addr.sin_port = htons(port);
+     fflush(stdout);
+     pid_t pid = fork();
+     if (0 > pid)
+          die("fork");
+     if (0 == pid)
+          clients(num);
+
+     struct link l;
+     struct count up, down;
+     memset(&l, 0, sizeof(l));
+     memset(&up, 0, sizeof(up));
+     memset(&down, 0, sizeof(down));
+     if (0 > (l.fd = accept(lfd, NULL, NULL)))
+          die("accept");
+     close(lfd);
+
+     char *buf = malloc(BUF_LEN), *wire = malloc(BUF_LEN);
+     unsigned long *ids = calloc(num, sizeof(unsigned long));
+     unsigned int num_ids = 0;
+     if (!buf || !wire || !ids)
+          die(argv[0]);
+
+     unsigned int len = handshake(&l, buf);
+     upstream(&l, &up, buf, len, wire, secs, ids, &num_ids, num);
+     kill(pid, SIGUSR1);
+     downstream(&l, &down, buf, wire, secs, ids, num_ids, batch);
+
+     printf("%u websockets, %.0f s each way\n", num, secs);
+     printf("%-8s %-6s %12s %12s %12s %10s %10s\n",
+            "link", "way", "msgs/s", "MB/s records", "MB/s wire", "wire",
+            "wire B/msg");
+     report("up", &l, &up, secs);
+     report("down", &l, &down, secs);
+
+     kill(pid, SIGTERM);
+     waitpid(pid, NULL, 0);
+     close(l.fd);
+     free(buf);
+     free(wire);
+     free(ids);
+     return 0;
+}
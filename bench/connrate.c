@@ -0,0 +1,229 @@
+/*
+ * Connections per second a running wsd completes the websocket opening
+ * handshake for, and handshake latency from connect(2) to the 101
+ * response. Keeps a number of connections in flight, replacing each as
+ * soon as it upgraded; a connect storm is a large number in flight.
+ * Sockets are reset on close so the client doesn't run out of ports.
+ *
+ * Usage: connrate [host [port [connections [in flight]]]]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+#define REQUEST                                         \
+     "GET /chat HTTP/1.1\r\n"                           \
+     "Host: localhost\r\n"                              \
+     "Upgrade: websocket\r\n"                           \
+     "Connection: Upgrade\r\n"                          \
+     "Origin: http://localhost\r\n"                     \
+     "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"  \
+     "Sec-WebSocket-Version: 13\r\n\r\n"
+
+struct conn {
+     int             fd;
+     unsigned int    len;
+     struct timespec start;
+     char            buf[512];
+};
+
+static struct sockaddr_in addr;
+static int epfd;
+static unsigned int started = 0, total = 0, failed = 0;
+static double *lat_ms;
+static unsigned int num_lat = 0;
+
+static double
+elapsed_ms(const struct timespec *start, const struct timespec *end)
+{
+     return (end->tv_sec - start->tv_sec) * 1e3
+          + (end->tv_nsec - start->tv_nsec) / 1e6;
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+     double x = *(const double*)a, y = *(const double*)b;
+     return (x > y) - (x < y);
+}
+
+static void
+conn_start(struct conn *c)
+{
+     c->len = 0;
+     c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+     if (0 > c->fd) {
+          perror("socket");
+          exit(EXIT_FAILURE);
+     }
+
+     struct linger l = { 1, 0 };
+     setsockopt(c->fd, SOL_SOCKET, SO_LINGER, &l, sizeof(l));
+
+     clock_gettime(CLOCK_MONOTONIC, &c->start);
+     if (0 > connect(c->fd, (struct sockaddr *)&addr, sizeof(addr))
+         && EINPROGRESS != errno) {
+          perror("connect");
+          exit(EXIT_FAILURE);
+     }
+
+     struct epoll_event ev;
+     ev.events = EPOLLOUT;
+     ev.data.ptr = c;
+     if (0 > epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev)) {
+          perror("epoll_ctl");
+          exit(EXIT_FAILURE);
+     }
+     started++;
+}
+
+/* Closes connection and starts the next one, if any; returns 1 if so */
+static int
+conn_done(struct conn *c, int ok)
+{
+     if (ok) {
+          struct timespec now;
+          clock_gettime(CLOCK_MONOTONIC, &now);
+          lat_ms[num_lat++] = elapsed_ms(&c->start, &now);
+     } else {
+          failed++;
+     }
+
+     close(c->fd);
+     if (started < total) {
+          conn_start(c);
+          return 1;
+     }
+     return 0;
+}
+
+/* Returns 1 while connection is in flight */
+static int
+on_event(struct conn *c, unsigned int events)
+{
+     if (events & (EPOLLERR | EPOLLHUP))
+          return conn_done(c, 0);
+
+     if (events & EPOLLOUT) {
+          if (sizeof(REQUEST) - 1 != write(c->fd, REQUEST, sizeof(REQUEST) - 1))
+               return conn_done(c, 0);
+
+          struct epoll_event ev;
+          ev.events = EPOLLIN;
+          ev.data.ptr = c;
+          if (0 > epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev)) {
+               perror("epoll_ctl");
+               exit(EXIT_FAILURE);
+          }
+          return 1;
+     }
+
+     ssize_t n = read(c->fd, &c->buf[c->len], sizeof(c->buf) - 1 - c->len);
+     if (0 > n && EAGAIN == errno)
+          return 1;
+     if (0 >= n)
+          return conn_done(c, 0);
+
+     c->len += n;
+     c->buf[c->len] = '\0';
+     if (!strstr(c->buf, "\r\n\r\n")) {
+          if (sizeof(c->buf) - 1 == c->len)
+               return conn_done(c, 0);
+          return 1;
+     }
+
+     return conn_done(c, 0 == strncmp(c->buf, "HTTP/1.1 101", 12));
+}
+
+int
+main(int argc, char **argv)
+{
+     const char *host = 1 < argc ? argv[1] : "127.0.0.1";
+     int port = 2 < argc ? atoi(argv[2]) : 6084;
+     total = 3 < argc ? atoi(argv[3]) : 20000;
+     unsigned int parallel = 4 < argc ? atoi(argv[4]) : 256;
+     if (0 == total || 0 == parallel) {
+          fprintf(stderr, "Usage: %s [host [port [conns [in flight]]]]\n",
+                  argv[0]);
+          exit(EXIT_FAILURE);
+     }
+     if (parallel > total)
+          parallel = total;
+
+     struct rlimit rl;
+     if (0 == getrlimit(RLIMIT_NOFILE, &rl)) {
+          rl.rlim_cur = rl.rlim_max;
+          setrlimit(RLIMIT_NOFILE, &rl);
+     }
+
+     memset(&addr, 0, sizeof(addr));
+     addr.sin_family = AF_INET;
+     addr.sin_port = htons(port);
+     if (1 != inet_pton(AF_INET, host, &addr.sin_addr)) {
+          fprintf(stderr, "%s: not an IPv4 address: %s\n", argv[0], host);
+          exit(EXIT_FAILURE);
+     }
+
+     epfd = epoll_create(1);
+     struct conn *conns = calloc(parallel, sizeof(struct conn));
+     lat_ms = calloc(total, sizeof(double));
+     struct epoll_event *evs = calloc(parallel, sizeof(struct epoll_event));
+     if (0 > epfd || !conns || !lat_ms || !evs) {
+          perror(argv[0]);
+          exit(EXIT_FAILURE);
+     }
+
+     struct timespec start, end;
+     clock_gettime(CLOCK_MONOTONIC, &start);
+
+     unsigned int in_flight = parallel;
+     for (unsigned int i = 0; i < parallel; i++)
+          conn_start(&conns[i]);
+
+     while (in_flight) {
+          int n = epoll_wait(epfd, evs, parallel, -1);
+          if (0 > n && EINTR == errno)
+               continue;
+          if (0 > n) {
+               perror("epoll_wait");
+               exit(EXIT_FAILURE);
+          }
+          for (int i = 0; i < n; i++)
+               if (!on_event(evs[i].data.ptr, evs[i].events))
+                    in_flight--;
+     }
+
+     clock_gettime(CLOCK_MONOTONIC, &end);
+     double secs = elapsed_ms(&start, &end) / 1e3;
+
+     qsort(lat_ms, num_lat, sizeof(double), cmp_double);
+     double sum = 0;
+     for (unsigned int i = 0; i < num_lat; i++)
+          sum += lat_ms[i];
+
+     printf("%8s %9s %10s %9s %9s %9s %7s\n",
+            "conns", "in flight", "conns/s", "mean ms", "p99 ms", "max ms",
+            "failed");
+     printf("%8u %9u %10.0f %9.2f %9.2f %9.2f %7u\n",
+            total,
+            parallel,
+            num_lat / secs,
+            num_lat ? sum / num_lat : 0,
+            num_lat ? lat_ms[num_lat * 99 / 100] : 0,
+            num_lat ? lat_ms[num_lat - 1] : 0,
+            failed);
+
+     free(evs);
+     free(lat_ms);
+     free(conns);
+     return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
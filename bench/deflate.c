@@ -0,0 +1,145 @@
+/*
+ * CPU cost of permessage-deflate against the bytes it saves, for JSON
+ * messages of the kind backends send: objects of a few fields, numbers
+ * changing from message to message. For message sizes from a tweet to
+ * a page, reports deflating and inflating time per message and the
+ * compressed size relative to the plain payload, at zlib levels 1, 6
+ * and 9, with the LZ77 window carried over from message to message and
+ * without (server_no_context_takeover). Uses the same calls as wsd.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+#include "sktable.h"
+#include "pmd.h"
+
+#define NUM_MSGS     2000     /* Distinct messages per size             */
+#define ROUNDS       2        /* Passes over them                       */
+#define MAX_MSG_LEN  8192
+
+sktable_t sk_table;
+const wsd_config_t *wsd_cfg = NULL;
+int epfd = -1;
+unsigned int wsd_errno = WSD_CHECKERRNO;
+
+static const unsigned int sizes[] = { 192, 1024, 8192 };
+static const int levels[] = { 1, 6, 9 };
+
+static double
+elapsed_ns(const struct timespec *start, const struct timespec *end)
+{
+     return (end->tv_sec - start->tv_sec) * 1e9
+          + (end->tv_nsec - start->tv_nsec);
+}
+
+/* Array of telemetry records, cut to about len bytes */
+static unsigned int
+make_msg(char *dst, unsigned int len, unsigned int seed)
+{
+     unsigned int n = snprintf(dst, len, "{\"id\":%u,\"points\":[", seed);
+     for (unsigned int i = 0; n + 96 < len; i++) {
+          seed = seed * 1103515245 + 12345;
+          n += snprintf(&dst[n],
+                        len - n,
+                        "%s{\"ts\":%u,\"sensor\":\"temp-%u\","
+                        "\"value\":%u.%u,\"ok\":true}",
+                        i ? "," : "",
+                        1586000000 + i,
+                        seed % 16,
+                        seed % 100,
+                        (seed >> 8) % 10);
+     }
+     n += snprintf(&dst[n], len - n, "]}");
+     return n;
+}
+
+static void
+run(char **msgs, unsigned int *lens, int level, bool nct)
+{
+     pmd_params_t params;
+     memset(&params, 0, sizeof(params));
+     params.server_no_context_takeover = nct;
+     pmd_init(level, PMD_FULL);
+     pmd_t *server = pmd_alloc(&params, true);
+     pmd_t *client = pmd_alloc(&params, false);
+     AN(server);
+     AN(client);
+
+     unsigned long int plain = 0, deflated = 0;
+     double deflate_ns = 0, inflate_ns = 0;
+     char out[2 * MAX_MSG_LEN], back[MAX_MSG_LEN];
+     for (unsigned int r = 0; r < ROUNDS; r++) {
+          for (unsigned int i = 0; i < NUM_MSGS; i++) {
+               struct timespec start, mid, end;
+               A(sizeof(out) >= pmd_deflate_bound(server, lens[i]));
+
+               clock_gettime(CLOCK_MONOTONIC, &start);
+               long n = pmd_deflate(server,
+                                    msgs[i],
+                                    lens[i],
+                                    out,
+                                    sizeof(out),
+                                    true);
+               clock_gettime(CLOCK_MONOTONIC, &mid);
+               A(0 < n);
+
+               unsigned long int in = n, len = sizeof(back);
+               A(1 == pmd_inflate(client, out, &in, back, &len, true));
+               clock_gettime(CLOCK_MONOTONIC, &end);
+               A(lens[i] == len);
+
+               deflate_ns += elapsed_ns(&start, &mid);
+               inflate_ns += elapsed_ns(&mid, &end);
+               plain += lens[i];
+               deflated += n;
+          }
+     }
+
+     unsigned int num = ROUNDS * NUM_MSGS;
+     printf("%6d %6s %12.0f %12.0f %10.1f%% %10.1f\n",
+            level,
+            nct ? "no" : "yes",
+            deflate_ns / num,
+            inflate_ns / num,
+            100.0 * deflated / plain,
+            (double)(plain - deflated) / deflate_ns * 1e3);
+
+     pmd_free(server);
+     pmd_free(client);
+}
+
+int
+main()
+{
+     char **msgs = malloc(NUM_MSGS * sizeof(char*));
+     unsigned int *lens = malloc(NUM_MSGS * sizeof(unsigned int));
+     AN(msgs);
+     AN(lens);
+     for (unsigned int i = 0; i < NUM_MSGS; i++)
+          AN(msgs[i] = malloc(MAX_MSG_LEN));
+
+     for (unsigned int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+          unsigned long int total = 0;
+          for (unsigned int i = 0; i < NUM_MSGS; i++)
+               total += lens[i] = make_msg(msgs[i], sizes[s], i);
+
+          printf("%s%lu byte messages\n", s ? "\n" : "", total / NUM_MSGS);
+          printf("%6s %6s %12s %12s %11s %10s\n",
+                 "level", "window", "deflate ns", "inflate ns", "size",
+                 "MB saved/s");
+          for (unsigned int l = 0; l < sizeof(levels) / sizeof(levels[0]); l++) {
+               run(msgs, lens, levels[l], false);
+               run(msgs, lens, levels[l], true);
+          }
+     }
+
+     for (unsigned int i = 0; i < NUM_MSGS; i++)
+          free(msgs[i]);
+     free(msgs);
+     free(lens);
+     return 0;
+}
@@ -0,0 +1,159 @@
+/*
+ * Cost of records on the backend link, full PP2 ones against compact
+ * ones (see -s). Encodes small messages from a number of websockets
+ * round robin into the send buffer of the link, then decodes them as if
+ * the backend had echoed them, and reports nanoseconds per message to
+ * encode and to decode and octets per message on the link. Connections
+ * had their full record before compact ones are timed. Uses the same
+ * calls as wsd.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "common.h"
+#include "sktable.h"
+#include "pp2.h"
+#include "ws.h"
+
+#define NUM_CONNS    64
+#define MSG_LEN      32
+#define ROUNDS       200
+
+sktable_t sk_table;
+const wsd_config_t *wsd_cfg = NULL;
+int epfd = -1;
+unsigned int wsd_errno = WSD_CHECKERRNO;
+
+extern sk_t *pp2sk;
+
+static double
+elapsed_ns(const struct timespec *start, const struct timespec *end)
+{
+     return (end->tv_sec - start->tv_sec) * 1e9
+          + (end->tv_nsec - start->tv_nsec);
+}
+
+static sk_t *
+open_sk()
+{
+     int sv[2];
+     AZ(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv));
+     sk_t *sk = sk_alloc();
+     AN(sk);
+     AZ(sk_init(sk, sv[0], 0ULL, SKB_SIZE));
+     sk->events = EPOLLIN | EPOLLOUT;
+     AZ(register_for_events(sk));
+     return sk;
+}
+
+/* Stands in for the websocket; takes the payload off the link */
+static int
+drop_frame(sk_t *sk, wsframe_t *wsf)
+{
+     (void)sk;
+     pp2sk->recvbuf->rdpos += wsf->payload_len;
+     return 0;
+}
+
+/* Encodes a message from every connection until the link is full */
+static unsigned long int
+encode(sk_t **conns, const char *msg)
+{
+     wsframe_t wsf;
+     memset(&wsf, 0, sizeof(wsf));
+     wsf.byte1 = (char)(0x80 | WS_TEXT_FRAME);
+     wsf.payload = msg;
+     wsf.payload_len = MSG_LEN;
+
+     unsigned long int n = 0;
+     for (;;) {
+          for (unsigned int i = 0; i < NUM_CONNS; i++, n++) {
+               if (0 > pp2_encode_frame(conns[i], &wsf))
+                    return n;
+          }
+     }
+}
+
+/* Decodes what was encoded, as if echoed */
+static void
+decode()
+{
+     skb_t *b = pp2sk->sendbuf;
+     skb_reset(pp2sk->recvbuf);
+     skb_copy(pp2sk->recvbuf, b, skb_rdsz(b));
+     skb_reset(b);
+     while (0 == pp2_decode_frame(pp2sk))
+          ;
+     AZ(skb_rdsz(pp2sk->recvbuf));
+}
+
+static void
+run(const char *name, sk_t **conns, const char *msg)
+{
+     /* Warm up; any switch of format goes out here */
+     encode(conns, msg);
+     decode();
+
+     double enc_ns = 0, dec_ns = 0;
+     unsigned long int msgs = 0, octets = 0;
+     struct timespec start, end;
+     for (unsigned int r = 0; r < ROUNDS; r++) {
+          clock_gettime(CLOCK_MONOTONIC, &start);
+          msgs += encode(conns, msg);
+          clock_gettime(CLOCK_MONOTONIC, &end);
+          enc_ns += elapsed_ns(&start, &end);
+          octets += skb_rdsz(pp2sk->sendbuf);
+
+          clock_gettime(CLOCK_MONOTONIC, &start);
+          decode();
+          clock_gettime(CLOCK_MONOTONIC, &end);
+          dec_ns += elapsed_ns(&start, &end);
+     }
+
+     printf("%8s %10.1f %10.1f %8.1f\n",
+            name,
+            enc_ns / msgs,
+            dec_ns / msgs,
+            (double)octets / msgs);
+}
+
+int
+main()
+{
+     wsd_config_t cfg;
+     memset(&cfg, 0, sizeof(cfg));
+     cfg.compact_link = true;
+     wsd_cfg = &cfg;
+     epfd = epoll_create(1);
+     A(0 <= epfd);
+     AZ(sktable_init(&sk_table, 2 * NUM_CONNS));
+
+     pp2sk = open_sk();
+     sk_t *conns[NUM_CONNS];
+     for (unsigned int i = 0; i < NUM_CONNS; i++) {
+          conns[i] = open_sk();
+          conns[i]->proto->encode_frame = drop_frame;
+          AN((conns[i]->ctlbuf = skb_alloc(SKB_CTL_SIZE)));
+          AZ(sktable_add(&sk_table, conns[i]));
+     }
+
+     char msg[MSG_LEN];
+     memset(msg, 'x', sizeof(msg));
+
+     printf("%u connections, %u byte messages\n", NUM_CONNS, MSG_LEN);
+     printf("%8s %10s %10s %8s\n", "format", "encode ns", "decode ns", "octets");
+     run("full", conns, msg);
+
+     /* Backend agrees to compact records */
+     pp2_put_local(pp2sk->recvbuf, PP2_TYPE_COMPACT, "", 0);
+     AZ(pp2_decode_frame(pp2sk));
+     run("compact", conns, msg);
+
+     return 0;
+}
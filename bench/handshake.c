@@ -0,0 +1,166 @@
+/*
+ * Opening handshakes per second and core: parsing the upgrade request
+ * and writing the 101 response into the send buffer, without the I/O.
+ * The Sec-WebSocket-Accept value on its own is measured as computed
+ * before, OpenSSL's SHA1() and a base64 BIO chain per handshake, iff
+ * OpenSSL is found, and with each implementation of sha1() the CPU
+ * supports.
+ */
+
+#include "config.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <assert.h>
+#include <sys/socket.h>
+
+#ifdef HAVE_LIBSSL
+#include <openssl/sha.h>
+#include <openssl/bio.h>
+#include <openssl/evp.h>
+#include <openssl/buffer.h>
+#endif
+
+#include "common.h"
+#include "sktable.h"
+#include "parser.h"
+#include "sha1.h"
+#include "ws.h"
+#include "ws_wsd.h"
+
+#define NUM_ACCEPTS    1000000
+#define NUM_HANDSHAKES 1000000
+
+#define REQUEST                                         \
+     "GET /chat HTTP/1.1\r\n"                           \
+     "Host: localhost\r\n"                              \
+     "Upgrade: websocket\r\n"                           \
+     "Connection: Upgrade\r\n"                          \
+     "Origin: http://localhost\r\n"                     \
+     "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"  \
+     "Sec-WebSocket-Version: 13\r\n\r\n"
+
+sktable_t sk_table;
+const wsd_config_t *wsd_cfg = NULL;
+int epfd = -1;
+unsigned int wsd_errno = WSD_CHECKERRNO;
+
+static double
+elapsed_ns(const struct timespec *start, const struct timespec *end)
+{
+     return (end->tv_sec - start->tv_sec) * 1e9
+          + (end->tv_nsec - start->tv_nsec);
+}
+
+#ifdef HAVE_LIBSSL
+/* As ws_wsd.c used to */
+static int
+accept_val_bio(char *dst, const chunk_t *key)
+{
+     char scratch[64];
+     memset(scratch, 0, sizeof(scratch));
+     strncpy(scratch, key->p, key->len);
+     strcpy(scratch + key->len, WS_GUID);
+
+     unsigned char *md = SHA1((unsigned char*)scratch, strlen(scratch), NULL);
+     A(md);
+
+     BIO *bio, *b64;
+     BUF_MEM *p;
+     b64 = BIO_new(BIO_f_base64());
+     bio = BIO_new(BIO_s_mem());
+     b64 = BIO_push(b64, bio);
+     BIO_write(b64, md, SHA_DIGEST_LENGTH);
+     (void)BIO_flush(b64);
+     BIO_get_mem_ptr(b64, &p);
+     memcpy(dst, p->data, p->length - 1);
+     BIO_free_all(b64);
+
+     return 0;
+}
+#endif /* #ifdef HAVE_LIBSSL */
+
+static double
+measure_accept(int (*accept_val)(char *dst, const chunk_t *key))
+{
+     chunk_t key;
+     key.p = "dGhlIHNhbXBsZSBub25jZQ==";
+     key.len = strlen(key.p);
+     char val[WS_ACCEPT_KEY_LEN + 1];
+     memset(val, 0, sizeof(val));
+
+     struct timespec start, end;
+     clock_gettime(CLOCK_MONOTONIC, &start);
+     for (unsigned int i = 0; i < NUM_ACCEPTS; i++)
+          AZ(accept_val(val, &key));
+     clock_gettime(CLOCK_MONOTONIC, &end);
+     A(0 == strcmp("s3pPLMBiTxaQ9kYGzzhZRbK+xOo=", val));
+
+     return elapsed_ns(&start, &end) / NUM_ACCEPTS;
+}
+
+static double
+measure_handshakes(sk_t *sk)
+{
+     char req[] = REQUEST;
+     http_parser_t hp;
+
+     struct timespec start, end;
+     clock_gettime(CLOCK_MONOTONIC, &start);
+     for (unsigned int i = 0; i < NUM_HANDSHAKES; i++) {
+          memset(&hp, 0, sizeof(http_parser_t));
+          A(sizeof(req) - 1 == http_parse(&hp, req, sizeof(req) - 1));
+          AZ(ws_decode_handshake(sk, &hp.req));
+          A(0 == strncmp(sk->sendbuf->data, "HTTP/1.1 101", 12));
+          skb_reset(sk->sendbuf);
+     }
+     clock_gettime(CLOCK_MONOTONIC, &end);
+
+     return NUM_HANDSHAKES / (elapsed_ns(&start, &end) / 1e9);
+}
+
+int
+main()
+{
+     wsd_config_t cfg;
+     memset(&cfg, 0, sizeof(cfg));
+     wsd_cfg = &cfg;
+     AZ(ws_wsd_init(wsd_cfg));
+
+     epfd = epoll_create(1);
+     A(0 <= epfd);
+
+     int sv[2];
+     AZ(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv));
+     sk_t *sk = sk_alloc();
+     AN(sk);
+     AZ(sk_init(sk, sv[0], 0ULL, SKB_HANDSHAKE_SIZE));
+     AZ(register_for_events(sk));
+
+     const char *impls[] = { "scalar", "sha-ni" };
+     printf("%-16s %12s %14s\n", "sha1", "accept ns", "handshakes/s");
+#ifdef HAVE_LIBSSL
+     printf("%-16s %12.1f %14s\n",
+            "openssl+bio",
+            measure_accept(accept_val_bio),
+            "n/a");
+#endif
+     for (unsigned int i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+          if (0 > sha1_select(i)) {
+               printf("%-16s %12s %14s\n", impls[i], "n/a", "n/a");
+               continue;
+          }
+          printf("%-16s %12.1f %14.0f\n",
+                 impls[i],
+                 measure_accept(ws_accept_val),
+                 measure_handshakes(sk));
+     }
+
+     sk_destroy(sk);
+     free(sk);
+     close(sv[0]);
+     close(sv[1]);
+     return 0;
+}
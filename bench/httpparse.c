@@ -0,0 +1,251 @@
+/*
+ * Parsing cost per upgrade request for the browser samples in test/,
+ * received whole or in segments of 64, 16 and 1 byte(s). The previous
+ * way, rescanning for the empty line on every read and tokenising once
+ * it arrived, is measured alongside the incremental parser, which is
+ * run with each implementation of http_span() the CPU supports.
+ * Then, per header line, the cost of resolving field names against
+ * the chain of comparisons it used to take and the hash it takes now.
+ *
+ * Usage: httpparse [sample directory]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <assert.h>
+
+#include "common.h"
+#include "parser.h"
+
+#define NUM_SAMPLES 7
+#define NUM_FIELDS  32
+#define WORK        (4 << 20)  /* Bytes to parse per measurement */
+
+const wsd_config_t *wsd_cfg = NULL;
+int epfd = -1;
+unsigned int wsd_errno = WSD_CHECKERRNO;
+
+static char *samples[] = {
+     "safari-9.1.1-varnish-4.1.3-sample",
+     "safari-9.1.1-sample",
+     "firefox-47-varnish-4.1.3-sample",
+     "firefox-47-sample",
+     "firefox-60-varnish-6.2.0-sample",
+     "chrome-51-varnish-4.1.3-sample",
+     "chrome-51-sample"
+};
+
+static double
+elapsed_ns(const struct timespec *start, const struct timespec *end)
+{
+     return (end->tv_sec - start->tv_sec) * 1e9
+          + (end->tv_nsec - start->tv_nsec);
+}
+
+/* As parse_header_field() used to */
+#define ASSIGN(to)                              \
+     to.p = tok->p + len;                       \
+     to.len = tok->len - len;
+
+#define CMP(to, to_len)                         \
+     (0 == strncasecmp(tok->p, to, to_len))
+
+static int
+parse_header_field_chain(chunk_t *tok, http_req_t *req)
+{
+     char *cur = tok->p;
+     while (':' != *cur++);
+
+     int len = cur - tok->p;
+     if (CMP("Host", 4)) {
+          ASSIGN(req->host);
+          return 1;
+     } else if (CMP("Upgrade", 7)) {
+          ASSIGN(req->upgrade);
+          return 1;
+     } else if (CMP("Connection", 10)) {
+          if (0 == req->conn.len) {
+               ASSIGN(req->conn);
+          } else {
+               ASSIGN(req->conn2);
+          }
+          return 1;
+     } else if (CMP("Sec-WebSocket-Key", 17)) {
+          ASSIGN(req->sec_ws_key);
+          return 1;
+     } else if (CMP("Sec-WebSocket-Version", 21)) {
+          ASSIGN(req->sec_ws_ver);
+          return 1;
+     } else if (CMP("Sec-WebSocket-Protocol", 22)) {
+          ASSIGN(req->sec_ws_proto);
+          return 1;
+     } else if (CMP("Sec-WebSocket-Extensions", 24)) {
+          ASSIGN(req->sec_ws_ext);
+          return 1;
+     } else if (CMP("Origin", 6)) {
+          ASSIGN(req->origin);
+          return 1;
+     } else if (CMP("User-Agent", 10)) {
+          ASSIGN(req->user_agent);
+          return 1;
+     }
+
+     return 0;
+}
+
+static double
+measure_fields(int (*parse)(chunk_t *tok, http_req_t *req),
+               chunk_t *fields,
+               unsigned int n)
+{
+     unsigned int reps = WORK / 64;
+     http_req_t req;
+     struct timespec start, end;
+     clock_gettime(CLOCK_MONOTONIC, &start);
+     for (unsigned int i = 0; i < reps; i++) {
+          memset(&req, 0, sizeof(http_req_t));
+          for (unsigned int j = 0; j < n; j++)
+               A(0 <= parse(&fields[j], &req));
+     }
+     clock_gettime(CLOCK_MONOTONIC, &end);
+     return elapsed_ns(&start, &end) / reps / n;
+}
+
+static int
+parse_rescan(skb_t *b, unsigned int n, unsigned int seg)
+{
+     http_req_t req;
+     b->rdpos = 0;
+     for (b->wrpos = seg < n ? seg : n; ; b->wrpos += seg) {
+          if (b->wrpos > n)
+               b->wrpos = n;
+          if (has_rnrn_termination(b))
+               break;
+     }
+
+     chunk_t t;
+     memset(&req, 0, sizeof(http_req_t));
+     if (0 > http_header_tok(b->data, &t) || 0 > parse_request_line(&t, &req))
+          return (-1);
+     while (0 < http_header_tok(NULL, &t))
+          parse_header_field(&t, &req);
+
+     return req.sec_ws_key.len;
+}
+
+static int
+parse_incremental(skb_t *b, unsigned int n, unsigned int seg)
+{
+     http_parser_t hp;
+     memset(&hp, 0, sizeof(http_parser_t));
+     for (unsigned int len = seg < n ? seg : n; ; len += seg) {
+          if (len > n)
+               len = n;
+          if (0 < http_parse(&hp, b->data, len))
+               break;
+          if (WSD_EINPUT != wsd_errno)
+               return (-1);
+     }
+
+     return hp.req.sec_ws_key.len;
+}
+
+static double
+measure(int (*parse)(skb_t *b, unsigned int n, unsigned int seg),
+        skb_t *b,
+        unsigned int n,
+        unsigned int seg)
+{
+     unsigned int reps = WORK / n;
+     struct timespec start, end;
+     clock_gettime(CLOCK_MONOTONIC, &start);
+     for (unsigned int i = 0; i < reps; i++)
+          A(0 < parse(b, n, seg));
+     clock_gettime(CLOCK_MONOTONIC, &end);
+     return elapsed_ns(&start, &end) / reps;
+}
+
+int
+main(int argc, char **argv)
+{
+     const char *dir = 1 < argc ? argv[1] : SAMPLE_DIR;
+     unsigned int segs[] = { 0, 64, 16, 1 };
+
+     static chunk_t fields[NUM_SAMPLES][NUM_FIELDS];
+     unsigned int num_fields[NUM_SAMPLES];
+
+     const char *impls[] = { "scalar ns", "sse4.2 ns", "avx2 ns" };
+     printf("%-36s %5s %10s", "sample", "seg", "rescan ns");
+     for (unsigned int k = 0; k < sizeof(impls) / sizeof(impls[0]); k++)
+          printf(" %10s", impls[k]);
+     printf(" %12s\n", "best req/s");
+     for (unsigned int i = 0; i < NUM_SAMPLES; i++) {
+          char path[4096];
+          snprintf(path, sizeof(path), "%s/%s", dir, samples[i]);
+          int fd = open(path, O_RDONLY);
+          if (0 > fd) {
+               perror(path);
+               exit(EXIT_FAILURE);
+          }
+          /* Kept to the end; fields point into it */
+          skb_t *b = skb_alloc(SKB_HANDSHAKE_SIZE);
+          AN(b);
+          int n = read(fd, b->data, b->size - 1);
+          A(0 < n);
+          b->data[n] = '\0';
+          close(fd);
+
+          http_parser_t hp;
+          memset(&hp, 0, sizeof(http_parser_t));
+          A(n == http_parse(&hp, b->data, n));
+          unsigned int num = 0;
+          char *line = strstr(b->data, "\r\n") + 2;
+          for (char *end; num < NUM_FIELDS
+                    && (end = strstr(line, "\r\n")) != line; line = end + 2) {
+               fields[i][num].p = line;
+               fields[i][num++].len = end - line;
+          }
+          num_fields[i] = num;
+
+          for (unsigned int j = 0; j < sizeof(segs) / sizeof(segs[0]); j++) {
+               unsigned int seg = segs[j] ? segs[j] : (unsigned int)n;
+               printf("%-36s %5u %10.0f",
+                      samples[i],
+                      seg,
+                      measure(parse_rescan, b, n, seg));
+
+               double best = 0;
+               for (unsigned int k = 0; k < sizeof(impls) / sizeof(impls[0]); k++) {
+                    if (0 > http_span_select(k)) {
+                         printf(" %10s", "n/a");
+                         continue;
+                    }
+                    double incr = measure(parse_incremental, b, n, seg);
+                    if (0 == best || incr < best)
+                         best = incr;
+                    printf(" %10.0f", incr);
+               }
+               printf(" %12.0f\n", 1e9 / best);
+          }
+     }
+
+     printf("\n%-36s %7s %14s %14s\n",
+            "sample", "fields", "chain ns/field", "hash ns/field");
+     for (unsigned int i = 0; i < NUM_SAMPLES; i++)
+          printf("%-36s %7u %14.1f %14.1f\n",
+                 samples[i],
+                 num_fields[i],
+                 measure_fields(parse_header_field_chain,
+                                fields[i],
+                                num_fields[i]),
+                 measure_fields(parse_header_field,
+                                fields[i],
+                                num_fields[i]));
+
+     return 0;
+}
@@ -0,0 +1,156 @@
+/*
+ * Memory that permessage-deflate takes per connection in each of wsd's
+ * memory modes (see -Z), for clients offering what browsers do. Sets up
+ * a few thousand connections and reports the bytes held per connection
+ * once agreed on, once each has received and sent a message of JSON,
+ * once released for being idle (see -r) and once woken up by another
+ * message, with the time to deflate those messages and their size
+ * relative to the plain payload. Uses the same calls as wsd.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+#include "sktable.h"
+#include "pmd.h"
+
+#define NUM_CONNS    4000
+#define MSG_LEN      1024
+#define OFFER        "permessage-deflate; client_max_window_bits"
+
+sktable_t sk_table;
+const wsd_config_t *wsd_cfg = NULL;
+int epfd = -1;
+unsigned int wsd_errno = WSD_CHECKERRNO;
+
+static const char *names[] = { "full", "lean", "shared" };
+
+static double
+elapsed_ns(const struct timespec *start, const struct timespec *end)
+{
+     return (end->tv_sec - start->tv_sec) * 1e9
+          + (end->tv_nsec - start->tv_nsec);
+}
+
+/* Array of telemetry records, cut to about len bytes */
+static unsigned int
+make_msg(char *dst, unsigned int len, unsigned int seed)
+{
+     unsigned int n = snprintf(dst, len, "{\"id\":%u,\"points\":[", seed);
+     for (unsigned int i = 0; n + 96 < len; i++) {
+          seed = seed * 1103515245 + 12345;
+          n += snprintf(&dst[n],
+                        len - n,
+                        "%s{\"ts\":%u,\"sensor\":\"temp-%u\","
+                        "\"value\":%u.%u,\"ok\":true}",
+                        i ? "," : "",
+                        1586000000 + i,
+                        seed % 16,
+                        seed % 100,
+                        (seed >> 8) % 10);
+     }
+     n += snprintf(&dst[n], len - n, "]}");
+     return n;
+}
+
+/* Deflates a message to every connection; returns ns per message */
+static double
+send_all(pmd_t **conns,
+         const char *msg,
+         unsigned int len,
+         unsigned long int *deflated)
+{
+     char out[2 * MSG_LEN];
+     struct timespec start, end;
+     clock_gettime(CLOCK_MONOTONIC, &start);
+     for (unsigned int i = 0; i < NUM_CONNS; i++) {
+          A(sizeof(out) >= pmd_deflate_bound(conns[i], len));
+          long n = pmd_deflate(conns[i], msg, len, out, sizeof(out), true);
+          A(0 < n);
+          *deflated += n;
+     }
+     clock_gettime(CLOCK_MONOTONIC, &end);
+     return elapsed_ns(&start, &end) / NUM_CONNS;
+}
+
+static unsigned long int
+per_conn(unsigned long int base)
+{
+     return (pmd_mem(NULL) - base) / NUM_CONNS;
+}
+
+static void
+run(int mode, pmd_t **conns, const char *msg, unsigned int len)
+{
+     pmd_init(6, mode);
+
+     pmd_params_t params;
+     chunk_t ext = { OFFER, strlen(OFFER) };
+     AZ(pmd_negotiate(&ext, true, &params));
+
+     /* What the client sends, deflated as agreed on */
+     char in[2 * MSG_LEN];
+     pmd_t *client = pmd_alloc(&params, false);
+     AN(client);
+     long in_len = pmd_deflate(client, msg, len, in, sizeof(in), true);
+     A(0 < in_len);
+     pmd_free(client);
+
+     unsigned long int base = pmd_mem(NULL);
+     for (unsigned int i = 0; i < NUM_CONNS; i++)
+          AN(conns[i] = pmd_alloc(&params, true));
+     unsigned long int agreed = per_conn(base);
+
+     for (unsigned int i = 0; i < NUM_CONNS; i++) {
+          char out[MSG_LEN + 1];
+          unsigned long int n = in_len, out_len = sizeof(out);
+          A(1 == pmd_inflate(conns[i], in, &n, out, &out_len, true));
+          A(len == out_len);
+     }
+     unsigned long int deflated = 0;
+     double ns = send_all(conns, msg, len, &deflated);
+     unsigned long int active = per_conn(base);
+
+     for (unsigned int i = 0; i < NUM_CONNS; i++)
+          pmd_release(conns[i]);
+     unsigned long int idle = per_conn(base);
+
+     ns += send_all(conns, msg, len, &deflated);
+     unsigned long int woken = per_conn(base);
+
+     printf("%8s %8lu %8lu %8lu %8lu %10.0f %7.1f%%\n",
+            names[mode],
+            agreed,
+            active,
+            idle,
+            woken,
+            ns / 2,
+            100.0 * deflated / (2.0 * len * NUM_CONNS));
+
+     for (unsigned int i = 0; i < NUM_CONNS; i++)
+          pmd_free(conns[i]);
+}
+
+int
+main()
+{
+     pmd_t **conns = malloc(NUM_CONNS * sizeof(pmd_t*));
+     char msg[MSG_LEN];
+     AN(conns);
+     unsigned int len = make_msg(msg, sizeof(msg), 42);
+
+     printf("%u connections, %u byte messages; bytes per connection\n",
+            NUM_CONNS,
+            len);
+     printf("%8s %8s %8s %8s %8s %10s %8s\n",
+            "mode", "agreed", "active", "idle", "woken", "deflate ns", "size");
+     run(PMD_FULL, conns, msg, len);
+     run(PMD_LEAN, conns, msg, len);
+     run(PMD_SHARED, conns, msg, len);
+
+     free(conns);
+     return 0;
+}
@@ -0,0 +1,199 @@
+/*
+ * Cache misses per message on the path from a client socket becoming
+ * readable to its PP2 record in the backend's send buffer: the event
+ * handler, the read, and the websocket and PP2 frame codecs. Caches are
+ * flushed between rounds: with many connections a socket's state has
+ * long been evicted by the time its next message arrives. Counters come
+ * from perf_event_open(2) and are reported as n/a where unavailable,
+ * e.g. in a VM without a PMU or with perf_event_paranoid too high.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <assert.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "common.h"
+#include "sktable.h"
+#include "pp2.h"
+#include "ws.h"
+#include "ws_wsd.h"
+
+#define NUM_SK       512
+#define NUM_ROUNDS   64
+#define MSG_LEN      64
+#define FLUSH_SIZE   (64 << 20)
+
+extern sk_t *pp2sk;
+
+sktable_t sk_table;
+const wsd_config_t *wsd_cfg = NULL;
+int epfd = -1;
+unsigned int wsd_errno = WSD_CHECKERRNO;
+
+static int
+perf_open(unsigned int type, unsigned long long config)
+{
+     struct perf_event_attr attr;
+     memset(&attr, 0, sizeof(attr));
+     attr.size = sizeof(attr);
+     attr.type = type;
+     attr.config = config;
+     attr.disabled = 1;
+     attr.exclude_kernel = 1;
+     attr.exclude_hv = 1;
+     return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void
+perf_ctl(int fd, unsigned long req)
+{
+     if (0 <= fd)
+          AZ(ioctl(fd, req, 0));
+}
+
+static long long
+perf_read(int fd)
+{
+     long long n = 0;
+     if (0 > fd || sizeof(n) != read(fd, &n, sizeof(n)))
+          return (-1);
+     return n;
+}
+
+static void
+print_per_msg(long long n, unsigned long msgs)
+{
+     if (0 > n)
+          printf(" %16s", "n/a");
+     else
+          printf(" %16.2f", (double)n / msgs);
+}
+
+static int
+no_close(sk_t *sk __attribute__((unused)))
+{
+     A(0);
+     return (-1);
+}
+
+/* Processes input right away; wsd defers it to the next iteration */
+static int
+post_read(sk_t *sk)
+{
+     return sk->ops->recv(sk);
+}
+
+static sk_t *
+open_sk(int *peer)
+{
+     int sv[2];
+     AZ(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv));
+     sk_t *sk = sk_alloc();
+     AN(sk);
+     AZ(sk_init(sk, sv[0], 0ULL, SKB_SIZE));
+     sk->ops->close = no_close;
+     AZ(register_for_events(sk));
+     *peer = sv[1];
+     return sk;
+}
+
+int
+main()
+{
+     wsd_config_t cfg;
+     memset(&cfg, 0, sizeof(cfg));
+     wsd_cfg = &cfg;
+
+     epfd = epoll_create(1);
+     A(0 <= epfd);
+
+     int pp2peer;
+     pp2sk = open_sk(&pp2peer);
+     pp2sk->proto->encode_frame = pp2_encode_frame;
+
+     static sk_t *sks[NUM_SK];
+     static int peers[NUM_SK];
+     for (unsigned int i = 0; i < NUM_SK; i++) {
+          sks[i] = open_sk(&peers[i]);
+          sks[i]->hash = i;
+          sks[i]->ops->recv = ws_recv;
+          sks[i]->proto->decode_frame = ws_decode_frame;
+     }
+
+     /* Handle sockets in random order, as epoll would hand them out */
+     unsigned int order[NUM_SK], k = 12345;
+     for (unsigned int i = 0; i < NUM_SK; i++)
+          order[i] = i;
+     for (unsigned int i = NUM_SK - 1; i > 0; i--) {
+          k = k * 1103515245 + 12345;
+          unsigned int j = k % (i + 1), t = order[i];
+          order[i] = order[j];
+          order[j] = t;
+     }
+
+     /* Masked text frame; see section 5.2 RFC6455 */
+     char frame[2 + 4 + MSG_LEN];
+     frame[0] = (char)0x81;
+     frame[1] = (char)(0x80 | MSG_LEN);
+     unsigned int key = 0x1a2b3c4d;
+     memcpy(&frame[2], &key, sizeof(key));
+     for (unsigned int i = 0; i < MSG_LEN; i++)
+          frame[6 + i] = mask('a' + i % 26, i, key);
+
+     char *flush = malloc(FLUSH_SIZE);
+     AN(flush);
+
+     int misses = perf_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+     int l1d = perf_open(PERF_TYPE_HW_CACHE,
+                         PERF_COUNT_HW_CACHE_L1D
+                         | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                         | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+
+     struct timespec start, end;
+     double ns = 0;
+     for (unsigned int r = 0; r < NUM_ROUNDS; r++) {
+          for (unsigned int i = 0; i < NUM_SK; i++)
+               A(sizeof(frame) == write(peers[i], frame, sizeof(frame)));
+          memset(flush, r, FLUSH_SIZE);
+
+          perf_ctl(misses, PERF_EVENT_IOC_ENABLE);
+          perf_ctl(l1d, PERF_EVENT_IOC_ENABLE);
+          clock_gettime(CLOCK_MONOTONIC, &start);
+          for (unsigned int i = 0; i < NUM_SK; i++) {
+               struct epoll_event ev;
+               ev.events = EPOLLIN;
+               ev.data.ptr = sks[order[i]];
+               on_epoll_event(&ev, post_read);
+          }
+          clock_gettime(CLOCK_MONOTONIC, &end);
+          perf_ctl(misses, PERF_EVENT_IOC_DISABLE);
+          perf_ctl(l1d, PERF_EVENT_IOC_DISABLE);
+
+          ns += (end.tv_sec - start.tv_sec) * 1e9
+               + (end.tv_nsec - start.tv_nsec);
+          /* One PP2 record, 46 byte header plus payload, per message */
+          A(NUM_SK * (MSG_LEN + 46) == skb_rdsz(pp2sk->sendbuf));
+          skb_reset(pp2sk->sendbuf);
+     }
+
+     unsigned long msgs = (unsigned long)NUM_SK * NUM_ROUNDS;
+     printf("sizeof(sk_t) %zu, hot fields %zu bytes\n",
+            sizeof(sk_t),
+            offsetof(sk_t, ts_last_io));
+     printf("%10s %10s %16s %16s\n",
+            "conns", "ns/msg", "cache-misses/msg", "L1d-misses/msg");
+     printf("%10u %10.1f", NUM_SK, ns / msgs);
+     print_per_msg(perf_read(misses), msgs);
+     print_per_msg(perf_read(l1d), msgs);
+     printf("\n");
+
+     free(flush);
+     return 0;
+}
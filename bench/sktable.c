@@ -0,0 +1,128 @@
+/*
+ * Lookup cost of the socket table at 1k, 100k and 1M connections. For
+ * comparison, the 16 bucket chained table keyed by address derived ids
+ * it replaced is measured alongside, all clients from one source
+ * address as seen behind a load balancer (fewer lookups; its chains
+ * are long).
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+#include "sktable.h"
+
+#define NUM_LOOKUPS     4000000
+#define NUM_OLD_LOOKUPS 2000
+#define OLD_BITS        4
+
+unsigned int wsd_errno = WSD_CHECKERRNO;
+
+struct old_entry {
+     struct hlist_node node;
+     uint64_t          id;
+};
+
+static double
+elapsed_ns(const struct timespec *start, const struct timespec *end)
+{
+     return (end->tv_sec - start->tv_sec) * 1e9
+          + (end->tv_nsec - start->tv_nsec);
+}
+
+/* Mirrors the ids wsd used to hand out: address, port, clock bits */
+static uint64_t
+lb_id(unsigned int i)
+{
+     return (0x0a000001ULL << 32) | ((i & 0xffff) << 16) | (i >> 16);
+}
+
+static double
+bench_sktable(unsigned int n, sk_t *sks, double *add_ns)
+{
+     struct timespec start, end;
+     sktable_t t;
+     assert(0 == sktable_init(&t, 0));
+
+     clock_gettime(CLOCK_MONOTONIC, &start);
+     for (unsigned int i = 0; i < n; i++) {
+          sks[i].fd = i;
+          assert(0 == sktable_add(&t, &sks[i]));
+     }
+     clock_gettime(CLOCK_MONOTONIC, &end);
+     *add_ns = elapsed_ns(&start, &end) / n;
+
+     unsigned long found = 0;
+     unsigned int k = 12345;
+     clock_gettime(CLOCK_MONOTONIC, &start);
+     for (unsigned int i = 0; i < NUM_LOOKUPS; i++) {
+          k = k * 1103515245 + 12345;
+          found += (NULL != sktable_get(&t, sks[k % n].hash));
+     }
+     clock_gettime(CLOCK_MONOTONIC, &end);
+     assert(NUM_LOOKUPS == found);
+
+     sktable_free(&t);
+     return elapsed_ns(&start, &end) / NUM_LOOKUPS;
+}
+
+static double
+bench_old(unsigned int n)
+{
+     struct hlist_head buckets[1 << OLD_BITS];
+     memset(buckets, 0, sizeof(buckets));
+
+     struct old_entry *entries = calloc(n, sizeof(struct old_entry));
+     assert(entries);
+     for (unsigned int i = 0; i < n; i++) {
+          entries[i].id = lb_id(i);
+          hlist_add_head(&entries[i].node,
+                         &buckets[entries[i].id >> (64 - OLD_BITS)]);
+     }
+
+     struct timespec start, end;
+     unsigned long found = 0;
+     unsigned int k = 12345;
+     clock_gettime(CLOCK_MONOTONIC, &start);
+     for (unsigned int i = 0; i < NUM_OLD_LOOKUPS; i++) {
+          k = k * 1103515245 + 12345;
+          uint64_t id = lb_id(k % n);
+          struct old_entry *pos;
+          hlist_for_each_entry(pos, &buckets[id >> (64 - OLD_BITS)], node) {
+               if (pos->id == id) {
+                    found++;
+                    break;
+               }
+          }
+     }
+     clock_gettime(CLOCK_MONOTONIC, &end);
+     assert(NUM_OLD_LOOKUPS == found);
+
+     free(entries);
+     return elapsed_ns(&start, &end) / NUM_OLD_LOOKUPS;
+}
+
+int
+main()
+{
+     unsigned int sizes[] = { 1000, 100000, 1000000 };
+
+     sk_t *sks = calloc(1000000, sizeof(sk_t));
+     assert(sks);
+
+     printf("%10s %14s %14s %14s\n",
+            "conns", "add ns/op", "get ns/op", "old get ns/op");
+     for (unsigned int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+          double add_ns;
+          double get_ns = bench_sktable(sizes[i], sks, &add_ns);
+          printf("%10u %14.1f %14.1f %14.1f\n",
+                 sizes[i],
+                 add_ns,
+                 get_ns,
+                 bench_old(sizes[i]));
+     }
+
+     free(sks);
+     return 0;
+}
@@ -0,0 +1,352 @@
+/*
+ * Latency of established websocket traffic while a running wsd weathers
+ * a reconnect storm. Keeps a number of websockets upgraded and pings
+ * them in turn, one at a time; wsd answers pings itself, so the round
+ * trip is the time the event loop takes to get around to them. Pings
+ * are timed for a while on a quiet server, then again while a child
+ * process opens, upgrades and resets the storm's connections, keeping a
+ * number in flight as connrate does. Run wsd with and without -w to
+ * compare. Listens on the port wsd multiplexes to and discards whatever
+ * wsd sends there.
+ *
+ * Usage: storm [port [forward port [established [storm [in flight]]]]]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define QUIET_PINGS 20000
+
+#define REQUEST                                         \
+     "GET /chat HTTP/1.1\r\n"                           \
+     "Host: localhost\r\n"                              \
+     "Upgrade: websocket\r\n"                           \
+     "Connection: Upgrade\r\n"                          \
+     "Origin: http://localhost\r\n"                     \
+     "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"  \
+     "Sec-WebSocket-Version: 13\r\n\r\n"
+
+/* Masked ping without payload; wsd answers with 0x8a 0x00 */
+static const unsigned char ping[] = { 0x89, 0x80, 0x01, 0x02, 0x03, 0x04 };
+
+struct conn {
+     int             fd;
+     unsigned int    len;
+     char            buf[512];
+};
+
+static struct sockaddr_in addr;
+
+static double
+elapsed_us(const struct timespec *start, const struct timespec *end)
+{
+     return (end->tv_sec - start->tv_sec) * 1e6
+          + (end->tv_nsec - start->tv_nsec) / 1e3;
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+     double x = *(const double*)a, y = *(const double*)b;
+     return (x > y) - (x < y);
+}
+
+static void
+die(const char *s)
+{
+     perror(s);
+     exit(EXIT_FAILURE);
+}
+
+/* Accepts and drains wsd's connections to the backend until killed */
+static void
+sink(int lfd)
+{
+     int efd = epoll_create(1);
+     struct epoll_event ev, evs[64];
+     ev.events = EPOLLIN;
+     ev.data.fd = lfd;
+     if (0 > efd || 0 > epoll_ctl(efd, EPOLL_CTL_ADD, lfd, &ev))
+          die("sink");
+
+     char buf[65536];
+     for (;;) {
+          int n = epoll_wait(efd, evs, 64, -1);
+          for (int i = 0; i < n; i++) {
+               if (evs[i].data.fd == lfd) {
+                    ev.data.fd = accept(lfd, NULL, NULL);
+                    if (0 <= ev.data.fd)
+                         epoll_ctl(efd, EPOLL_CTL_ADD, ev.data.fd, &ev);
+               } else if (0 >= read(evs[i].data.fd, buf, sizeof(buf))) {
+                    close(evs[i].data.fd);
+               }
+          }
+     }
+}
+
+static int
+upgrade(int fd)
+{
+     if (sizeof(REQUEST) - 1 != write(fd, REQUEST, sizeof(REQUEST) - 1))
+          return (-1);
+
+     char buf[512];
+     unsigned int len = 0;
+     while (len < sizeof(buf) - 1) {
+          ssize_t n = read(fd, &buf[len], sizeof(buf) - 1 - len);
+          if (0 >= n)
+               return (-1);
+          len += n;
+          buf[len] = '\0';
+          if (strstr(buf, "\r\n\r\n"))
+               return strncmp(buf, "HTTP/1.1 101", 12) ? -1 : 0;
+     }
+     return (-1);
+}
+
+/* Round trip of one ping in microseconds */
+static double
+round_trip(int fd)
+{
+     struct timespec start, end;
+     clock_gettime(CLOCK_MONOTONIC, &start);
+     if (sizeof(ping) != write(fd, ping, sizeof(ping)))
+          die("write");
+
+     /* Frames from wsd carry no payload; skip its own pings */
+     unsigned char frame[2];
+     do {
+          unsigned int len = 0;
+          while (len < sizeof(frame)) {
+               ssize_t n = read(fd, &frame[len], sizeof(frame) - len);
+               if (0 >= n)
+                    die("read");
+               len += n;
+          }
+     } while (0x8a != frame[0]);
+
+     clock_gettime(CLOCK_MONOTONIC, &end);
+     return elapsed_us(&start, &end);
+}
+
+static void
+conn_start(int epfd, struct conn *c)
+{
+     c->len = 0;
+     c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+     if (0 > c->fd)
+          die("socket");
+
+     struct linger l = { 1, 0 };
+     setsockopt(c->fd, SOL_SOCKET, SO_LINGER, &l, sizeof(l));
+
+     if (0 > connect(c->fd, (struct sockaddr *)&addr, sizeof(addr))
+         && EINPROGRESS != errno)
+          die("connect");
+
+     struct epoll_event ev;
+     ev.events = EPOLLOUT;
+     ev.data.ptr = c;
+     if (0 > epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev))
+          die("epoll_ctl");
+}
+
+/* Runs storm of connections, exiting with the number that failed */
+static void
+storm(unsigned int total, unsigned int parallel)
+{
+     int epfd = epoll_create(1);
+     struct conn *conns = calloc(parallel, sizeof(struct conn));
+     struct epoll_event *evs = calloc(parallel, sizeof(struct epoll_event));
+     if (0 > epfd || !conns || !evs)
+          die("storm");
+
+     unsigned int started = 0, in_flight = 0, failed = 0;
+     for (; in_flight < parallel; in_flight++, started++)
+          conn_start(epfd, &conns[in_flight]);
+
+     while (in_flight) {
+          int n = epoll_wait(epfd, evs, parallel, -1);
+          if (0 > n && EINTR == errno)
+               continue;
+          if (0 > n)
+               die("epoll_wait");
+
+          for (int i = 0; i < n; i++) {
+               struct conn *c = evs[i].data.ptr;
+               int ok = 0;
+               if (evs[i].events & (EPOLLERR | EPOLLHUP))
+                    goto done;
+
+               if (evs[i].events & EPOLLOUT) {
+                    if (sizeof(REQUEST) - 1
+                        != write(c->fd, REQUEST, sizeof(REQUEST) - 1))
+                         goto done;
+                    struct epoll_event ev;
+                    ev.events = EPOLLIN;
+                    ev.data.ptr = c;
+                    if (0 > epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev))
+                         die("epoll_ctl");
+                    continue;
+               }
+
+               ssize_t r = read(c->fd,
+                                &c->buf[c->len],
+                                sizeof(c->buf) - 1 - c->len);
+               if (0 > r && EAGAIN == errno)
+                    continue;
+               if (0 >= r)
+                    goto done;
+               c->len += r;
+               c->buf[c->len] = '\0';
+               if (!strstr(c->buf, "\r\n\r\n")) {
+                    if (sizeof(c->buf) - 1 > c->len)
+                         continue;
+                    goto done;
+               }
+               ok = 0 == strncmp(c->buf, "HTTP/1.1 101", 12);
+          done:
+               if (!ok)
+                    failed++;
+               close(c->fd);
+               if (started < total) {
+                    conn_start(epfd, c);
+                    started++;
+               } else {
+                    in_flight--;
+               }
+          }
+     }
+
+     exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+static void
+report(const char *what, double *rtt, unsigned int n)
+{
+     qsort(rtt, n, sizeof(double), cmp_double);
+     printf("%-8s %8u %9.1f %9.1f %9.1f %9.1f\n",
+            what,
+            n,
+            n ? rtt[n / 2] : 0,
+            n ? rtt[n * 99 / 100] : 0,
+            n ? rtt[n * 999 / 1000] : 0,
+            n ? rtt[n - 1] : 0);
+}
+
+int
+main(int argc, char **argv)
+{
+     int port = 1 < argc ? atoi(argv[1]) : 6084;
+     int fport = 2 < argc ? atoi(argv[2]) : 6085;
+     unsigned int established = 3 < argc ? atoi(argv[3]) : 100;
+     unsigned int total = 4 < argc ? atoi(argv[4]) : 50000;
+     unsigned int parallel = 5 < argc ? atoi(argv[5]) : 256;
+     if (0 == established || 0 == total || 0 == parallel) {
+          fprintf(stderr,
+                  "Usage: %s [port [forward port [established [storm "
+                  "[in flight]]]]]\n",
+                  argv[0]);
+          exit(EXIT_FAILURE);
+     }
+     if (parallel > total)
+          parallel = total;
+
+     struct rlimit rl;
+     if (0 == getrlimit(RLIMIT_NOFILE, &rl)) {
+          rl.rlim_cur = rl.rlim_max;
+          setrlimit(RLIMIT_NOFILE, &rl);
+     }
+
+     memset(&addr, 0, sizeof(addr));
+     addr.sin_family = AF_INET;
+     addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+     int lfd = socket(AF_INET, SOCK_STREAM, 0), on = 1;
+     setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+     addr.sin_port = htons(fport);
+     if (0 > lfd
+         || 0 > bind(lfd, (struct sockaddr *)&addr, sizeof(addr))
+         || 0 > listen(lfd, SOMAXCONN))
+          die("backend");
+
+     fflush(stdout);
+     pid_t sink_pid = fork();
+     if (0 > sink_pid)
+          die("fork");
+     if (0 == sink_pid)
+          sink(lfd);
+     close(lfd);
+
+     addr.sin_port = htons(port);
+     int *fds = calloc(established, sizeof(int));
+     if (!fds)
+          die(argv[0]);
+     for (unsigned int i = 0; i < established; i++) {
+          fds[i] = socket(AF_INET, SOCK_STREAM, 0);
+          setsockopt(fds[i], IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+          if (0 > fds[i]
+              || 0 > connect(fds[i], (struct sockaddr *)&addr, sizeof(addr))
+              || 0 > upgrade(fds[i]))
+               die("upgrade");
+     }
+
+     /* Generous; a storm slower than 1 ms per ping is a result in itself */
+     unsigned int size = QUIET_PINGS + 4 * total;
+     double *rtt = calloc(size, sizeof(double));
+     if (!rtt)
+          die(argv[0]);
+
+     printf("%-8s %8s %9s %9s %9s %9s\n",
+            "", "pings", "p50 us", "p99 us", "p99.9 us", "max us");
+
+     unsigned int n = 0;
+     for (; n < QUIET_PINGS; n++)
+          rtt[n] = round_trip(fds[n % established]);
+     report("quiet", rtt, n);
+
+     fflush(stdout);
+     struct timespec start, end;
+     clock_gettime(CLOCK_MONOTONIC, &start);
+     pid_t storm_pid = fork();
+     if (0 > storm_pid)
+          die("fork");
+     if (0 == storm_pid)
+          storm(total, parallel);
+
+     int status;
+     for (n = 0; n < size && 0 == waitpid(storm_pid, &status, WNOHANG); n++)
+          rtt[n] = round_trip(fds[n % established]);
+     if (n == size)
+          waitpid(storm_pid, &status, 0);
+     clock_gettime(CLOCK_MONOTONIC, &end);
+     report("storm", rtt, n);
+
+     double secs = elapsed_us(&start, &end) / 1e6;
+     printf("\nstorm: %u connections, %u in flight, %.0f conns/s%s\n",
+            total,
+            parallel,
+            total / secs,
+            WIFEXITED(status) && 0 == WEXITSTATUS(status)
+            ? "" : ", some failed");
+
+     kill(sink_pid, SIGTERM);
+     waitpid(sink_pid, NULL, 0);
+     for (unsigned int i = 0; i < established; i++)
+          close(fds[i]);
+     free(fds);
+     free(rtt);
+     return 0;
+}
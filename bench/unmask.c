@@ -0,0 +1,206 @@
+/*
+ * Cost of receiving large websocket frames that arrive in many reads:
+ * 256 KiB frames written to the client socket in 16 KiB segments, each
+ * segment handled as wsd would on the socket becoming readable. The
+ * "rescan" decoder is the one wsd used to have: it parses the header
+ * again on every read and, once the whole frame is in, unmasks the
+ * payload a byte at a time, by then long out of L1. wsd now parses the
+ * header once and unmasks every segment a word at a time right after
+ * reading it. Also reports unmasking throughput on its own.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/socket.h>
+
+#include "common.h"
+#include "sktable.h"
+#include "pp2.h"
+#include "ws.h"
+#include "ws_wsd.h"
+
+#define FRAME_LEN    (256 << 10)
+#define SEGMENT_LEN  (16 << 10)
+#define HEADER_LEN   14     /* 64 bit length plus masking key */
+#define NUM_FRAMES   2000
+
+extern sk_t *pp2sk;
+
+sktable_t sk_table;
+const wsd_config_t *wsd_cfg = NULL;
+int epfd = -1;
+unsigned int wsd_errno = WSD_CHECKERRNO;
+
+static int
+no_close(sk_t *sk __attribute__((unused)))
+{
+     A(0);
+     return (-1);
+}
+
+static int
+post_read(sk_t *sk)
+{
+     return sk->ops->recv(sk);
+}
+
+/* ws_decode_frame() as it was, data frames only */
+static int
+rescan_decode_frame(sk_t *sk)
+{
+     if (skb_rdsz(sk->recvbuf) < WS_MASKED_FRAME_LEN) {
+          wsd_errno = WSD_EINPUT;
+          return (-1);
+     }
+
+     unsigned int old_rdpos = sk->recvbuf->rdpos;
+
+     wsframe_t wsf;
+     memset(&wsf, 0, sizeof(wsframe_t));
+     skb_get(sk->recvbuf, wsf.byte1);
+     skb_get(sk->recvbuf, wsf.byte2);
+
+     wsf.payload_len = ws_decode_payload_len(sk->recvbuf, wsf.byte2);
+     if (ULONG_MAX == wsf.payload_len) {
+          skb_rd_reset(sk->recvbuf, old_rdpos);
+          return (-1);
+     }
+
+     if (sizeof(wsf.masking_key) > skb_rdsz(sk->recvbuf)) {
+          skb_rd_reset(sk->recvbuf, old_rdpos);
+          wsd_errno = WSD_EINPUT;
+          return (-1);
+     }
+     skb_get(sk->recvbuf, wsf.masking_key);
+
+     if (wsf.payload_len > skb_rdsz(sk->recvbuf)) {
+          sk->recvbuf->rdpos = old_rdpos;
+          wsd_errno = WSD_EINPUT;
+          return (-1);
+     }
+
+     unsigned int end = sk->recvbuf->rdpos + wsf.payload_len;
+     for (unsigned int i = sk->recvbuf->rdpos, j = 0; i < end; i++, j++)
+          sk->recvbuf->data[i] =
+               unmask(sk->recvbuf->data[i], j, wsf.masking_key);
+
+     return pp2sk->proto->encode_frame(sk, &wsf);
+}
+
+static sk_t *
+open_sk(int *peer)
+{
+     int sv[2];
+     AZ(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv));
+     sk_t *sk = sk_alloc();
+     AN(sk);
+     AZ(sk_init(sk, sv[0], 0ULL, SKB_SIZE));
+     sk->ops->close = no_close;
+     sk->ops->recv = ws_recv;
+     AZ(register_for_events(sk));
+     *peer = sv[1];
+     return sk;
+}
+
+static double
+elapsed_ns(const struct timespec *start, const struct timespec *end)
+{
+     return (end->tv_sec - start->tv_sec) * 1e9
+          + (end->tv_nsec - start->tv_nsec);
+}
+
+/* Nanoseconds per frame written segment by segment and received by sk */
+static double
+run(sk_t *sk, int peer, const char *frame, unsigned int len)
+{
+     struct timespec start, end;
+     clock_gettime(CLOCK_MONOTONIC, &start);
+     for (unsigned int n = 0; n < NUM_FRAMES; n++) {
+          for (unsigned int i = 0; i < len; i += SEGMENT_LEN) {
+               unsigned int k = len - i < SEGMENT_LEN ? len - i : SEGMENT_LEN;
+               A(k == write(peer, &frame[i], k));
+
+               struct epoll_event ev;
+               ev.events = EPOLLIN;
+               ev.data.ptr = sk;
+               on_epoll_event(&ev, post_read);
+          }
+
+          /* Backend gets the payload, in one or more PP2 records */
+          AZ(skb_rdsz(sk->recvbuf));
+          A(FRAME_LEN < skb_rdsz(pp2sk->sendbuf));
+          skb_reset(pp2sk->sendbuf);
+     }
+     clock_gettime(CLOCK_MONOTONIC, &end);
+
+     return elapsed_ns(&start, &end) / NUM_FRAMES;
+}
+
+int
+main()
+{
+     wsd_config_t cfg;
+     memset(&cfg, 0, sizeof(cfg));
+     wsd_cfg = &cfg;
+
+     epfd = epoll_create(1);
+     A(0 <= epfd);
+
+     int pp2peer;
+     pp2sk = open_sk(&pp2peer);
+     pp2sk->proto->encode_frame = pp2_encode_frame;
+
+     /* Masked binary frame with 64 bit length; see section 5.2 RFC6455 */
+     unsigned int len = HEADER_LEN + FRAME_LEN, key = 0x1a2b3c4d;
+     char *frame = malloc(len);
+     AN(frame);
+     frame[0] = (char)0x82;
+     frame[1] = (char)(0x80 | 127);
+     unsigned long int be_len = htobe64(FRAME_LEN);
+     memcpy(&frame[2], &be_len, sizeof(be_len));
+     memcpy(&frame[10], &key, sizeof(key));
+     for (unsigned int i = 0; i < FRAME_LEN; i++)
+          frame[HEADER_LEN + i] = mask('a' + i % 26, i, key);
+
+     int peer;
+     sk_t *sk = open_sk(&peer);
+
+     printf("%u byte frames in %u byte segments\n", FRAME_LEN, SEGMENT_LEN);
+     printf("%-12s %12s %12s\n", "", "us/frame", "MB/s");
+
+     sk->proto->decode_frame = rescan_decode_frame;
+     double ns = run(sk, peer, frame, len);
+     printf("%-12s %12.1f %12.1f\n", "rescan", ns / 1e3, FRAME_LEN / ns * 1e3);
+
+     sk->ops->read = ws_read;
+     sk->proto->decode_frame = ws_decode_frame;
+     ns = run(sk, peer, frame, len);
+     printf("%-12s %12.1f %12.1f\n", "incremental", ns / 1e3, FRAME_LEN / ns * 1e3);
+
+     /* Unmasking alone, over a payload in L1 */
+     char *p = &frame[HEADER_LEN];
+     struct timespec start, end;
+     printf("\n%-12s %12s %12s\n", "unmask", "us/16 KiB", "MB/s");
+
+     clock_gettime(CLOCK_MONOTONIC, &start);
+     for (unsigned int n = 0; n < NUM_FRAMES * 16; n++)
+          for (unsigned int i = 0; i < SEGMENT_LEN; i++)
+               p[i] = unmask(p[i], i, key);
+     clock_gettime(CLOCK_MONOTONIC, &end);
+     ns = elapsed_ns(&start, &end) / (NUM_FRAMES * 16);
+     printf("%-12s %12.2f %12.1f\n", "bytewise", ns / 1e3, SEGMENT_LEN / ns * 1e3);
+
+     clock_gettime(CLOCK_MONOTONIC, &start);
+     for (unsigned int n = 0; n < NUM_FRAMES * 16; n++)
+          ws_unmask(p, SEGMENT_LEN, key, n);
+     clock_gettime(CLOCK_MONOTONIC, &end);
+     ns = elapsed_ns(&start, &end) / (NUM_FRAMES * 16);
+     printf("%-12s %12.2f %12.1f\n", "ws_unmask", ns / 1e3, SEGMENT_LEN / ns * 1e3);
+
+     free(frame);
+     return 0;
+}
@@ -28,6 +28,7 @@
 
 #include "common.h"
 #include "ws.h"
+#include "pmd.h"
 
 #define MAX_EVENTS 256
 
@@ -38,12 +39,8 @@ extern const wsd_config_t *wsd_cfg;
 bool done = false;
 unsigned int num = 0;
 
-static int sk_read(sk_t *sk);
-static int sk_write(sk_t *sk);
-static int on_write(sk_t *sk, const struct timespec *now);
-static int on_read(sk_t *sk,
-                   int (*post_read)(sk_t *sk),
-                   const struct timespec *now);
+static int on_write(sk_t *sk);
+static int on_read(sk_t *sk, int (*post_read)(sk_t *sk));
 static int check_errno();
 
 inline void
@@ -78,6 +75,41 @@ register_for_events(sk_t *fd)
      return epoll_ctl(epfd, EPOLL_CTL_ADD, fd->fd, &ev);
 }
 
+/* Allocates empty buffer of size bytes; contents left uninitialised */
+skb_t *
+skb_alloc(unsigned int size)
+{
+     skb_t *b = malloc(sizeof(skb_t) + size);
+     if (!b) {
+          wsd_errno = WSD_ENOMEM;
+          return NULL;
+     }
+     b->rdpos = 0;
+     b->wrpos = 0;
+     b->size = size;
+     return b;
+}
+
+/* Resizes buffer, keeping unread bytes; *b is left as is on failure */
+int
+skb_resize(skb_t **b, unsigned int size)
+{
+     if (skb_rdsz((*b)) > size) {
+          wsd_errno = WSD_EINPUT;
+          return (-1);
+     }
+
+     skb_compact(*b);
+     skb_t *p = realloc(*b, sizeof(skb_t) + size);
+     if (!p) {
+          wsd_errno = WSD_ENOMEM;
+          return (-1);
+     }
+     p->size = size;
+     *b = p;
+     return 0;
+}
+
 inline void
 skb_compact(skb_t *b)
 {
@@ -123,8 +155,21 @@ skb_put_strn(skb_t *b, const char *s, size_t n) {
      return 0;
 }
 
+/* Allocates zeroed socket, aligned so its hot fields take two cache lines */
+sk_t *
+sk_alloc()
+{
+     sk_t *sk = aligned_alloc(CACHE_LINE_SIZE, sizeof(sk_t));
+     if (!sk) {
+          wsd_errno = WSD_ENOMEM;
+          return NULL;
+     }
+     memset(sk, 0, sizeof(sk_t));
+     return sk;
+}
+
 int
-sk_init(sk_t *sk, int fd, unsigned long int hash)
+sk_init(sk_t *sk, int fd, unsigned long int hash, unsigned int bufsize)
 {
      sk->proto = malloc(sizeof(struct proto));
      if (!sk->proto) {
@@ -140,19 +185,11 @@ sk_init(sk_t *sk, int fd, unsigned long int hash)
      }
      memset(sk->ops, 0, sizeof(struct ops));
 
-     sk->sendbuf = malloc(sizeof(skb_t));
-     if (!sk->sendbuf) {
-          wsd_errno = WSD_ENOMEM;
+     if (!(sk->sendbuf = skb_alloc(bufsize)))
           return (-1);
-     }
-     memset(sk->sendbuf, 0, sizeof(skb_t));
 
-     sk->recvbuf = malloc(sizeof(skb_t));
-     if (!sk->recvbuf) {
-          wsd_errno = WSD_ENOMEM;
+     if (!(sk->recvbuf = skb_alloc(bufsize)))
           return (-1);
-     }
-     memset(sk->recvbuf, 0, sizeof(skb_t));
      sk->hash = hash;
      sk->fd = fd;
      sk->events = EPOLLIN | EPOLLPRI | EPOLLRDHUP;
@@ -170,17 +207,34 @@ sk_destroy(sk_t *sk)
      if (sk->proto)
           free(sk->proto);
 
+     if (sk->sendbuf)
+          free(sk->sendbuf);
+
+     if (sk->recvbuf)
+          free(sk->recvbuf);
+
+     if (sk->ctlbuf)
+          free(sk->ctlbuf);
+
+     if (sk->hp)
+          free(sk->hp);
+
+     if (sk->pmd)
+          pmd_free(sk->pmd);
+
      memset(sk, 0, sizeof(sk_t));
 }
 
 int
-on_write(sk_t *sk, const struct timespec *now)
+on_write(sk_t *sk)
 {
      int rv = sk->ops->write(sk);
-     ts_last_io_set(sk, now);
+     sk->io = 1;
      if (0 > rv && wsd_errno != WSD_EAGAIN) {
           AZ(sk->ops->close(sk));
-     } else if (sk->close_on_write && 0 == skb_rdsz(sk->sendbuf)) {
+     } else if (sk->close_on_write
+                && 0 == skb_rdsz(sk->sendbuf)
+                && (!sk->ctlbuf || 0 == skb_rdsz(sk->ctlbuf))) {
           AZ(sk->ops->close(sk));
      } else if (sk->close) {
           AZ(sk->ops->close(sk));
@@ -189,12 +243,12 @@ on_write(sk_t *sk, const struct timespec *now)
 }
 
 int
-on_read(sk_t *sk, int (*post_read)(sk_t *sk), const struct timespec *now)
+on_read(sk_t *sk, int (*post_read)(sk_t *sk))
 {
      A(!sk->close_on_write);
      A(!sk->close);
      int rv = sk->ops->read(sk);
-     ts_last_io_set(sk, now);
+     sk->io = 1;
      if (0 > rv && wsd_errno != WSD_EAGAIN) {
           if (wsd_errno == WSD_CHECKERRNO)
                if (0 == check_errno(sk)) {
@@ -215,17 +269,15 @@ on_read(sk_t *sk, int (*post_read)(sk_t *sk), const struct timespec *now)
 }
 
 int
-on_epoll_event(struct epoll_event *evt,
-               int (*post_read)(sk_t *sk),
-               const struct timespec *now)
+on_epoll_event(struct epoll_event *evt, int (*post_read)(sk_t *sk))
 {
      int rv = 0;
      sk_t *sk = (sk_t*)evt->data.ptr;
      A(sk->fd >= 0);
      if (evt->events & EPOLLIN || evt->events & EPOLLPRI) {
-          rv = on_read(sk, post_read, now);
+          rv = on_read(sk, post_read);
      } else if (evt->events & EPOLLOUT) {
-          rv = on_write(sk, now);
+          rv = on_write(sk);
      } else if (evt->events & EPOLLERR
                 || evt->events & EPOLLHUP
                 || evt->events & EPOLLRDHUP) {
@@ -395,10 +447,10 @@ event_loop(int (*on_iteration)(const struct timespec *now),
           for (n = 0; n < nfd; n++) {
                sk_t *sk = (sk_t*)evs[n].data.ptr;
                if (sk->fd == wsd_cfg->lfd) {
-                    AZ(sk->ops->accept(sk->fd));
+                    sk->ops->accept(sk->fd);
                     continue;
                }
-               rv = on_epoll_event(&evs[n], post_read, now);
+               rv = on_epoll_event(&evs[n], post_read);
           }
      }
      free(now);
@@ -406,12 +458,22 @@ event_loop(int (*on_iteration)(const struct timespec *now),
 }
 
 int
-check_timeout(const sk_t *sk,
+check_timeout(sk_t *sk,
               const struct timespec *now,
               const int timeout)
 {
      AN(sk);
 
+     /*
+      * Reads and writes only flag I/O, keeping the clock off the socket's
+      * hot cache lines; record the time here, once per loop iteration.
+      */
+     if (sk->io) {
+          sk->io = 0;
+          sk->ts_last_io.tv_sec = now->tv_sec;
+          sk->ts_last_io.tv_nsec = now->tv_nsec;
+     }
+
      if (-1 == timeout)
           return 0;
 
@@ -8,7 +8,7 @@
 #include "types.h"
 
 #define skb_rdsz(buf) (buf->wrpos - buf->rdpos)
-#define skb_wrsz(buf) ((unsigned int)sizeof(buf->data) - buf->wrpos)
+#define skb_wrsz(buf) (buf->size - buf->wrpos)
 #define skb_put(buf, obj)                             \
      *(typeof(obj)*)(&buf->data[buf->wrpos]) = obj;   \
      buf->wrpos += sizeof(typeof(obj));
@@ -27,30 +27,30 @@
 #define skb_copy(dst, src, len)                                         \
      memmove(&dst->data[dst->wrpos], &src->data[src->rdpos], len);      \
      dst->wrpos += len;
-#define ts_last_io_set(dst, src)                \
-     dst->ts_last_io.tv_sec = src->tv_sec;      \
-     dst->ts_last_io.tv_nsec = src->tv_nsec;
 #define unmask mask
 
+sk_t *sk_alloc();
 void sk_destroy(sk_t *sk);
-int sk_init(sk_t *sk, int fd, unsigned long int hash);
+int sk_read(sk_t *sk);
+int sk_write(sk_t *sk);
+int sk_init(sk_t *sk, int fd, unsigned long int hash, unsigned int bufsize);
 void turn_on_events(sk_t *sk, unsigned int events);
 void turn_off_events(sk_t *sk, unsigned int events);
-int on_epoll_event(struct epoll_event *evt,
-                   int (*post_read)(sk_t *sk),
-                   const struct timespec *now);
+int on_epoll_event(struct epoll_event *evt, int (*post_read)(sk_t *sk));
 int has_rnrn_termination(skb_t *b);
 int register_for_events(sk_t *sk);
 int skb_put_str(skb_t *b, const char *s);
 int skb_put_strn(skb_t *b, const char *s, size_t n);
 void skb_compact(skb_t *b);
+skb_t *skb_alloc(unsigned int size);
+int skb_resize(skb_t **b, unsigned int size);
 int skb_print(FILE *stream, skb_t *b, size_t n);
 void trim(chunk_t *chk);
 char mask(char c, unsigned int i, unsigned int key);
 int event_loop(int (*on_iteration)(const struct timespec *now),
                int (*post_read)(sk_t *sk),
                int timeout);
-int check_timeout(const sk_t *sk,
+int check_timeout(sk_t *sk,
                   const struct timespec *now,
                   const int timeout);
 bool has_timed_out(const struct timespec *instant,
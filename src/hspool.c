@@ -0,0 +1,281 @@
+/*
+ *  Copyright (C) 2020 Michael Goldschmidt
+ *
+ *  This file is part of wsd/wscat.
+ *
+ *  wsd/wscat is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  wsd/wscat is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with wsd/wscat.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+
+#include "hspool.h"
+#include "http.h"
+
+#define DEQUE_MASK (HSPOOL_DEQUE_SIZE - 1)
+
+_Static_assert(0 == (HSPOOL_DEQUE_SIZE & DEQUE_MASK),
+               "HSPOOL_DEQUE_SIZE must be a power of two");
+
+extern unsigned int wsd_errno;
+
+/*
+ * Fixed-size Chase-Lev deque; see Lê et al., "Correct and Efficient
+ * Work-Stealing for Weak Memory Models", PPoPP 2013. Only the event loop
+ * pushes and nobody pops at the bottom, so take() is their steal().
+ */
+typedef struct {
+     atomic_long  top __attribute__((aligned(CACHE_LINE_SIZE)));
+     atomic_long  bottom __attribute__((aligned(CACHE_LINE_SIZE)));
+     _Atomic(hsjob_t*) jobs[HSPOOL_DEQUE_SIZE];
+} deque_t;
+
+typedef struct {
+     deque_t      deque;
+     pthread_t    thread;
+     unsigned int idx;
+} worker_t;
+
+static worker_t *workers = NULL;
+static unsigned int num_workers = 0;
+static unsigned int next_worker = 0;    /* Receives next job             */
+static sem_t pending;                   /* Number of jobs in deques      */
+static atomic_bool stopping;
+static _Atomic(hsjob_t*) done = NULL;   /* Finished jobs, latest first   */
+static int efd = -1;                    /* Readable iff done non-empty   */
+
+static int push(deque_t *d, hsjob_t *job);
+static hsjob_t *take(deque_t *d);
+static void *work(void *arg);
+
+hsjob_t *
+hsjob_alloc(uint64_t id,
+            const chunk_t *key,
+            const chunk_t *proto,
+            const chunk_t *ext,
+            const http_req_t *req,
+            unsigned int resp_len)
+{
+     /* Fields for the open record iff req */
+     unsigned int req_len = req ? http_open_fields_len(req) : 0;
+     hsjob_t *job = malloc(sizeof(hsjob_t)
+                           + key->len
+                           + proto->len
+                           + ext->len
+                           + req_len
+                           + resp_len);
+     if (!job) {
+          wsd_errno = WSD_ENOMEM;
+          return NULL;
+     }
+
+     job->next = NULL;
+     job->work = NULL;
+     job->id = id;
+     job->rv = -1;
+     job->key.p = job->data;
+     job->key.len = key->len;
+     memcpy(job->key.p, key->p, key->len);
+     job->proto.p = job->key.p + key->len;
+     job->proto.len = proto->len;
+     memcpy(job->proto.p, proto->p, proto->len);
+     job->ext.p = job->proto.p + proto->len;
+     job->ext.len = ext->len;
+     memcpy(job->ext.p, ext->p, ext->len);
+     char *p = job->ext.p + ext->len;
+     if (req)
+          p = http_copy_open_fields(&job->req, req, p);
+     else
+          memset(&job->req, 0, sizeof(job->req));
+     job->resp.p = p;
+     job->resp.len = resp_len;
+
+     return job;
+}
+
+int
+hspool_init(unsigned int num)
+{
+     A(0 < num);
+     AZ(workers);
+
+     workers = aligned_alloc(CACHE_LINE_SIZE, num * sizeof(worker_t));
+     if (!workers) {
+          wsd_errno = WSD_ENOMEM;
+          return (-1);
+     }
+     memset(workers, 0, num * sizeof(worker_t));
+
+     if (0 > (efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))) {
+          free(workers);
+          workers = NULL;
+          wsd_errno = WSD_CHECKERRNO;
+          return (-1);
+     }
+
+     AZ(sem_init(&pending, 0, 0));
+     atomic_store(&stopping, false);
+
+     for (num_workers = 0; num_workers < num; num_workers++) {
+          worker_t *w = &workers[num_workers];
+          w->idx = num_workers;
+          if (0 != pthread_create(&w->thread, NULL, work, w)) {
+               hspool_stop();
+               wsd_errno = WSD_CHECKERRNO;
+               return (-1);
+          }
+     }
+
+     return 0;
+}
+
+int
+hspool_fd()
+{
+     return efd;
+}
+
+/* Queues job for a worker; fails with WSD_EAGAIN if its deque is full */
+int
+hspool_submit(hsjob_t *job)
+{
+     AN(job->work);
+     AN(num_workers);
+
+     unsigned int i = next_worker;
+     if (++next_worker == num_workers)
+          next_worker = 0;
+
+     if (0 > push(&workers[i].deque, job)) {
+          wsd_errno = WSD_EAGAIN;
+          return (-1);
+     }
+
+     AZ(sem_post(&pending));
+     return 0;
+}
+
+/* Takes every finished job, in no particular order */
+hsjob_t *
+hspool_done()
+{
+     return atomic_exchange(&done, NULL);
+}
+
+/* Joins workers; jobs not yet taken are freed, finished ones are kept */
+void
+hspool_stop()
+{
+     if (!workers)
+          return;
+
+     atomic_store(&stopping, true);
+     for (unsigned int i = 0; i < num_workers; i++)
+          AZ(sem_post(&pending));
+     for (unsigned int i = 0; i < num_workers; i++)
+          AZ(pthread_join(workers[i].thread, NULL));
+
+     for (unsigned int i = 0; i < num_workers; i++) {
+          hsjob_t *job;
+          while ((job = take(&workers[i].deque)))
+               free(job);
+     }
+
+     AZ(sem_destroy(&pending));
+     AZ(close(efd));
+     efd = -1;
+     free(workers);
+     workers = NULL;
+     num_workers = 0;
+     next_worker = 0;
+}
+
+int
+push(deque_t *d, hsjob_t *job)
+{
+     long b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+     long t = atomic_load_explicit(&d->top, memory_order_acquire);
+     if (HSPOOL_DEQUE_SIZE <= b - t)
+          return (-1);
+
+     atomic_store_explicit(&d->jobs[b & DEQUE_MASK], job, memory_order_relaxed);
+     atomic_thread_fence(memory_order_release);
+     atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+     return 0;
+}
+
+/* Takes oldest job, or NULL if none or another thread took it first */
+hsjob_t *
+take(deque_t *d)
+{
+     long t = atomic_load_explicit(&d->top, memory_order_acquire);
+     atomic_thread_fence(memory_order_seq_cst);
+     long b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+     if (t >= b)
+          return NULL;
+
+     hsjob_t *job = atomic_load_explicit(&d->jobs[t & DEQUE_MASK],
+                                         memory_order_relaxed);
+     if (!atomic_compare_exchange_strong_explicit(&d->top,
+                                                  &t,
+                                                  t + 1,
+                                                  memory_order_seq_cst,
+                                                  memory_order_relaxed))
+          return NULL;
+
+     return job;
+}
+
+void *
+work(void *arg)
+{
+     worker_t *self = arg;
+
+     for (;;) {
+          while (0 > sem_wait(&pending));
+          if (atomic_load(&stopping))
+               break;
+
+          /*
+           * The semaphore counts jobs, so there is one for this worker in
+           * some deque; own first, then the others', until found.
+           */
+          hsjob_t *job = NULL;
+          for (unsigned int i = 0; !job; i++)
+               job = take(&workers[(self->idx + i) % num_workers].deque);
+
+          job->work(job);
+
+          job->next = atomic_load_explicit(&done, memory_order_relaxed);
+          while (!atomic_compare_exchange_weak_explicit(&done,
+                                                        &job->next,
+                                                        job,
+                                                        memory_order_release,
+                                                        memory_order_relaxed));
+
+          /* Loop takes the whole list at once; wake it for the first only */
+          if (!job->next) {
+               uint64_t one = 1;
+               A(sizeof(one) == write(efd, &one, sizeof(one)));
+          }
+     }
+
+     return NULL;
+}
@@ -0,0 +1,46 @@
+#ifndef __HSPOOL_H__
+#define __HSPOOL_H__
+
+#include <stdint.h>
+
+#include "types.h"
+
+/*
+ * Pool of threads computing opening handshake responses off the event
+ * loop. The loop is the only producer: it pushes jobs round-robin onto
+ * one Chase-Lev deque per worker. Workers take from their own deque and
+ * steal from the others' once it runs dry; all of them take from the
+ * top, so none of them ever contends with the loop. Finished jobs are
+ * handed back on a single list, signalled by an eventfd(2) the loop
+ * polls like any other descriptor.
+ */
+
+#define HSPOOL_DEQUE_SIZE 1024  /* Jobs per worker; a power of two */
+
+typedef struct hsjob hsjob_t;
+struct hsjob {
+     hsjob_t      *next;        /* Next finished job                      */
+     void        (*work)(hsjob_t *job);/* Run on a worker                 */
+     uint64_t      id;          /* Connection id, see sktable.h           */
+     int           rv;          /* Result of work                         */
+     chunk_t       key;         /* Sec-WebSocket-Key, points into data    */
+     chunk_t       proto;       /* Sec-WebSocket-Protocol, ditto          */
+     chunk_t       ext;         /* Sec-WebSocket-Extensions line, ditto   */
+     chunk_t       resp;        /* 101 response, ditto                    */
+     http_req_t    req;         /* Fields for the open record, ditto      */
+     char          data[];
+};
+
+hsjob_t *hsjob_alloc(uint64_t id,
+                     const chunk_t *key,
+                     const chunk_t *proto,
+                     const chunk_t *ext,
+                     const http_req_t *req,
+                     unsigned int resp_len);
+int hspool_init(unsigned int num);
+int hspool_fd();
+int hspool_submit(hsjob_t *job);
+hsjob_t *hspool_done();
+void hspool_stop();
+
+#endif /* #ifndef __HSPOOL_H__ */
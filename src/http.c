@@ -20,6 +20,7 @@
 
 #include <sys/epoll.h>
 #include <string.h>
+#include <stddef.h>
 #include <errno.h>
 
 #ifdef WSD_DEBUG
@@ -51,31 +52,26 @@ http_recv(sk_t *sk)
 {
      AN(skb_rdsz(sk->recvbuf));
 
-     if (!has_rnrn_termination(sk->recvbuf)) {
-          wsd_errno = WSD_EINPUT;
-          return (-1);
-     }
-
-     int rv;
-     chunk_t tok;
-     memset(&tok, 0, sizeof(chunk_t));
-     rv = http_header_tok(&sk->recvbuf->data[sk->recvbuf->rdpos], &tok);
-     if (0 > rv) {
-          if (LOG_VVERBOSE <= wsd_cfg->verbose) {
-               printf("\t%s: errno=%d\n", __func__, errno);
+     /* Parse state persists across reads until the request completes */
+     if (!sk->hp) {
+          if (!(sk->hp = calloc(1, sizeof(http_parser_t)))) {
+               wsd_errno = WSD_ENOMEM;
+               goto error;
           }
-
-          goto error;
      }
 
-     http_req_t hreq;
-     memset(&hreq, 0, sizeof(http_req_t));
+     /* Parse request line and header fields received since last call ... */
+     int rv = http_parse(sk->hp,
+                         &sk->recvbuf->data[sk->recvbuf->rdpos],
+                         skb_rdsz(sk->recvbuf));
+     /* Incomplete, unless the request outgrew the pre-upgrade buffer */
+     if (0 > rv && WSD_EINPUT == wsd_errno && skb_wrsz(sk->recvbuf))
+          return (-1);
 
-     /* Parse status line, see whether or not it's a request ... */
-     if (0 > parse_request_line(&tok, &hreq)) {
+     if (0 > rv) {
 
           if (LOG_VVERBOSE <= wsd_cfg->verbose) {
-               printf("\t%s: errno=%d\n", __func__, errno);
+               printf("\t%s: wsd_errno=%d\n", __func__, wsd_errno);
           }
 
           if (0 == skb_put_strn(sk->sendbuf, HTTP_400, strlen(HTTP_400))) {
@@ -85,8 +81,10 @@ http_recv(sk_t *sk)
           goto error;
      }
 
+     http_req_t *hreq = &sk->hp->req;
+
      /* ... validate request line ... */
-     if (!is_valid_req_line(&hreq)) {
+     if (!is_valid_req_line(hreq)) {
 
           if (0 == skb_put_strn(sk->sendbuf, HTTP_400, strlen(HTTP_400))) {
                sk->close_on_write = 1;
@@ -95,25 +93,8 @@ http_recv(sk_t *sk)
           goto error;
      }
 
-     /* ... tokenise and parse header fields ... */
-     while (0 < http_header_tok(NULL, &tok)) {
-
-          if (0 > parse_header_field(&tok, &hreq)) {
-               
-               if (LOG_VVERBOSE <= wsd_cfg->verbose) {
-                    printf("\t%s: errno=%d\n", __func__, errno);
-               }
-
-               if (0 == skb_put_strn(sk->sendbuf, HTTP_400, strlen(HTTP_400))) {
-                    sk->close_on_write = 1;
-               }
-
-               goto error;
-          }
-     }
-
      /* ... and finally, validate HTTP protocol fields. */
-     if (!is_valid_host_header_field(&hreq)) {
+     if (!is_valid_host_header_field(hreq)) {
 
           if (LOG_VVERBOSE <= wsd_cfg->verbose) {
                printf("\t%s: invalid host header field\n", __func__);
@@ -130,7 +111,7 @@ http_recv(sk_t *sk)
           goto error;
      }
 
-     if (!is_valid_upgrade_header_field(&hreq)) {
+     if (!is_valid_upgrade_header_field(hreq)) {
 
           if (LOG_VVERBOSE <= wsd_cfg->verbose) {
                printf("\t%s: invalid upgrade header field\n", __func__);
@@ -143,7 +124,7 @@ http_recv(sk_t *sk)
           goto error;
      }
      
-     if (!is_valid_connection_header_field(&hreq)) {
+     if (!is_valid_connection_header_field(hreq)) {
 
           if (LOG_VVERBOSE <= wsd_cfg->verbose) {
                printf("\t%s: invalid connection header field\n", __func__);
@@ -156,9 +137,13 @@ http_recv(sk_t *sk)
           goto error;
      }
 
-     skb_reset(sk->recvbuf);
+     /* Bytes past the request are frames the client pipelined */
+     sk->recvbuf->rdpos += rv;
 
-     return sk->proto->decode_handshake(sk, &hreq);
+     rv = sk->proto->decode_handshake(sk, hreq);
+     free(sk->hp);
+     sk->hp = NULL;
+     return rv;
 
 error:
      skb_reset(sk->recvbuf);
@@ -254,3 +239,46 @@ is_valid_connection_header_field(http_req_t *hreq)
      /* Got two ... */
      return tokenise_connection(&hreq->conn2);
 }
+
+/*
+ * Fields of req an open record carries, see pp2.h, so they can outlive
+ * the receive buffer: request target, Host, Sec-WebSocket-Protocol,
+ * Origin and User-Agent
+ */
+static const size_t open_fields[] = {
+     offsetof(http_req_t, req_target),
+     offsetof(http_req_t, host),
+     offsetof(http_req_t, sec_ws_proto),
+     offsetof(http_req_t, origin),
+     offsetof(http_req_t, user_agent)
+};
+#define NUM_OPEN_FIELDS (sizeof(open_fields) / sizeof(open_fields[0]))
+
+unsigned int
+http_open_fields_len(const http_req_t *req)
+{
+     unsigned int len = 0;
+     for (unsigned int i = 0; i < NUM_OPEN_FIELDS; i++)
+          len += ((const chunk_t*)((const char*)req + open_fields[i]))->len;
+
+     return len;
+}
+
+/* Copies those fields of src to p, dst pointing at them; returns their end */
+char *
+http_copy_open_fields(http_req_t *dst, const http_req_t *src, char *p)
+{
+     memset(dst, 0, sizeof(http_req_t));
+     for (unsigned int i = 0; i < NUM_OPEN_FIELDS; i++) {
+          const chunk_t *from =
+               (const chunk_t*)((const char*)src + open_fields[i]);
+          chunk_t *to = (chunk_t*)((char*)dst + open_fields[i]);
+          to->p = p;
+          to->len = from->len;
+          if (from->len)
+               memcpy(p, from->p, from->len);
+          p += from->len;
+     }
+
+     return p;
+}
@@ -4,5 +4,7 @@
 #include "types.h"
 
 int http_recv(sk_t *sk);
+unsigned int http_open_fields_len(const http_req_t *req);
+char *http_copy_open_fields(http_req_t *dst, const http_req_t *src, char *p);
 
 #endif /* #ifndef __HTTP_H__ */
@@ -21,81 +21,229 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <string.h>
 #include <strings.h>
 #include <ctype.h>
+#include <stdint.h>
+#include "config.h"
 #include "parser.h"
 
 #define CRLF 0x0a0d
 #define HTTP_version 0x312e312f50545448
 
+/* States of http_parse() */
+#define HP_START_LINE    0     /* Request line                           */
+#define HP_START_LINE_LF 1     /* Request line, seen CR                  */
+#define HP_NAME          2     /* Field name or empty line               */
+#define HP_NAME_LF       3     /* Field name, seen CR                    */
+#define HP_VALUE         4     /* Field value                            */
+#define HP_VALUE_LF      5     /* Field value, seen CR                   */
+
 extern unsigned int wsd_errno;
 
-static unsigned int
-is_rfc7230_start_line(char c)
+#define S HTTP_START_LINE
+#define H HTTP_HEADER_FIELD
+#define V HTTP_FIELD_VALUE
+
+/* Character classes of RFC7230 request lines, field names and values */
+static const uint8_t http_class[256] = {
+     ['A' ... 'Z'] = S|H|V,
+     ['a' ... 'z'] = S|H|V,
+     ['0' ... '9'] = S|H|V,
+     ['-'] = S|H|V,
+     [' '] = S|V, ['/'] = S|V, ['.'] = S|V, ['?'] = S|V, [':'] = S|V,
+     ['*'] = S|V,
+     ['\t'] = V, ['='] = V, ['_'] = V, [';'] = V, [','] = V, ['('] = V,
+     [')'] = V, ['+'] = V
+};
+
+#undef S
+#undef H
+#undef V
+
+#define is_rfc7230_start_line(c)                                \
+     (http_class[(unsigned char)(c)] & HTTP_START_LINE)
+#define is_rfc7230_header_field(c)                              \
+     (http_class[(unsigned char)(c)] & HTTP_HEADER_FIELD)
+#define is_rfc7230_field_value(c)                               \
+     (http_class[(unsigned char)(c)] & HTTP_FIELD_VALUE)
+
+static unsigned int span_scalar(const char *s,
+                                unsigned int len,
+                                unsigned int cls);
+
+/* Implementation of http_span(); see http_span_select() */
+static unsigned int (*span)(const char *s,
+                            unsigned int len,
+                            unsigned int cls) = span_scalar;
+
+unsigned int
+span_scalar(const char *s, unsigned int len, unsigned int cls)
 {
-     if ('A' <= c && c <= 'Z')
-          return 1;
-     else if ('a' <= c && c <= 'z')
-          return 1;
-     else if ('0' <= c && c <= '9')
-          return 1;
-
-     switch (c) {
-     case ' ':
-     case '/':
-     case '.':
-     case '?':
-     case '-':
-     case ':':
-     case '*':
-          break;
-     default:
-          return 0;
+     unsigned int i = 0;
+     while (i < len && (http_class[(unsigned char)s[i]] & cls))
+          i++;
+     return i;
+}
+
+#if defined(HAVE_IMMINTRIN_H) && defined(__x86_64__)
+#define HTTP_SPAN_SIMD
+#include <immintrin.h>
+
+/*
+ * Classes as byte ranges for pcmpestri; up to eight pairs each. The
+ * parser test checks them against http_class.
+ */
+static const struct {
+     char set[16];
+     int  len;
+} http_ranges[] = {
+     { "  **-:??AZaz", 12 },                 /* HTTP_START_LINE   */
+     { "--09AZaz", 8 },                      /* HTTP_HEADER_FIELD */
+     { "\t\t  (;==??AZ__az", 16 }            /* HTTP_FIELD_VALUE  */
+};
+
+/*
+ * Classes as nibble tables for pshufb: a byte is in a class iff the
+ * entries of its low and high nibbles share a bit. Each high nibble
+ * gets a bit of its own, so the tables are exact; built at startup.
+ */
+static uint8_t http_lo_nibbles[3][16] __attribute__((aligned(16)));
+static uint8_t http_hi_nibbles[3][16] __attribute__((aligned(16)));
+
+static unsigned int span_sse42(const char *s,
+                               unsigned int len,
+                               unsigned int cls);
+static unsigned int span_avx2(const char *s,
+                              unsigned int len,
+                              unsigned int cls);
+
+/* Index of class in tables above */
+#define CLS_IDX(cls) ((cls) >> 1)
+
+__attribute__((target("sse4.2")))
+unsigned int
+span_sse42(const char *s, unsigned int len, unsigned int cls)
+{
+     __m128i set = _mm_loadu_si128((const __m128i*)http_ranges[CLS_IDX(cls)].set);
+     int set_len = http_ranges[CLS_IDX(cls)].len;
+
+     unsigned int i = 0;
+     for (; i + 16 <= len; i += 16) {
+          __m128i v = _mm_loadu_si128((const __m128i*)(s + i));
+          int j = _mm_cmpestri(set, set_len, v, 16,
+                               _SIDD_UBYTE_OPS
+                               | _SIDD_CMP_RANGES
+                               | _SIDD_NEGATIVE_POLARITY
+                               | _SIDD_LEAST_SIGNIFICANT);
+          if (16 > j)
+               return i + j;
      }
 
-     return 1;
+     return i + span_scalar(s + i, len - i, cls);
 }
 
-static unsigned int
-is_rfc7230_field_value(char c)
+__attribute__((target("avx2")))
+unsigned int
+span_avx2(const char *s, unsigned int len, unsigned int cls)
 {
-     if (is_rfc7230_start_line(c))
-          return 1;
-
-     switch (c) {
-     case '\t':
-     case '=':
-     case '_':
-     case ';':
-     case ',':
-     case '(':
-     case ')':
-     case '+':
-          break;
-     default:
-          return 0;
+     __m256i lo_lut = _mm256_broadcastsi128_si256(
+          _mm_load_si128((const __m128i*)http_lo_nibbles[CLS_IDX(cls)]));
+     __m256i hi_lut = _mm256_broadcastsi128_si256(
+          _mm_load_si128((const __m128i*)http_hi_nibbles[CLS_IDX(cls)]));
+     __m256i nibble = _mm256_set1_epi8(0x0f);
+     __m256i zero = _mm256_setzero_si256();
+
+     unsigned int i = 0;
+     for (; i + 32 <= len; i += 32) {
+          __m256i v = _mm256_loadu_si256((const __m256i*)(s + i));
+          __m256i lo = _mm256_shuffle_epi8(lo_lut,
+                                           _mm256_and_si256(v, nibble));
+          __m256i hi = _mm256_shuffle_epi8(
+               hi_lut,
+               _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+          __m256i out = _mm256_cmpeq_epi8(_mm256_and_si256(lo, hi), zero);
+          unsigned int mask = _mm256_movemask_epi8(out);
+          if (mask)
+               return i + __builtin_ctz(mask);
      }
-     return 1;
+
+     /* Upper halves clean, no SSE transition penalty past this point */
+     _mm256_zeroupper();
+
+     if (i + 16 <= len) {
+          __m128i v = _mm_loadu_si128((const __m128i*)(s + i));
+          __m128i lo = _mm_shuffle_epi8(_mm256_castsi256_si128(lo_lut),
+                                        _mm_and_si128(v, _mm_set1_epi8(0x0f)));
+          __m128i hi = _mm_shuffle_epi8(
+               _mm256_castsi256_si128(hi_lut),
+               _mm_and_si128(_mm_srli_epi16(v, 4), _mm_set1_epi8(0x0f)));
+          __m128i out = _mm_cmpeq_epi8(_mm_and_si128(lo, hi),
+                                       _mm_setzero_si128());
+          unsigned int mask = _mm_movemask_epi8(out);
+          if (mask)
+               return i + __builtin_ctz(mask);
+          i += 16;
+     }
+
+     return i + span_scalar(s + i, len - i, cls);
 }
 
-static unsigned int
-is_rfc7230_header_field(char c)
+__attribute__((constructor))
+static void
+span_init()
 {
-     if ('A' <= c && c <= 'Z')
-          return 1;
-     else if ('a' <= c && c <= 'z')
-          return 1;
-     else if ('0' <= c && c <= '9')
-          return 1;
-
-     switch (c) {
-     case '-':
-          break;
-     default:
+     for (unsigned int k = 0; k < 3; k++) {
+          unsigned int cls = 1 << k, bit = 0;
+          for (unsigned int hi = 0; hi < 16; hi++) {
+               for (unsigned int lo = 0; lo < 16; lo++) {
+                    if (!(http_class[hi << 4 | lo] & cls))
+                         continue;
+                    if (!http_hi_nibbles[k][hi])
+                         http_hi_nibbles[k][hi] = 1 << bit++;
+                    http_lo_nibbles[k][lo] |= http_hi_nibbles[k][hi];
+               }
+          }
+          A(8 >= bit);
+     }
+
+     if (0 > http_span_select(HTTP_SPAN_AVX2))
+          http_span_select(HTTP_SPAN_SSE42);
+}
+#endif /* #if defined(HAVE_IMMINTRIN_H) && defined(__x86_64__) */
+
+/* Selects implementation of http_span(); fails if CPU lacks support */
+int
+http_span_select(unsigned int impl)
+{
+     switch (impl) {
+     case HTTP_SPAN_SCALAR:
+          span = span_scalar;
+          return 0;
+#ifdef HTTP_SPAN_SIMD
+     case HTTP_SPAN_SSE42:
+          if (!__builtin_cpu_supports("sse4.2"))
+               break;
+          span = span_sse42;
           return 0;
+     case HTTP_SPAN_AVX2:
+          if (!__builtin_cpu_supports("avx2")
+              || !__builtin_cpu_supports("sse4.2"))
+               break;
+          span = span_avx2;
+          return 0;
+#endif
      }
 
-     return 1;
+     wsd_errno = WSD_EINPUT;
+     return (-1);
+}
+
+/* Returns number of leading bytes of s in class cls, up to len */
+unsigned int
+http_span(const char *s, unsigned int len, unsigned int cls)
+{
+     return span(s, len, cls);
 }
 
 int
@@ -154,6 +302,103 @@ finish:
      return result->len;
 }
 
+/*
+ * Parses the next len - hp->pos bytes of the request starting at s,
+ * accepting the same characters as http_header_tok(). Returns length
+ * of request including the empty line once complete; otherwise -1 and
+ * sets wsd_errno: WSD_EINPUT asks for more input, anything else means
+ * the request is malformed.
+ */
+int
+http_parse(http_parser_t *hp, char *s, unsigned int len)
+{
+     unsigned int pos = hp->pos;
+     unsigned int state = hp->state;
+     chunk_t tok;
+
+     for (; pos < len; pos++) {
+          char c = s[pos];
+
+          /* Runs of class bytes are skipped by http_span() */
+          switch (state) {
+          case HP_START_LINE:
+               pos += http_span(&s[pos], len - pos, HTTP_START_LINE);
+               if (pos == len)
+                    goto more;
+               if ('\r' != s[pos])
+                    goto bad_char;
+               state = HP_START_LINE_LF;
+               break;
+          case HP_START_LINE_LF:
+               if ('\n' != c)
+                    goto bad_char;
+
+               tok.p = s + hp->line;
+               tok.len = pos - 1 - hp->line; /* excludes CRLF */
+               if (0 > parse_request_line(&tok, &hp->req))
+                    goto bad_req;
+
+               hp->line = pos + 1;
+               state = HP_NAME;
+               break;
+          case HP_NAME:
+               pos += http_span(&s[pos], len - pos, HTTP_HEADER_FIELD);
+               if (pos == len)
+                    goto more;
+               if (':' == s[pos])
+                    state = HP_VALUE;
+               else if ('\r' == s[pos])
+                    state = HP_NAME_LF;
+               else
+                    goto bad_char;
+               break;
+          case HP_NAME_LF:
+               /* Only the empty line ends without colon */
+               if ('\n' != c || pos - 1 != hp->line)
+                    goto bad_char;
+
+               hp->pos = pos + 1;
+               hp->state = state;
+               return hp->pos;
+          case HP_VALUE:
+               pos += http_span(&s[pos], len - pos, HTTP_FIELD_VALUE);
+               if (pos == len)
+                    goto more;
+               if ('\r' != s[pos])
+                    goto bad_char;
+               state = HP_VALUE_LF;
+               break;
+          case HP_VALUE_LF:
+               if ('\n' != c)
+                    goto bad_char;
+
+               tok.p = s + hp->line;
+               tok.len = pos - 1 - hp->line;
+               if (0 > parse_header_field(&tok, &hp->req))
+                    goto bad_req;
+
+               hp->line = pos + 1;
+               state = HP_NAME;
+               break;
+          }
+     }
+
+more:
+     hp->pos = pos;
+     hp->state = state;
+     wsd_errno = WSD_EINPUT;
+     return (-1);
+
+bad_char:
+     /* Implementing CRLF as MUST; see RFC7230, section 3.5 */
+     wsd_errno = WSD_ECHAR;
+     return (-1);
+
+bad_req:
+     wsd_errno = WSD_EBADREQ;
+     return (-1);
+}
+
 /* Parses HTTP 1.1 request line as per RFC7230 */
 int
 parse_request_line(chunk_t *tok, http_req_t *req)
@@ -205,63 +450,67 @@ parse_request_line(chunk_t *tok, http_req_t *req)
      return 0;
 }
 
-#define ASSIGN(to)                              \
-     to.p = tok->p + len;                       \
-     to.len = tok->len - len;
-
-#define CMP(to, to_len)                         \
-     (0 == strncasecmp(tok->p, to, to_len))
+/* Fields of interest, by FIELD_HASH() of name; collision free */
+#define FIELD_HASH(c, len) (((len) + ((c) | 0x20)) & 31)
+#define FIELD(c, name, member)                                  \
+     [FIELD_HASH(c, sizeof(name) - 1)] = {                      \
+          name, sizeof(name) - 1, offsetof(http_req_t, member)  \
+     }
 
+static const struct {
+     const char  *name;
+     unsigned int len;
+     size_t       off;
+} http_fields[32] = {
+     FIELD('H', "Host", host),
+     FIELD('U', "Upgrade", upgrade),
+     FIELD('C', "Connection", conn),
+     FIELD('S', "Sec-WebSocket-Key", sec_ws_key),
+     FIELD('S', "Sec-WebSocket-Version", sec_ws_ver),
+     FIELD('S', "Sec-WebSocket-Protocol", sec_ws_proto),
+     FIELD('S', "Sec-WebSocket-Extensions", sec_ws_ext),
+     FIELD('O', "Origin", origin),
+     FIELD('U', "User-Agent", user_agent)
+};
+
+#undef FIELD
+
+/* Returns 1 if field is of interest and assigned, 0 if not */
 int
 parse_header_field(chunk_t *tok, http_req_t *req)
 {
-     char *cur = tok->p;
-     while (':' != *cur++);
-
-     int len = cur - tok->p; /* inclusive colon */
-
-     if (CMP("Host", 4)) {
-          ASSIGN(req->host);
-          return 1;
-     } else if (CMP("Upgrade", 7)) {
-          ASSIGN(req->upgrade);
-          return 1;
-     } else if (CMP("Connection", 10)) {
-          /*
-           * Connection header field can appear multiple times
-           * and implementations are supposed to combine values
-           * in an ordered list. See section 6.1. But I don't
-           * like allocating memory thus this implementation
-           * assumes Connection appears at most two times.
-           */
-          if (0 == req->conn.len) {
-               ASSIGN(req->conn);
-          } else {
-               ASSIGN(req->conn2);
-          }
-          
-          return 1;
-     } else if (CMP("Sec-WebSocket-Key", 17)) {
-          ASSIGN(req->sec_ws_key);
-          return 1;
-     } else if (CMP("Sec-WebSocket-Version", 21)) {
-          ASSIGN(req->sec_ws_ver);
-          return 1;
-     } else if (CMP("Sec-WebSocket-Protocol", 22)) {
-          ASSIGN(req->sec_ws_proto);
-          return 1;
-     } else if (CMP("Sec-WebSocket-Extensions", 24)) {
-          ASSIGN(req->sec_ws_ext);
-          return 1;
-     } else if (CMP("Origin", 6)) {
-          ASSIGN(req->origin);
-          return 1;
-     } else if (CMP("User-Agent", 10)) {
-          ASSIGN(req->user_agent);
-          return 1;
+     char *colon = memchr(tok->p, ':', tok->len);
+     if (NULL == colon) {
+          wsd_errno = WSD_ECHAR;
+          return (-1);
      }
 
-     return 0;
+     unsigned int len = colon - tok->p;
+     if (0 == len)
+          return 0;
+
+     /* Names are case-insensitive; see section 3.2 RFC7230 */
+     unsigned int h = FIELD_HASH(tok->p[0], len);
+     if (len != http_fields[h].len
+         || 0 != strncasecmp(tok->p, http_fields[h].name, len))
+          return 0;
+
+     chunk_t *to = (chunk_t*)((char*)req + http_fields[h].off);
+
+     /*
+      * Connection header field can appear multiple times
+      * and implementations are supposed to combine values
+      * in an ordered list. See section 6.1. But I don't
+      * like allocating memory thus this implementation
+      * assumes Connection appears at most two times.
+      */
+     if (to == &req->conn && 0 != req->conn.len)
+          to = &req->conn2;
+
+     to->p = colon + 1;
+     to->len = tok->len - len - 1;
+
+     return 1;
 }
 
 /* "," delimits s; if not then simply returns result = s */
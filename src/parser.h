@@ -3,9 +3,36 @@
 
 #include "types.h"
 
+/*
+ * State of an incremental parse of an HTTP upgrade request. Bytes are
+ * scanned once; a call resumes where the previous one stopped, and
+ * fields are parsed into req as their lines complete. Chunks in req
+ * point into the input, which must stay in place between calls.
+ */
+struct http_parser {
+     http_req_t   req;
+     unsigned int pos;          /* Offset of next byte to scan            */
+     unsigned int line;         /* Offset of current line                 */
+     unsigned int state;
+};
+typedef struct http_parser http_parser_t;
+
+/* Character classes; see http_span() */
+#define HTTP_START_LINE   0x1
+#define HTTP_HEADER_FIELD 0x2
+#define HTTP_FIELD_VALUE  0x4
+
+/* Implementations of http_span(); the fastest supported is the default */
+#define HTTP_SPAN_SCALAR  0
+#define HTTP_SPAN_SSE42   1
+#define HTTP_SPAN_AVX2    2
+
 int http_header_tok(char *s, chunk_t *result);
 int parse_request_line(chunk_t *tok, http_req_t *req);
 int parse_header_field(chunk_t *tok, http_req_t *req);
 int http_field_value_tok(chunk_t *s, chunk_t *result);
+int http_parse(http_parser_t *hp, char *s, unsigned int len);
+unsigned int http_span(const char *s, unsigned int len, unsigned int cls);
+int http_span_select(unsigned int impl);
 
 #endif /* #ifndef __PARSER_H__ */
@@ -0,0 +1,618 @@
+/*
+ *  Copyright (C) 2020 Michael Goldschmidt
+ *
+ *  This file is part of wsd/wscat.
+ *
+ *  wsd/wscat is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  wsd/wscat is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with wsd/wscat.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "common.h"
+#include "pmd.h"
+
+#define PMD_MEM_LEVEL 8
+#define PMD_POOL_MAX  64        /* Idle inflaters kept for shared mode    */
+
+/* Parameters in an offer, each allowed once */
+#define PMD_SERVER_NCT  0x1
+#define PMD_CLIENT_NCT  0x2
+#define PMD_SERVER_MWB  0x4
+#define PMD_CLIENT_MWB  0x8
+
+extern unsigned int wsd_errno;
+
+static const char tail[PMD_TAIL_LEN] = { 0x00, 0x00, (char)0xff, (char)0xff };
+
+static int level = Z_DEFAULT_COMPRESSION;
+static int mode = PMD_FULL;
+
+/*
+ * In shared mode, every record sent is deflated by the one deflater for
+ * its window and every message received is inflated by one of the pool,
+ * borrowed for as long as the message takes to arrive.
+ */
+static z_stream *shared_tx[PMD_MAX_WINDOW_BITS + 1];
+static z_stream *pool[PMD_POOL_MAX];
+static unsigned int pool_num = 0;
+
+static unsigned long int mem = 0;   /* Bytes allocated by zlib and for pmd_t */
+static unsigned int num = 0;        /* Number of pmd_t                       */
+
+static void fit_mode(pmd_params_t *params);
+static z_stream *tx_context(pmd_t *pmd);
+static z_stream *rx_context(pmd_t *pmd);
+static void put_rx(pmd_t *pmd);
+static z_stream *z_alloc();
+static void z_free(z_stream *z);
+static voidpf zalloc(voidpf opaque, uInt items, uInt size);
+static void zfree(voidpf opaque, voidpf ptr);
+static int parse_offer(const char *p,
+                       const char *end,
+                       const bool server,
+                       pmd_params_t *params);
+static const char *next_elem(const char *p,
+                             const char *end,
+                             chunk_t *name,
+                             chunk_t *val);
+static void strip(chunk_t *chk);
+static bool is(const chunk_t *chk, const char *s);
+static int window_bits(const chunk_t *val);
+
+/*
+ * Sets zlib level and memory mode of contexts set up from now on. Full
+ * mode deflates with the window agreed on, 32 KiB by default, and takes
+ * some 300 KiB a connection once it has sent and received a message.
+ * Lean mode asks clients for a 1 KiB window and deflates with one as
+ * small, a few dozen KiB a connection. Shared mode has clients agree to
+ * no context takeover either way, so a connection holds no contexts of
+ * its own at all, at the cost of compressing each message on its own.
+ */
+void
+pmd_init(const int lvl, const int md)
+{
+     level = lvl;
+     mode = md;
+}
+
+/*
+ * Agrees on the first offer of permessage-deflate in ext, the value of a
+ * Sec-WebSocket-Extensions header, that can be honoured. As server, ext
+ * holds the client's offers; as client, the server's response.
+ */
+int
+pmd_negotiate(const chunk_t *ext, const bool server, pmd_params_t *params)
+{
+     const char *p = ext->p, *end = ext->p + ext->len;
+     while (p < end) {
+          const char *q = memchr(p, ',', end - p);
+          if (!q)
+               q = end;
+
+          if (0 == parse_offer(p, q, server, params)) {
+               if (server)
+                    fit_mode(params);
+               return 0;
+          }
+
+          p = q + 1;
+     }
+
+     wsd_errno = WSD_EINPUT;
+     return (-1);
+}
+
+/* Writes response header line accepting params to dst; returns length */
+unsigned int
+pmd_response(char *dst, const pmd_params_t *params)
+{
+     int len = snprintf(dst,
+                        PMD_MAX_RESPONSE_LEN,
+                        "%s%s%s%s",
+                        PMD_EXT,
+                        PMD_NAME,
+                        params->server_no_context_takeover ?
+                        "; server_no_context_takeover" : "",
+                        params->client_no_context_takeover ?
+                        "; client_no_context_takeover" : "");
+     if (params->server_max_window_bits)
+          len += snprintf(&dst[len],
+                          PMD_MAX_RESPONSE_LEN - len,
+                          "; server_max_window_bits=%hhu",
+                          params->server_max_window_bits);
+     if (params->client_max_window_bits)
+          len += snprintf(&dst[len],
+                          PMD_MAX_RESPONSE_LEN - len,
+                          "; client_max_window_bits=%hhu",
+                          params->client_max_window_bits);
+     len += snprintf(&dst[len], PMD_MAX_RESPONSE_LEN - len, "\r\n");
+
+     A(PMD_MAX_RESPONSE_LEN > len);
+     return len;
+}
+
+/*
+ * Sets up compression for one end of a connection as agreed on. Its
+ * contexts are set up once there is a message to deflate or inflate.
+ */
+pmd_t *
+pmd_alloc(const pmd_params_t *params, const bool server)
+{
+     pmd_t *pmd = malloc(sizeof(pmd_t));
+     if (!pmd) {
+          wsd_errno = WSD_ENOMEM;
+          return NULL;
+     }
+     memset(pmd, 0, sizeof(pmd_t));
+
+     pmd->tx_bits = server ?
+          params->server_max_window_bits : params->client_max_window_bits;
+     pmd->rx_bits = server ?
+          params->client_max_window_bits : params->server_max_window_bits;
+     if (0 == pmd->tx_bits)
+          pmd->tx_bits = PMD_MAX_WINDOW_BITS;
+     if (0 == pmd->rx_bits)
+          pmd->rx_bits = PMD_MAX_WINDOW_BITS;
+     pmd->tx_mem_level = PMD_LEAN == mode ? PMD_LEAN_MEM_LEVEL : PMD_MEM_LEVEL;
+
+     pmd->tx_reset = server ?
+          params->server_no_context_takeover :
+          params->client_no_context_takeover;
+     pmd->rx_reset = server ?
+          params->client_no_context_takeover :
+          params->server_no_context_takeover;
+     pmd->shared = PMD_SHARED == mode && pmd->tx_reset && pmd->rx_reset;
+
+     mem += sizeof(pmd_t);
+     num++;
+     return pmd;
+}
+
+void
+pmd_free(pmd_t *pmd)
+{
+     if (pmd->tx) {
+          deflateEnd(pmd->tx);
+          z_free(pmd->tx);
+     }
+     if (pmd->shared)
+          put_rx(pmd);
+     if (pmd->rx) {
+          inflateEnd(pmd->rx);
+          z_free(pmd->rx);
+     }
+
+     mem -= sizeof(pmd_t);
+     num--;
+     free(pmd);
+}
+
+/*
+ * Releases contexts of an idle connection that it can do without. The
+ * deflater always goes; every record ends on a block boundary, so the
+ * next is as good deflated afresh, if with a smaller window from now
+ * on. The inflater goes iff the peer doesn't refer back to earlier
+ * messages and none is under way.
+ */
+void
+pmd_release(pmd_t *pmd)
+{
+     if (pmd->tx) {
+          deflateEnd(pmd->tx);
+          z_free(pmd->tx);
+          pmd->tx = NULL;
+          if (PMD_LEAN_WINDOW_BITS < pmd->tx_bits)
+               pmd->tx_bits = PMD_LEAN_WINDOW_BITS;
+          pmd->tx_mem_level = PMD_LEAN_MEM_LEVEL;
+     }
+
+     if (pmd->rx && pmd->rx_reset && !pmd->rx_msg) {
+          inflateEnd(pmd->rx);
+          z_free(pmd->rx);
+          pmd->rx = NULL;
+     }
+}
+
+/* Bytes held for compression, contexts pooled and shared included */
+unsigned long int
+pmd_mem(unsigned int *n)
+{
+     if (n)
+          *n = num;
+     return mem;
+}
+
+/* Most that pmd_deflate() writes for len bytes of payload */
+unsigned long int
+pmd_deflate_bound(pmd_t *pmd, unsigned long int len)
+{
+     /* deflateBound() assumes Z_FINISH; a sync flush takes a few more */
+     return deflateBound(pmd->tx, len) + 2 * PMD_TAIL_LEN;
+}
+
+/*
+ * Deflates len bytes of a message into dst, which must have room for
+ * pmd_deflate_bound() bytes; fin iff they end the message. Returns the
+ * number of bytes written. A shared deflater starts afresh on every
+ * call, so records of different connections may come in any order.
+ */
+long
+pmd_deflate(pmd_t *pmd,
+            const char *src,
+            unsigned long int len,
+            char *dst,
+            unsigned long int dst_len,
+            const bool fin)
+{
+     z_stream *z = tx_context(pmd);
+     if (!z)
+          return (-1);
+
+     z->next_in = (Bytef*)src;
+     z->avail_in = len;
+     z->next_out = (Bytef*)dst;
+     z->avail_out = dst_len;
+
+     /* Z_BUF_ERROR iff flushed already and nothing since */
+     int rv = deflate(z, Z_SYNC_FLUSH);
+     if ((Z_OK != rv && Z_BUF_ERROR != rv) || z->avail_in || !z->avail_out) {
+          if (pmd->shared)
+               AZ(deflateReset(z));
+          wsd_errno = WSD_ENOMEM;
+          return (-1);
+     }
+
+     unsigned long int n = dst_len - z->avail_out;
+     if (!fin) {
+          if (pmd->shared)
+               AZ(deflateReset(z));
+          return n;
+     }
+
+     if (PMD_TAIL_LEN <= n && 0 == memcmp(&dst[n - PMD_TAIL_LEN],
+                                          tail,
+                                          PMD_TAIL_LEN)) {
+          n -= PMD_TAIL_LEN;
+     } else {
+          /* Nothing new; empty stored block, see section 7.2.3.6 */
+          A(0 == n);
+          dst[n++] = 0x00;
+     }
+
+     if (pmd->tx_reset || pmd->shared)
+          AZ(deflateReset(z));
+
+     return n;
+}
+
+/*
+ * Inflates up to *src_len bytes of a message into dst; fin iff the
+ * frame they belong to ends the message. On return *src_len holds the
+ * number of bytes consumed and *dst_len the number written. Returns 1
+ * once the message is inflated in full, tail and all, 0 if not yet, and
+ * -1 if it is no valid deflate data or no inflater can be set up.
+ */
+int
+pmd_inflate(pmd_t *pmd,
+            const char *src,
+            unsigned long int *src_len,
+            char *dst,
+            unsigned long int *dst_len,
+            const bool fin)
+{
+     z_stream *z = rx_context(pmd);
+     if (!z)
+          return (-1);
+
+     z->next_in = (Bytef*)src;
+     z->avail_in = *src_len;
+     z->next_out = (Bytef*)dst;
+     z->avail_out = *dst_len;
+
+     int rv = inflate(z, Z_SYNC_FLUSH);
+     if (Z_STREAM_END == rv)
+          rv = inflateReset(z); /* Block with BFINAL set, section 7.2.3.3 */
+     if (Z_OK != rv && Z_BUF_ERROR != rv)
+          goto error;
+     *src_len -= z->avail_in;
+
+     if (fin && 0 == z->avail_in && z->avail_out) {
+          z->next_in = (Bytef*)&tail[pmd->rx_tail];
+          z->avail_in = PMD_TAIL_LEN - pmd->rx_tail;
+          rv = inflate(z, Z_SYNC_FLUSH);
+          if (Z_OK != rv && Z_BUF_ERROR != rv)
+               goto error;
+          pmd->rx_tail = PMD_TAIL_LEN - z->avail_in;
+     }
+     *dst_len -= z->avail_out;
+
+     /* Room left over, so nothing held back */
+     if (fin && PMD_TAIL_LEN == pmd->rx_tail && z->avail_out) {
+          pmd->rx_tail = 0;
+          if (pmd->shared)
+               put_rx(pmd);
+          return 1;
+     }
+
+     return 0;
+
+error:
+     wsd_errno = WSD_EBADREQ;
+     return (-1);
+}
+
+/*
+ * Narrows the parameters agreed on as server to what the memory mode
+ * allows. A client that offered client_max_window_bits, with or without
+ * a value, may be held to a smaller window; no context takeover may be
+ * asked of any, section 7.1.1.
+ */
+void
+fit_mode(pmd_params_t *params)
+{
+     switch (mode) {
+     case PMD_LEAN:
+          if (0 == params->server_max_window_bits
+              || PMD_LEAN_WINDOW_BITS < params->server_max_window_bits)
+               params->server_max_window_bits = PMD_LEAN_WINDOW_BITS;
+          if (PMD_LEAN_WINDOW_BITS < params->client_max_window_bits)
+               params->client_max_window_bits = PMD_LEAN_WINDOW_BITS;
+          break;
+     case PMD_SHARED:
+          params->server_no_context_takeover = true;
+          params->client_no_context_takeover = true;
+          params->client_max_window_bits = 0;
+          break;
+     default:
+          params->client_max_window_bits = 0;
+     }
+}
+
+/* Deflater of pmd, set up as needed; NULL if out of memory */
+z_stream *
+tx_context(pmd_t *pmd)
+{
+     z_stream **z = pmd->shared ? &shared_tx[pmd->tx_bits] : &pmd->tx;
+     if (*z)
+          return *z;
+
+     if (!(*z = z_alloc()))
+          return NULL;
+
+     if (Z_OK != deflateInit2(*z,
+                              level,
+                              Z_DEFLATED,
+                              -pmd->tx_bits,
+                              pmd->tx_mem_level,
+                              Z_DEFAULT_STRATEGY)) {
+          z_free(*z);
+          *z = NULL;
+          wsd_errno = WSD_ENOMEM;
+          return NULL;
+     }
+
+     return *z;
+}
+
+/* Inflater of pmd, borrowed from the pool or set up as needed */
+z_stream *
+rx_context(pmd_t *pmd)
+{
+     if (pmd->rx)
+          return pmd->rx;
+
+     if (pmd->shared && pool_num)
+          return pmd->rx = pool[--pool_num];
+
+     if (!(pmd->rx = z_alloc()))
+          return NULL;
+
+     int bits = pmd->shared ? PMD_MAX_WINDOW_BITS : pmd->rx_bits;
+     if (Z_OK != inflateInit2(pmd->rx, -bits)) {
+          z_free(pmd->rx);
+          pmd->rx = NULL;
+          wsd_errno = WSD_ENOMEM;
+          return NULL;
+     }
+
+     return pmd->rx;
+}
+
+/* Returns borrowed inflater, if any, to the pool */
+void
+put_rx(pmd_t *pmd)
+{
+     if (!pmd->rx)
+          return;
+
+     if (PMD_POOL_MAX > pool_num && Z_OK == inflateReset(pmd->rx)) {
+          pool[pool_num++] = pmd->rx;
+     } else {
+          inflateEnd(pmd->rx);
+          z_free(pmd->rx);
+     }
+     pmd->rx = NULL;
+}
+
+z_stream *
+z_alloc()
+{
+     z_stream *z = malloc(sizeof(z_stream));
+     if (!z) {
+          wsd_errno = WSD_ENOMEM;
+          return NULL;
+     }
+     memset(z, 0, sizeof(z_stream));
+     z->zalloc = zalloc;
+     z->zfree = zfree;
+
+     mem += sizeof(z_stream);
+     return z;
+}
+
+void
+z_free(z_stream *z)
+{
+     mem -= sizeof(z_stream);
+     free(z);
+}
+
+/* Allocators of zlib that keep count; size goes ahead of each block */
+voidpf
+zalloc(voidpf opaque, uInt items, uInt size)
+{
+     (void)opaque;
+     size_t len = (size_t)items * size;
+     max_align_t *p = malloc(sizeof(max_align_t) + len);
+     if (!p)
+          return Z_NULL;
+
+     *(size_t*)p = len;
+     mem += len;
+     return p + 1;
+}
+
+void
+zfree(voidpf opaque, voidpf ptr)
+{
+     (void)opaque;
+     max_align_t *p = (max_align_t*)ptr - 1;
+     mem -= *(size_t*)p;
+     free(p);
+}
+
+/* Parses offer from p to end, rejecting what zlib or we can't do */
+int
+parse_offer(const char *p,
+            const char *end,
+            const bool server,
+            pmd_params_t *params)
+{
+     memset(params, 0, sizeof(pmd_params_t));
+
+     chunk_t name, val;
+     p = next_elem(p, end, &name, &val);
+     if (!is(&name, PMD_NAME) || val.p)
+          return (-1);
+
+     unsigned int seen = 0, param;
+     while (p < end) {
+          p = next_elem(p, end, &name, &val);
+
+          if (is(&name, "server_no_context_takeover") && !val.p) {
+               param = PMD_SERVER_NCT;
+               params->server_no_context_takeover = true;
+          } else if (is(&name, "client_no_context_takeover") && !val.p) {
+               param = PMD_CLIENT_NCT;
+               params->client_no_context_takeover = true;
+          } else if (is(&name, "server_max_window_bits") && val.p) {
+               param = PMD_SERVER_MWB;
+               int bits = window_bits(&val);
+               /* zlib deflates with no fewer than 9; see deflateInit2() */
+               if (0 > bits || (server && 8 == bits))
+                    return (-1);
+               params->server_max_window_bits = bits;
+          } else if (is(&name, "client_max_window_bits")) {
+               param = PMD_CLIENT_MWB;
+               /* Value optional in offer only; a mere hint to the server */
+               int bits = server && !val.p ?
+                    PMD_MAX_WINDOW_BITS : window_bits(&val);
+               if (0 > bits || (!server && 8 == bits))
+                    return (-1);
+               params->client_max_window_bits = bits;
+          } else {
+               return (-1);
+          }
+
+          if (seen & param)
+               return (-1);
+          seen |= param;
+     }
+
+     return 0;
+}
+
+/*
+ * Splits element of a parameter list at p, up to the next semicolon or
+ * end, into name and value, if any; see section 5 RFC7692. Returns
+ * start of the next element.
+ */
+const char *
+next_elem(const char *p, const char *end, chunk_t *name, chunk_t *val)
+{
+     const char *q = memchr(p, ';', end - p);
+     if (!q)
+          q = end;
+
+     name->p = (char*)p;
+     name->len = q - p;
+     val->p = NULL;
+     val->len = 0;
+
+     const char *eq = memchr(p, '=', q - p);
+     if (eq) {
+          name->len = eq - p;
+          val->p = (char*)eq + 1;
+          val->len = q - eq - 1;
+          strip(val);
+          if (2 <= val->len && '"' == val->p[0] && '"' == val->p[val->len - 1]) {
+               val->p++;
+               val->len -= 2;
+          }
+     }
+     strip(name);
+
+     return q < end ? q + 1 : end;
+}
+
+void
+strip(chunk_t *chk)
+{
+     while (chk->len && (' ' == chk->p[0] || '\t' == chk->p[0])) {
+          chk->p++;
+          chk->len--;
+     }
+
+     while (chk->len
+            && (' ' == chk->p[chk->len - 1] || '\t' == chk->p[chk->len - 1]))
+          chk->len--;
+}
+
+bool
+is(const chunk_t *chk, const char *s)
+{
+     return strlen(s) == chk->len && 0 == strncasecmp(chk->p, s, chk->len);
+}
+
+/* Value of a *_max_window_bits parameter, 8 to 15, or -1 */
+int
+window_bits(const chunk_t *val)
+{
+     if (!val->p || 0 == val->len || 2 < val->len || '0' == val->p[0])
+          return (-1);
+
+     int bits = 0;
+     for (unsigned int i = 0; i < val->len; i++) {
+          if ('0' > val->p[i] || '9' < val->p[i])
+               return (-1);
+          bits = bits * 10 + val->p[i] - '0';
+     }
+
+     return 8 <= bits && PMD_MAX_WINDOW_BITS >= bits ? bits : (-1);
+}
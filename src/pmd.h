@@ -0,0 +1,74 @@
+#ifndef __PMD_H__
+#define __PMD_H__
+
+#include <zlib.h>
+
+#include "types.h"
+
+/*
+ * Per-message compression extension permessage-deflate; see RFC7692.
+ * Every message is deflated on its own, with Z_SYNC_FLUSH, and sent with
+ * the four trailing octets of the flush stripped; the receiving end puts
+ * them back before inflating. Unless a *_no_context_takeover parameter
+ * was agreed on, the LZ77 window carries over from message to message.
+ */
+
+#define PMD_EXT              "Sec-WebSocket-Extensions: "
+#define PMD_NAME             "permessage-deflate"
+#define PMD_TAIL_LEN         4       /* 0x00 0x00 0xff 0xff, section 7.2.1 */
+#define PMD_MAX_WINDOW_BITS  15
+#define PMD_MAX_RESPONSE_LEN 160     /* Header line, parameters and all    */
+
+/* Memory modes, from most compression to least memory; see pmd_init() */
+#define PMD_FULL   0            /* Own contexts, largest windows          */
+#define PMD_LEAN   1            /* Own contexts, small windows            */
+#define PMD_SHARED 2            /* No context takeover, contexts borrowed */
+
+#define PMD_LEAN_WINDOW_BITS 10      /* Window of lean and idle contexts   */
+#define PMD_LEAN_MEM_LEVEL   2       /* Hash table of lean and idle ones   */
+
+/* Parameters of the offer agreed on; window bits 0 iff not specified */
+typedef struct {
+     bool    server_no_context_takeover;
+     bool    client_no_context_takeover;
+     uint8_t server_max_window_bits;
+     uint8_t client_max_window_bits;
+} pmd_params_t;
+
+/* Contexts are set up on first use and may be released when idle */
+typedef struct pmd {
+     z_stream *tx;              /* Deflates messages sent iff set up      */
+     z_stream *rx;              /* Inflates messages received iff set up  */
+     uint8_t   tx_bits;         /* Window bits to deflate with            */
+     uint8_t   tx_mem_level;    /* Memory level to deflate with           */
+     uint8_t   rx_bits;         /* Window bits to inflate with            */
+     bool      tx_reset;        /* No context takeover when sending       */
+     bool      rx_reset;        /* No context takeover when receiving     */
+     bool      shared;          /* Contexts borrowed per record/message   */
+     bool      rx_msg;          /* Receiving compressed message           */
+     uint8_t   rx_tail;         /* Octets of stripped tail inflated       */
+} pmd_t;
+
+void pmd_init(const int level, const int mode);
+
+int pmd_negotiate(const chunk_t *ext, const bool server, pmd_params_t *params);
+unsigned int pmd_response(char *dst, const pmd_params_t *params);
+pmd_t *pmd_alloc(const pmd_params_t *params, const bool server);
+void pmd_free(pmd_t *pmd);
+void pmd_release(pmd_t *pmd);
+unsigned long int pmd_mem(unsigned int *num);
+unsigned long int pmd_deflate_bound(pmd_t *pmd, unsigned long int len);
+long pmd_deflate(pmd_t *pmd,
+                 const char *src,
+                 unsigned long int len,
+                 char *dst,
+                 unsigned long int dst_len,
+                 const bool fin);
+int pmd_inflate(pmd_t *pmd,
+                const char *src,
+                unsigned long int *src_len,
+                char *dst,
+                unsigned long int *dst_len,
+                const bool fin);
+
+#endif /* #ifndef __PMD_H__ */
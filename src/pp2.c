@@ -29,6 +29,8 @@
  */
 
 #include <errno.h>
+#include <limits.h>
+#include <syslog.h>
 #include <unistd.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -37,6 +39,7 @@
 #include <string.h>
 #include <netdb.h>
 #include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
@@ -50,43 +53,114 @@
 
 #include "common.h"
 #include "list.h"
-#include "hashtable.h"
+#include "sktable.h"
 #include "pp2.h"
+#include "pp2z.h"
+#include "ws.h"
+#include "ws_wsd.h"
 
 #define PP2_SIG_VER_CMD_FAM_LEN 14
 #define PP2_ADDR_LEN            12
 #define PP2_ADDR_TLVS_LEN       (18 + PP2_ADDR_LEN)
 #define PP2_HEADER_LEN         (2 + PP2_ADDR_TLVS_LEN + PP2_SIG_VER_CMD_FAM_LEN)
+#define PP2_CONT_LEN            sizeof(struct pp2_tlv)
+#define PP2_OPCODE_LEN          (sizeof(struct pp2_tlv) + 1)
+#define PP2_BATCH_TLVS_LEN      (PP2_CONT_LEN + sizeof(struct pp2_tlv) + 4)
+#define PP2_BATCH_HEADER_LEN    (2 + PP2_BATCH_TLVS_LEN + PP2_SIG_VER_CMD_FAM_LEN)
+#define PP2_VARINT_MAX_LEN      10
+#define PP2_COMPACT_MAX_LEN     (1 + 2 * PP2_VARINT_MAX_LEN)
+#define PP2_LOCAL_LEN           (2 + PP2_CONT_LEN + PP2_SIG_VER_CMD_FAM_LEN)
 #define PP2_VER_BITS(byte)      ((0xf0 & byte) >> 4)
 #define PP2_CMD_BITS(byte)      (0xf & byte)
 #define PP2_FAM_BITS(byte)      ((0xf0 & byte) >> 4)
 #define PP2_PROTO_BITS(byte)    (0xf & byte)
 
+_Static_assert(sizeof(ipv4_addr_t) == PP2_ADDR_LEN,
+               "ipv4_addr_t must match the PP2 IPv4 address block");
+_Static_assert(PP2_HEADER_LEN + PP2_CONT_LEN + PP2_OPCODE_LEN
+               <= PP2_MAX_HEADER_LEN,
+               "PP2_MAX_HEADER_LEN must cover every record header");
+_Static_assert(PP2_BATCH_HEADER_LEN + sizeof(struct pp2_entry)
+               <= PP2_MAX_HEADER_LEN,
+               "PP2_MAX_HEADER_LEN must cover opening a batch");
+_Static_assert(PP2_LOCAL_LEN + PP2_COMPACT_MAX_LEN <= PP2_MAX_HEADER_LEN,
+               "PP2_MAX_HEADER_LEN must cover switching to compact records");
+
 sk_t *pp2sk = NULL;
 
+/*
+ * Batch being collected at the end of the send buffer of pp2sk, if any,
+ * and the timer ending it; see put_entry()
+ */
+static sk_t *tsk = NULL;
+static int batch_usec = 0;
+static unsigned int batch_len = 0;
+
+/* Octets of entries of batch from backend yet to decode */
+static unsigned long int batch_left = 0;
+
+/*
+ * Compact records either way once agreed on; records to the backend
+ * turn compact behind a LOCAL record saying so, see pp2_encode_frame()
+ */
+static bool rx_compact = false;
+static bool tx_compact = false;
+
+/* Credit counts from the LOCAL record saying so once agreed on */
+static bool flow = false;
+
 extern unsigned int wsd_errno;
-extern DECLARE_HASHTABLE(sk_hash, 4);
+extern sktable_t sk_table;
 extern const wsd_config_t *wsd_cfg;
-extern struct list_head *sk_list;
+extern int epfd;
 
 static const uint8_t pp2_sig_ver_cmd_fam[] =
 { 0x0d, 0x0a, 0x0d, 0x0a, 0x00, 0x0d, /* pp2 signature               */
   0x0a, 0x51, 0x55, 0x49, 0x54, 0x0a, /* cont'd pp2 signature        */
   0x21, 0x11 };                       /* version, command and family */
+static const uint8_t pp2_sig_ver_cmd_fam_local[] =
+{ 0x0d, 0x0a, 0x0d, 0x0a, 0x00, 0x0d, /* pp2 signature               */
+  0x0a, 0x51, 0x55, 0x49, 0x54, 0x0a, /* cont'd pp2 signature        */
+  0x20, 0x00 };                       /* LOCAL command, no addresses */
 static const uint8_t pp2_sig[] =
 { 0x0d, 0x0a, 0x0d, 0x0a, 0x00, 0x0d, 0x0a, 0x51, 0x55, 0x49, 0x54, 0x0a };
 
 static void pp2_put_proxy_hdr_v2(skb_t *dst, const uint8_t *h);
 static void pp2_put_connhash(skb_t *dst, long unsigned int hash);
 static void pp2_put_payloadlen(skb_t *dst, unsigned int len);
-static long int pp2_get_connhash(skb_t *src);
-static int pp2_get_payloadlen(skb_t *src);
+static void put_bare_header(skb_t *dst, const sk_t *sk, unsigned int len);
+static void put_tlv(skb_t *dst, uint8_t type, const char *value, uint16_t len);
 static void pp2_printf(FILE *stream, char *p);
+static int deliver(sk_t *sk,
+                   const unsigned long int hash,
+                   const unsigned int len,
+                   const char byte1,
+                   const unsigned int old_rdpos);
+static int decode_entry(sk_t *sk);
+static int decode_compact(sk_t *sk);
+static bool is_valid_status(const unsigned int status);
+static unsigned int open_len(http_req_t *req);
+static int agree_flow(sk_t *sk, const unsigned int old_rdpos);
+static void control(const unsigned long int hash,
+                    const int close,
+                    const bool ping,
+                    const long int rate,
+                    const int prio,
+                    const long int credit);
+static int put_compact(sk_t *sk, const wsframe_t *wsf, const bool more);
+static unsigned int put_varint(char *dst, uint64_t v);
+static int get_varint(const char *p, const char *end, uint64_t *v);
+static int put_entry(sk_t *sk, const wsframe_t *wsf, const bool more);
+static bool collecting();
+static int batch_read(sk_t *sk);
+static int batch_recv(sk_t *sk);
+static int batch_close(sk_t *sk);
 static void pp2_encode_header(skb_t *buf,
-                              struct sockaddr_in *src,
-                              struct sockaddr_in *dst,
+                              const ipv4_addr_t *addr,
                               const unsigned long int hash,
-                              const unsigned long int payload_len);
+                              const unsigned long int payload_len,
+                              const bool more,
+                              const int opcode);
 
 int
 pp2_recv(sk_t *sk)
@@ -110,7 +184,16 @@ pp2_recv(sk_t *sk)
 int
 pp2_decode_frame(sk_t *sk)
 {
-     if (PP2_HEADER_LEN >= skb_rdsz(sk->recvbuf)) {
+     /* Inside a batch, entries come one at a time */
+     if (batch_left)
+          return decode_entry(sk);
+
+     if (rx_compact
+         && skb_rdsz(sk->recvbuf)
+         && pp2_sig[0] != sk->recvbuf->data[sk->recvbuf->rdpos])
+          return decode_compact(sk);
+
+     if (sizeof(struct proxy_hdr_v2) > skb_rdsz(sk->recvbuf)) {
           wsd_errno = WSD_EINPUT;
           return (-1);
      }
@@ -124,51 +207,148 @@ pp2_decode_frame(sk_t *sk)
      if (0 != memcmp(hdr->sig, pp2_sig, sizeof(pp2_sig)))
           goto error;
 
-     if (0x2 != PP2_VER_BITS(hdr->ver_cmd) ||
-         0x1 != PP2_CMD_BITS(hdr->ver_cmd) ||
-         0x1 != PP2_FAM_BITS(hdr->fam)     ||
-         0x1 != PP2_PROTO_BITS(hdr->fam))
-          goto error;
-     
-     union proxy_addr *addr =
-          (union proxy_addr*)&sk->recvbuf->data[sk->recvbuf->rdpos];
-     sk->recvbuf->rdpos += PP2_ADDR_LEN;
-     
-     long int val = pp2_get_connhash(sk->recvbuf);
-     if (0 > val)
+     bool local = 0x0 == PP2_CMD_BITS(hdr->ver_cmd);
+     if (0x2 != PP2_VER_BITS(hdr->ver_cmd))
           goto error;
 
-     unsigned long int hash = (unsigned long int)val;
-
-     val = pp2_get_payloadlen(sk->recvbuf);
-     if (0 > val)
+     if (!local && (0x1 != PP2_CMD_BITS(hdr->ver_cmd) ||
+                    0x1 != PP2_FAM_BITS(hdr->fam)     ||
+                    0x1 != PP2_PROTO_BITS(hdr->fam)))
           goto error;
 
-     unsigned int len = (unsigned int)val;
+     unsigned int hdr_len = be16toh(hdr->len);
+     if (!local && PP2_ADDR_LEN > hdr_len)
+          goto error;
 
-     if (skb_rdsz(sk->recvbuf) < len) {
+     if (skb_rdsz(sk->recvbuf) < hdr_len) {
           sk->recvbuf->rdpos = old_rdpos;
-          wsd_errno = WSD_EAGAIN;
+          wsd_errno = WSD_EINPUT;
           return (-1);
      }
 
-     sk_t *cln_sk = NULL;
-     hash_for_each_possible(sk_hash, cln_sk, hash_node, hash) {
-          if (cln_sk->hash == hash)
+     if (!local)
+          sk->recvbuf->rdpos += PP2_ADDR_LEN;
+
+     /* TLVs in any order; unknown ones are skipped */
+     unsigned long int hash = 0;
+     unsigned int len = 0;
+     bool has_hash = false, has_len = false, more = false, batch = false;
+     bool compact = false, open = false, ping = false;
+     long int rate = -1, credit = -1;
+     int close = -1;
+     int prio = -1, opcode = WS_TEXT_FRAME;
+     unsigned int end = old_rdpos + sizeof(struct proxy_hdr_v2) + hdr_len;
+     while (sk->recvbuf->rdpos < end) {
+          struct pp2_tlv *tlv =
+               (struct pp2_tlv*)&sk->recvbuf->data[sk->recvbuf->rdpos];
+          if (end - sk->recvbuf->rdpos < sizeof(struct pp2_tlv))
+               goto error;
+
+          unsigned int tlv_len = tlv->length_hi << 8 | tlv->length_lo;
+          sk->recvbuf->rdpos += sizeof(struct pp2_tlv);
+          if (end - sk->recvbuf->rdpos < tlv_len)
+               goto error;
+          sk->recvbuf->rdpos += tlv_len;
+
+          switch (tlv->type) {
+          case PP2_TYPE_CONNHASH:
+               if (sizeof(unsigned long int) != tlv_len)
+                    goto error;
+               hash = *(unsigned long int*)tlv->value;
+               has_hash = true;
                break;
+          case PP2_TYPE_PAYLOADLEN:
+               if (sizeof(unsigned int) != tlv_len)
+                    goto error;
+               len = *(unsigned int*)tlv->value;
+               has_len = true;
+               break;
+          case PP2_TYPE_CONTINUATION:
+               more = true;
+               break;
+          case PP2_TYPE_OPCODE:
+               if (1 != tlv_len
+                   || (WS_TEXT_FRAME != tlv->value[0]
+                       && WS_BINARY_FRAME != tlv->value[0]))
+                    goto error;
+               opcode = tlv->value[0];
+               break;
+          case PP2_TYPE_BATCH:
+               batch = true;
+               break;
+          case PP2_TYPE_COMPACT:
+               compact = true;
+               break;
+          case PP2_TYPE_OPEN:
+               open = true;
+               break;
+          case PP2_TYPE_CLOSE:
+               if (2 != tlv_len)
+                    goto error;
+               close = tlv->value[0] << 8 | tlv->value[1];
+               break;
+          case PP2_TYPE_PING:
+               ping = true;
+               break;
+          case PP2_TYPE_RATE:
+               if (sizeof(unsigned int) != tlv_len)
+                    goto error;
+               rate = *(unsigned int*)tlv->value;
+               break;
+          case PP2_TYPE_PRIORITY:
+               if (1 != tlv_len || 1 < tlv->value[0])
+                    goto error;
+               prio = tlv->value[0];
+               break;
+          case PP2_TYPE_CREDIT:
+               if (sizeof(unsigned int) != tlv_len)
+                    goto error;
+               credit = *(unsigned int*)tlv->value;
+               break;
+          }
      }
 
-     if (NULL == cln_sk) {
-          sk->recvbuf->rdpos += len;
+     /* Control record; see pp2.h */
+     if (0 <= close
+         || ping
+         || 0 <= rate
+         || 0 <= prio
+         || (0 <= credit && has_hash)) {
+          if (!has_hash || len)
+               goto error;
+          control(hash, close, ping, rate, prio, credit);
           skb_compact(sk->recvbuf);
           return 0;
      }
 
-     wsframe_t wsf;
-     memset(&wsf, 0, sizeof(wsf));
-     wsf.payload_len = len;
-     
-     return cln_sk->proto->encode_frame(cln_sk, &wsf);
+     /*
+      * Entries of batch follow, or compact records if offered; other
+      * LOCAL records are skipped
+      */
+     if (local) {
+          if (batch && has_len)
+               batch_left = len;
+          if (compact && wsd_cfg->compact_link && !rx_compact) {
+               rx_compact = true;
+               syslog(LOG_INFO, "Backend link compact");
+          }
+          if (0 <= credit && wsd_cfg->window && !flow)
+               return agree_flow(sk, old_rdpos);
+          return 0;
+     }
+
+     if (!has_hash || !has_len)
+          goto error;
+
+     /* Open records are for the backend; echoed ones are skipped */
+     if (open) {
+          if (len)
+               goto error;
+          skb_compact(sk->recvbuf);
+          return 0;
+     }
+
+     return deliver(sk, hash, len, (more ? 0 : 0x80) | opcode, old_rdpos);
 
      error:
      sk->recvbuf->rdpos = old_rdpos;
@@ -177,24 +357,252 @@ pp2_decode_frame(sk_t *sk)
      return (-1);
 }
 
+/* True iff status may be sent in a close frame; see section 7.4 RFC6455 */
+bool
+is_valid_status(const unsigned int status)
+{
+     return (1000 <= status && status <= 1003)
+          || (1007 <= status && status <= 1014)
+          || (3000 <= status && status <= 4999);
+}
+
+/*
+ * Applies control record to upgraded client hash, if still there; -1
+ * means no such TLV. Clients are dropped without closing handshake for
+ * a status no close frame may carry, e.g. 1006.
+ */
+void
+control(const unsigned long int hash,
+        const int close,
+        const bool ping,
+        const long int rate,
+        const int prio,
+        const long int credit)
+{
+     sk_t *cln_sk = sktable_get(&sk_table, hash);
+     if (!cln_sk || !cln_sk->ctlbuf || cln_sk->close)
+          return;
+
+     if (0 <= close) {
+          bool valid = is_valid_status(close);
+          if (valid && (cln_sk->closing || cln_sk->close_on_write))
+               return;
+          if (valid
+              && 0 == cln_sk->proto->start_closing_handshake(cln_sk,
+                                                             close,
+                                                             false))
+               return;
+
+          /* Closes on next write; the close frame, if any, is lost */
+          if (!cln_sk->close_code)
+               cln_sk->close_code = is_valid_status(close) ? close : WS_1006;
+          cln_sk->close = 1;
+          if (!(cln_sk->events & EPOLLOUT))
+               turn_on_events(cln_sk, EPOLLOUT);
+          return;
+     }
+
+     if (ping && !cln_sk->closing)
+          cln_sk->proto->ping(cln_sk, false);
+
+     if (0 <= rate)
+          ws_set_rate(cln_sk, rate);
+
+     if (0 <= prio)
+          cln_sk->low_prio = 1 == prio;
+
+     if (0 <= credit && flow)
+          ws_add_credit(cln_sk, credit);
+}
+
+/*
+ * Backend agreed on flow control; marks where credit starts counting,
+ * with a window's worth for every client
+ */
+int
+agree_flow(sk_t *sk, const unsigned int old_rdpos)
+{
+     if (PP2_LOCAL_LEN + sizeof(unsigned int) > skb_wrsz(pp2sk->sendbuf)) {
+          sk->recvbuf->rdpos = old_rdpos;
+          wsd_errno = WSD_EAGAIN;
+          return (-1);
+     }
+
+     batch_len = 0;
+     pp2_put_local(pp2sk->sendbuf,
+                   PP2_TYPE_CREDIT,
+                   (char*)&wsd_cfg->window,
+                   sizeof(unsigned int));
+     if (!(pp2sk->events & EPOLLOUT))
+          turn_on_events(pp2sk, EPOLLOUT);
+
+     flow = true;
+     unsigned int i;
+     sk_t *pos = NULL;
+     sktable_for_each(&sk_table, pos, i) {
+          pos->credit = wsd_cfg->window;
+          pos->owed = 0;
+     }
+     syslog(LOG_INFO, "Backend link flow controlled");
+     return 0;
+}
+
+/* Passes payload of len at read position of sk on to connection hash */
 int
-pp2_encode_frame(sk_t *sk, wsframe_t *wsf)
+deliver(sk_t *sk,
+        const unsigned long int hash,
+        const unsigned int len,
+        const char byte1,
+        const unsigned int old_rdpos)
 {
-     if ((wsf->payload_len + PP2_HEADER_LEN) > skb_wrsz(pp2sk->sendbuf)) {
+     if (skb_rdsz(sk->recvbuf) < len) {
+          sk->recvbuf->rdpos = old_rdpos;
           wsd_errno = WSD_EAGAIN;
           return (-1);
      }
 
-     pp2_encode_header(pp2sk->sendbuf,
-                       &sk->src_addr,
-                       &sk->dst_addr,
-                       sk->hash,
-                       wsf->payload_len);
+     sk_t *cln_sk = sktable_get(&sk_table, hash);
 
-     if (LOG_VVERBOSE <= wsd_cfg->verbose) {
-          pp2_printf(stdout,
-                     &pp2sk->sendbuf->data[pp2sk->sendbuf->wrpos -
-                                           PP2_HEADER_LEN]);
+     /* Gone, not a websocket yet or no longer taking frames */
+     if (NULL == cln_sk || !cln_sk->ctlbuf || cln_sk->close) {
+          sk->recvbuf->rdpos += len;
+          skb_compact(sk->recvbuf);
+          return 0;
+     }
+
+     if (flow)
+          cln_sk->owed += len;
+
+     wsframe_t wsf;
+     memset(&wsf, 0, sizeof(wsf));
+     wsf.payload_len = len;
+     wsf.byte1 = byte1;
+
+     /* Record consumed iff frame encoded; try again from the top if not */
+     int rv = cln_sk->proto->encode_frame(cln_sk, &wsf);
+     if (0 > rv) {
+          sk->recvbuf->rdpos = old_rdpos;
+          if (flow)
+               cln_sk->owed -= len;
+     }
+
+     return rv;
+}
+
+/* Decodes next entry of batch; opcode 0 in first entry of message is text */
+int
+decode_entry(sk_t *sk)
+{
+     skb_t *b = sk->recvbuf;
+     if (sizeof(struct pp2_entry) > skb_rdsz(b)) {
+          wsd_errno = WSD_EINPUT;
+          return (-1);
+     }
+
+     const struct pp2_entry *e = (struct pp2_entry*)&b->data[b->rdpos];
+     unsigned long int n = sizeof(struct pp2_entry) + (unsigned long)e->len;
+     int opcode = OPCODE(e->byte1) ? OPCODE(e->byte1) : WS_TEXT_FRAME;
+     if (n > batch_left
+         || (WS_TEXT_FRAME != opcode && WS_BINARY_FRAME != opcode)) {
+          wsd_errno = WSD_ENUM;
+          return (-1);
+     }
+
+     unsigned int old_rdpos = b->rdpos;
+     b->rdpos += sizeof(struct pp2_entry);
+     int rv = deliver(sk, e->id, e->len, (0x80 & e->byte1) | opcode, old_rdpos);
+     if (0 == rv)
+          batch_left -= n;
+
+     return rv;
+}
+
+/* Decodes compact record; see pp2.h */
+int
+decode_compact(sk_t *sk)
+{
+     skb_t *b = sk->recvbuf;
+     const char *p = &b->data[b->rdpos], *end = &b->data[b->wrpos];
+     char byte1 = p[0];
+     int opcode = OPCODE(byte1) ? OPCODE(byte1) : WS_TEXT_FRAME;
+     if (0x70 & byte1
+         || (WS_TEXT_FRAME != opcode && WS_BINARY_FRAME != opcode)) {
+          wsd_errno = WSD_ENUM;
+          return (-1);
+     }
+
+     uint64_t hash, len;
+     int n = get_varint(p + 1, end, &hash), m = 0;
+     if (0 < n)
+          m = get_varint(p + 1 + n, end, &len);
+     if (0 > n || 0 > m || (0 < m && UINT_MAX < len)) {
+          wsd_errno = WSD_ENUM;
+          return (-1);
+     }
+     if (0 == n || 0 == m) {
+          wsd_errno = WSD_EINPUT;
+          return (-1);
+     }
+
+     unsigned int old_rdpos = b->rdpos;
+     b->rdpos += 1 + n + m;
+     return deliver(sk, hash, len, (0x80 & byte1) | opcode, old_rdpos);
+}
+
+int
+pp2_encode_frame(sk_t *sk, wsframe_t *wsf)
+{
+     /* Message continues in next frame; see section 5.4 RFC6455 */
+     bool more = !(0x80 & wsf->byte1);
+
+     if (rx_compact && sk->linked) {
+          if (0 > put_compact(sk, wsf, more))
+               return (-1);
+     } else if (tsk && !rx_compact) {
+          if (0 > put_entry(sk, wsf, more))
+               return (-1);
+     } else {
+          /* Text unless said otherwise, in first record of message only */
+          int opcode = sk->rx_frag ? WS_FRAG_FRAME : OPCODE(wsf->byte1);
+          if (WS_TEXT_FRAME == opcode)
+               opcode = WS_FRAG_FRAME;
+
+          unsigned int hdr_len = PP2_HEADER_LEN
+               + (more ? PP2_CONT_LEN : 0)
+               + (opcode ? PP2_OPCODE_LEN : 0);
+          if ((wsf->payload_len + hdr_len) > skb_wrsz(pp2sk->sendbuf)) {
+               wsd_errno = WSD_EAGAIN;
+               return (-1);
+          }
+
+          /* Not to be held back by a batch left open by compact records */
+          batch_len = 0;
+
+          pp2_encode_header(pp2sk->sendbuf,
+                            &sk->addr,
+                            sk->hash,
+                            wsf->payload_len,
+                            more,
+                            opcode);
+          sk->linked = 1;
+
+          if (LOG_VVERBOSE <= wsd_cfg->verbose) {
+               pp2_printf(stdout,
+                          &pp2sk->sendbuf->data[pp2sk->sendbuf->wrpos
+                                                - hdr_len]);
+          }
+     }
+     sk->rx_frag = more;
+     if (flow)
+          sk->credit -= wsf->payload_len;
+
+     /* Inflated payload comes from elsewhere; see inflate_payload() */
+     if (wsf->payload) {
+          memcpy(&pp2sk->sendbuf->data[pp2sk->sendbuf->wrpos],
+                 wsf->payload,
+                 wsf->payload_len);
+          pp2sk->sendbuf->wrpos += wsf->payload_len;
+          return 0;
      }
 
      unsigned int len = wsf->payload_len;
@@ -209,23 +617,439 @@ pp2_encode_frame(sk_t *sk, wsframe_t *wsf)
 
 void
 pp2_encode_header(skb_t *buf,
-                  struct sockaddr_in *src,
-                  struct sockaddr_in *dst,
+                  const ipv4_addr_t *addr,
                   const unsigned long int hash,
-                  const unsigned long int payload_len)
+                  const unsigned long int payload_len,
+                  const bool more,
+                  const int opcode)
 {
      memcpy(&buf->data[buf->wrpos],
             pp2_sig_ver_cmd_fam,
             PP2_SIG_VER_CMD_FAM_LEN);
      buf->wrpos += PP2_SIG_VER_CMD_FAM_LEN;
 
-     skb_put(buf, htobe16(PP2_ADDR_TLVS_LEN));
-     skb_put(buf, src->sin_addr);
-     skb_put(buf, dst->sin_addr);
-     skb_put(buf, src->sin_port);
-     skb_put(buf, dst->sin_port);
+     skb_put(buf, htobe16(PP2_ADDR_TLVS_LEN
+                          + (more ? PP2_CONT_LEN : 0)
+                          + (opcode ? PP2_OPCODE_LEN : 0)));
+     memcpy(&buf->data[buf->wrpos], addr, PP2_ADDR_LEN);
+     buf->wrpos += PP2_ADDR_LEN;
      pp2_put_connhash(buf, hash);
      pp2_put_payloadlen(buf, payload_len);
+
+     if (more) {
+          struct pp2_tlv *tlv = (struct pp2_tlv*)&buf->data[buf->wrpos];
+          tlv->type = PP2_TYPE_CONTINUATION;
+          tlv->length_hi = 0;
+          tlv->length_lo = 0;
+          buf->wrpos += PP2_CONT_LEN;
+     }
+
+     if (opcode) {
+          struct pp2_tlv *tlv = (struct pp2_tlv*)&buf->data[buf->wrpos];
+          tlv->type = PP2_TYPE_OPCODE;
+          tlv->length_hi = 0;
+          tlv->length_lo = 1;
+          tlv->value[0] = opcode;
+          buf->wrpos += PP2_OPCODE_LEN;
+     }
+}
+
+/*
+ * Puts header of compact record for sk into the send buffer of pp2sk,
+ * preceded by a LOCAL record with TLV 0xE6 if the first since agreed on
+ */
+int
+put_compact(sk_t *sk, const wsframe_t *wsf, const bool more)
+{
+     skb_t *b = pp2sk->sendbuf;
+     if (PP2_LOCAL_LEN + PP2_COMPACT_MAX_LEN + wsf->payload_len
+         > skb_wrsz(b)) {
+          wsd_errno = WSD_EAGAIN;
+          return (-1);
+     }
+
+     if (!tx_compact) {
+          batch_len = 0;
+          pp2_put_local(b, PP2_TYPE_COMPACT, "", 0);
+          tx_compact = true;
+     }
+
+     b->data[b->wrpos++] = (more ? 0 : 0x80)
+          | (sk->rx_frag ? WS_FRAG_FRAME : OPCODE(wsf->byte1));
+     b->wrpos += put_varint(&b->data[b->wrpos], sk->hash);
+     b->wrpos += put_varint(&b->data[b->wrpos], wsf->payload_len);
+     return 0;
+}
+
+/* Puts v as LEB128 varint, 7 bits per octet and lowest first */
+unsigned int
+put_varint(char *dst, uint64_t v)
+{
+     unsigned int n = 0;
+     while (0x7f < v) {
+          dst[n++] = (char)(0x80 | (v & 0x7f));
+          v >>= 7;
+     }
+     dst[n++] = (char)v;
+     return n;
+}
+
+/* Returns octets of varint at p, 0 if incomplete and -1 if too long */
+int
+get_varint(const char *p, const char *end, uint64_t *v)
+{
+     *v = 0;
+     for (int n = 0; n < PP2_VARINT_MAX_LEN; n++) {
+          if (p + n >= end)
+               return 0;
+          *v |= (uint64_t)(0x7f & p[n]) << (7 * n);
+          if (!(0x80 & p[n]))
+               return n + 1;
+     }
+     return (-1);
+}
+
+/*
+ * Offers compact records in a LOCAL record; full ones go out until the
+ * backend agrees in kind
+ */
+void
+pp2_offer_compact(sk_t *sk)
+{
+     pp2_put_local(sk->sendbuf, PP2_TYPE_COMPACT, "", 0);
+     sk->events |= EPOLLOUT;
+}
+
+/* Length of open record for req after its fixed part, fields trimmed */
+unsigned int
+open_len(http_req_t *req)
+{
+     trim(&req->host);
+     trim(&req->sec_ws_proto);
+     trim(&req->origin);
+     trim(&req->user_agent);
+
+     /* Request target even if empty, other fields iff present */
+     const chunk_t *fields[] = {
+          &req->host, &req->sec_ws_proto, &req->origin, &req->user_agent
+     };
+     unsigned int len = PP2_ADDR_TLVS_LEN
+          + sizeof(struct pp2_tlv)
+          + req->req_target.len;
+     for (unsigned int i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+          if (fields[i]->len)
+               len += sizeof(struct pp2_tlv) + fields[i]->len;
+     }
+
+     return len;
+}
+
+/*
+ * Checks an open record for req would fit the link, so it can go out
+ * once upgraded; sets EBADREQ if it can't, EAGAIN if backed up
+ */
+int
+pp2_check_open(http_req_t *req)
+{
+     AN(pp2sk);
+     unsigned int len = open_len(req);
+     if (UINT16_MAX < len) {
+          wsd_errno = WSD_EBADREQ;
+          return (-1);
+     }
+     if (PP2_SIG_VER_CMD_FAM_LEN + 2 + len > skb_wrsz(pp2sk->sendbuf)) {
+          wsd_errno = WSD_EAGAIN;
+          return (-1);
+     }
+
+     return 0;
+}
+
+/*
+ * Queues open record for sk, upgraded as asked for in req; see pp2.h.
+ * Fails as pp2_check_open() does.
+ */
+int
+pp2_encode_open(sk_t *sk, http_req_t *req)
+{
+     if (0 > pp2_check_open(req))
+          return (-1);
+
+     const struct {
+          uint8_t  type;
+          chunk_t *val;
+     } fields[] = {
+          { PP2_TYPE_OPEN,        &req->req_target },
+          { PP2_TYPE_AUTHORITY,   &req->host },
+          { PP2_TYPE_SUBPROTOCOL, &req->sec_ws_proto },
+          { PP2_TYPE_ORIGIN,      &req->origin },
+          { PP2_TYPE_USER_AGENT,  &req->user_agent }
+     };
+     const unsigned int num = sizeof(fields) / sizeof(fields[0]);
+
+     put_bare_header(pp2sk->sendbuf, sk, open_len(req));
+     for (unsigned int i = 0; i < num; i++) {
+          if (0 == i || fields[i].val->len)
+               put_tlv(pp2sk->sendbuf,
+                       fields[i].type,
+                       fields[i].val->p,
+                       fields[i].val->len);
+     }
+     sk->linked = 1;
+     sk->announced = 1;
+     return 0;
+}
+
+/*
+ * Queues close record for sk iff it had an open record, with the status
+ * of the first close frame either way, or 1006 for none
+ */
+int
+pp2_encode_close(sk_t *sk)
+{
+     if (!sk->announced || !pp2sk)
+          return 0;
+
+     uint16_t code = htobe16(sk->close_code ? sk->close_code : WS_1006);
+     unsigned int len = PP2_ADDR_TLVS_LEN + sizeof(struct pp2_tlv) + 2;
+     if (PP2_SIG_VER_CMD_FAM_LEN + 2 + len > skb_wrsz(pp2sk->sendbuf)) {
+          wsd_errno = WSD_EAGAIN;
+          return (-1);
+     }
+
+     put_bare_header(pp2sk->sendbuf, sk, len);
+     put_tlv(pp2sk->sendbuf, PP2_TYPE_CLOSE, (char*)&code, sizeof(code));
+     sk->announced = 0;
+     return 0;
+}
+
+/* Queues record giving the backend credit back for what sk took */
+int
+pp2_encode_credit(sk_t *sk)
+{
+     if (!flow || !sk->owed || !pp2sk)
+          return 0;
+
+     unsigned int len = PP2_ADDR_TLVS_LEN + sizeof(struct pp2_tlv) + 4;
+     if (PP2_SIG_VER_CMD_FAM_LEN + 2 + len > skb_wrsz(pp2sk->sendbuf)) {
+          wsd_errno = WSD_EAGAIN;
+          return (-1);
+     }
+
+     put_bare_header(pp2sk->sendbuf, sk, len);
+     put_tlv(pp2sk->sendbuf,
+             PP2_TYPE_CREDIT,
+             (char*)&sk->owed,
+             sizeof(sk->owed));
+     sk->owed = 0;
+     return 0;
+}
+
+/* Offers flow control with window in a LOCAL record; see pp2.h */
+void
+pp2_offer_flow(sk_t *sk, const unsigned int window)
+{
+     pp2_put_local(sk->sendbuf,
+                   PP2_TYPE_CREDIT,
+                   (char*)&window,
+                   sizeof(window));
+     sk->events |= EPOLLOUT;
+}
+
+/* True iff sk used up the credit the backend granted it */
+bool
+pp2_paused(const sk_t *sk)
+{
+     return flow && 0 >= sk->credit;
+}
+
+/*
+ * Puts header of a record without payload for sk, its TLVs of len yet
+ * to follow, into dst, the send buffer of pp2sk. Ends any batch being
+ * collected so as not to overtake its entries, and has it all written.
+ */
+void
+put_bare_header(skb_t *dst, const sk_t *sk, unsigned int len)
+{
+     batch_len = 0;
+
+     memcpy(&dst->data[dst->wrpos],
+            pp2_sig_ver_cmd_fam,
+            PP2_SIG_VER_CMD_FAM_LEN);
+     dst->wrpos += PP2_SIG_VER_CMD_FAM_LEN;
+     skb_put(dst, htobe16(len));
+     memcpy(&dst->data[dst->wrpos], &sk->addr, PP2_ADDR_LEN);
+     dst->wrpos += PP2_ADDR_LEN;
+     pp2_put_connhash(dst, sk->hash);
+     pp2_put_payloadlen(dst, 0);
+
+     if (!(pp2sk->events & EPOLLOUT))
+          turn_on_events(pp2sk, EPOLLOUT);
+}
+
+void
+put_tlv(skb_t *dst, uint8_t type, const char *value, uint16_t len)
+{
+     struct pp2_tlv *tlv = (struct pp2_tlv*)&dst->data[dst->wrpos];
+     tlv->type = type;
+     tlv->length_hi = len >> 8;
+     tlv->length_lo = len & 0xff;
+     if (len)
+          memcpy(tlv->value, value, len);
+     dst->wrpos += sizeof(struct pp2_tlv) + len;
+}
+
+/*
+ * Puts the header of an entry for sk into the batch at the end of the
+ * send buffer of pp2sk, opening a batch and arming its timer first if
+ * there is none. Records keep going out on their own while pp2sk has
+ * anything to write, whereas a batch holds them back until it fills
+ * up or its deadline passes; see pp2_batching().
+ */
+int
+put_entry(sk_t *sk, const wsframe_t *wsf, const bool more)
+{
+     skb_t *b = pp2sk->sendbuf;
+     bool open = collecting();
+     unsigned long int len = sizeof(struct pp2_entry) + wsf->payload_len;
+     if (len + (open ? 0 : PP2_BATCH_HEADER_LEN) > skb_wrsz(b)) {
+          wsd_errno = WSD_EAGAIN;
+          return (-1);
+     }
+
+     if (!open) {
+          memcpy(&b->data[b->wrpos],
+                 pp2_sig_ver_cmd_fam_local,
+                 PP2_SIG_VER_CMD_FAM_LEN);
+          b->wrpos += PP2_SIG_VER_CMD_FAM_LEN;
+          skb_put(b, htobe16(PP2_BATCH_TLVS_LEN));
+
+          struct pp2_tlv *tlv = (struct pp2_tlv*)&b->data[b->wrpos];
+          tlv->type = PP2_TYPE_BATCH;
+          tlv->length_hi = 0;
+          tlv->length_lo = 0;
+          b->wrpos += PP2_CONT_LEN;
+          pp2_put_payloadlen(b, 0);
+          batch_len = PP2_BATCH_HEADER_LEN;
+
+          struct itimerspec its;
+          memset(&its, 0, sizeof(its));
+          its.it_value.tv_nsec = batch_usec * 1000L;
+          AZ(timerfd_settime(tsk->fd, 0, &its, NULL));
+     }
+
+     /* Length of all entries is the last TLV of the header */
+     *(unsigned int*)&b->data[b->wrpos - batch_len + PP2_BATCH_HEADER_LEN
+                              - sizeof(unsigned int)] += len;
+     batch_len += len;
+
+     struct pp2_entry *e = (struct pp2_entry*)&b->data[b->wrpos];
+     e->id = sk->hash;
+     e->len = wsf->payload_len;
+     e->byte1 = (more ? 0 : 0x80)
+          | (sk->rx_frag ? WS_FRAG_FRAME : OPCODE(wsf->byte1));
+     b->wrpos += sizeof(struct pp2_entry);
+
+     if (PP2_BATCH_HEADER_LEN + PP2_BATCH_LEN <= batch_len) {
+          batch_len = 0;
+          if (!(pp2sk->events & EPOLLOUT))
+               turn_on_events(pp2sk, EPOLLOUT);
+     }
+
+     return 0;
+}
+
+/*
+ * True while a batch collects entries at the end of the send buffer.
+ * Writing any of it ends the batch, as its header has gone out.
+ */
+bool
+collecting()
+{
+     return batch_len && skb_rdsz(pp2sk->sendbuf) >= batch_len;
+}
+
+/* True iff writes to the backend wait for the batch being collected */
+bool
+pp2_batching()
+{
+     return collecting();
+}
+
+/* Sets up timer ending batches after usec; kept across backend links */
+int
+pp2_batch_open(const int usec)
+{
+     batch_usec = usec;
+     if (tsk)
+          return 0;
+
+     int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+     if (0 > fd) {
+          wsd_errno = WSD_CHECKERRNO;
+          return (-1);
+     }
+
+     if (!(tsk = sk_alloc()) || 0 > sk_init(tsk, fd, 0ULL, 0)) {
+          if (tsk) {
+               sk_destroy(tsk);
+               free(tsk);
+               tsk = NULL;
+          }
+          AZ(close(fd));
+          return (-1);
+     }
+
+     tsk->events = EPOLLIN;
+     tsk->ops->read = batch_read;
+     tsk->ops->recv = batch_recv;
+     tsk->ops->close = batch_close;
+     AZ(register_for_events(tsk));
+     return 0;
+}
+
+void
+pp2_batch_close()
+{
+     if (tsk)
+          batch_close(tsk);
+}
+
+int
+batch_read(sk_t *sk)
+{
+     uint64_t n;
+     if (0 > read(sk->fd, &n, sizeof(n)) && EAGAIN != errno) {
+          wsd_errno = WSD_CHECKERRNO;
+          return (-1);
+     }
+
+     return 0;
+}
+
+/* Deadline passed; batch goes out as is */
+int
+batch_recv(sk_t *sk __attribute__((unused)))
+{
+     if (pp2sk && collecting()) {
+          batch_len = 0;
+          if (!(pp2sk->events & EPOLLOUT))
+               turn_on_events(pp2sk, EPOLLOUT);
+     }
+
+     return 0;
+}
+
+int
+batch_close(sk_t *sk)
+{
+     AZ(epoll_ctl(epfd, EPOLL_CTL_DEL, sk->fd, NULL));
+     AZ(close(sk->fd));
+     sk_destroy(sk);
+     free(sk);
+     tsk = NULL;
+     batch_len = 0;
+     return 0;
 }
 
 inline void
@@ -250,32 +1074,6 @@ pp2_put_payloadlen(skb_t *dst, unsigned int len)
      dst->wrpos += sizeof(struct pp2_tlv) + sizeof(unsigned int);
 }
 
-inline long int
-pp2_get_connhash(skb_t *src)
-{
-     struct pp2_tlv *tlv = (struct pp2_tlv*)&src->data[src->rdpos];
-     if (tlv->type != PP2_TYPE_CONNHASH ||
-         tlv->length_hi != 0 ||
-         tlv->length_lo != sizeof(unsigned long int))
-          return (-1);
-
-     src->rdpos += sizeof(struct pp2_tlv) + sizeof(unsigned long int);
-     return *(unsigned long int*)tlv->value;
-}
-
-inline int
-pp2_get_payloadlen(skb_t *src)
-{
-     struct pp2_tlv *tlv = (struct pp2_tlv*)&src->data[src->rdpos];
-     if (tlv->type != PP2_TYPE_PAYLOADLEN ||
-         tlv->length_hi != 0 ||
-         tlv->length_lo != sizeof(unsigned int))
-          return (-1);
-
-     src->rdpos += sizeof(struct pp2_tlv) + sizeof(unsigned int);
-     return *(unsigned int*)tlv->value;
-}
-
 inline void
 pp2_printf(FILE *stream, char *p)
 {
@@ -302,12 +1100,86 @@ pp2_printf(FILE *stream, char *p)
              be16toh(addr->ipv4_addr.dst_port));
 }
 
+/*
+ * Puts a LOCAL record with a single TLV into dst. Receivers skip what
+ * such a record says about the connection; see section 2.2 of the spec.
+ */
+void
+pp2_put_local(skb_t *dst,
+              const uint8_t type,
+              const char *value,
+              const uint16_t len)
+{
+     memcpy(&dst->data[dst->wrpos],
+            pp2_sig_ver_cmd_fam_local,
+            PP2_SIG_VER_CMD_FAM_LEN);
+     dst->wrpos += PP2_SIG_VER_CMD_FAM_LEN;
+     skb_put(dst, htobe16(sizeof(struct pp2_tlv) + len));
+     put_tlv(dst, type, value, len);
+}
+
+/*
+ * Looks for a TLV of type in the LOCAL record at the read position of
+ * src, setting *len to the length of the record. Returns 1 if found, 0
+ * if not and -1 if the record is incomplete (WSD_EINPUT) or no LOCAL
+ * record at all (WSD_EBADREQ).
+ */
+int
+pp2_get_local(const skb_t *src, const uint8_t type, unsigned int *len)
+{
+     if (sizeof(struct proxy_hdr_v2) > skb_rdsz(src)) {
+          wsd_errno = WSD_EINPUT;
+          return (-1);
+     }
+
+     const char *p = &src->data[src->rdpos];
+     if (0 != memcmp(p, pp2_sig_ver_cmd_fam_local, sizeof(pp2_sig))
+         || 0x2 != PP2_VER_BITS(((struct proxy_hdr_v2*)p)->ver_cmd)
+         || 0x0 != PP2_CMD_BITS(((struct proxy_hdr_v2*)p)->ver_cmd)) {
+          wsd_errno = WSD_EBADREQ;
+          return (-1);
+     }
+
+     *len = sizeof(struct proxy_hdr_v2)
+          + be16toh(((struct proxy_hdr_v2*)p)->len);
+     if (*len > skb_rdsz(src)) {
+          wsd_errno = WSD_EINPUT;
+          return (-1);
+     }
+
+     const char *q = p + sizeof(struct proxy_hdr_v2), *end = p + *len;
+     while (end - q >= (long)sizeof(struct pp2_tlv)) {
+          const struct pp2_tlv *tlv = (const struct pp2_tlv*)q;
+          if (type == tlv->type)
+               return 1;
+          q += sizeof(struct pp2_tlv) + (tlv->length_hi << 8 | tlv->length_lo);
+     }
+
+     return 0;
+}
+
 int
 pp2_close(sk_t *sk) {
      if (LOG_VVVERBOSE <= wsd_cfg->verbose)
           printf("%s:%d: %s: fd=%d\n", __FILE__, __LINE__, __func__, sk->fd);
      AZ(close(sk->fd));
-     list_del(&sk->sk_node);
+     pp2z_close();
+     batch_len = 0;
+     batch_left = 0;
+     rx_compact = false;
+     tx_compact = false;
+     bool was_flow = flow;
+     flow = false;
+
+     /* Next link knows nothing of the clients, nor of their credit */
+     unsigned int i;
+     sk_t *pos = NULL;
+     sktable_for_each(&sk_table, pos, i) {
+          pos->linked = 0;
+          pos->announced = 0;
+          if (was_flow && pos->ctlbuf)
+               ws_add_credit(pos, 0);
+     }
      sk_destroy(sk);
      free(sk);
      pp2sk = NULL;
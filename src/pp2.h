@@ -4,11 +4,32 @@
 #include <stdint.h>
 #include "types.h"
 
+#define PP2_TYPE_AUTHORITY     0x02  /* Host header field, see the spec   */
 #define PP2_TYPE_MIN_CUSTOM    0xE0
 #define PP2_TYPE_CONNHASH      PP2_TYPE_MIN_CUSTOM
 #define PP2_TYPE_PAYLOADLEN    0xE1
+#define PP2_TYPE_CONTINUATION  0xE2  /* Empty; message continues in next */
+#define PP2_TYPE_LINK_DEFLATE  0xE3  /* Offer or acceptance of compression */
+#define PP2_TYPE_OPCODE        0xE4  /* Opcode of message iff not text     */
+#define PP2_TYPE_BATCH         0xE5  /* Empty; payload is entries, see below */
+#define PP2_TYPE_COMPACT       0xE6  /* Empty; compact records follow      */
+#define PP2_TYPE_OPEN          0xE7  /* Request target of upgrade request */
+#define PP2_TYPE_CLOSE         0xE8  /* Close code, 2 octets big endian   */
+#define PP2_TYPE_SUBPROTOCOL   0xE9  /* Sec-WebSocket-Protocol field      */
+#define PP2_TYPE_ORIGIN        0xEA  /* Origin field                      */
+#define PP2_TYPE_USER_AGENT    0xEB  /* User-Agent field                  */
+#define PP2_TYPE_PING          0xEC  /* Empty; ping client                */
+#define PP2_TYPE_RATE          0xED  /* Octets/s client may send, 0 any   */
+#define PP2_TYPE_PRIORITY      0xEE  /* 1 octet, 0 normal or 1 low        */
+#define PP2_TYPE_CREDIT        0xEF  /* Octets of payload, 4 octets       */
 #define PP2_TYPE_MAX_CUSTOM    0xEF
 
+/* Bytes of a record besides its payload, at most */
+#define PP2_MAX_HEADER_LEN     64
+
+/* Octets of entries after which a batch goes out before its deadline */
+#define PP2_BATCH_LEN          16384
+
 struct proxy_hdr_v2 {
      uint8_t sig[12];      /* hex 0D 0A 0D 0A 00 0D 0A 51 55 49 54 0A */
      uint8_t ver_cmd;      /* protocol version and command */
@@ -42,11 +63,69 @@ struct pp2_tlv {
      uint8_t value[0];
 } __attribute__((packed));
 
+/*
+ * Entry of a batch, i.e. a LOCAL record with TLVs 0xE5 and 0xE1, the
+ * latter giving the length of all entries following the header. Each
+ * entry carries a record's worth of payload for one connection.
+ */
+struct pp2_entry {
+     uint64_t id;          /* Connection id, as in TLV 0xE0 */
+     uint32_t len;         /* Payload length, as in TLV 0xE1 */
+     uint8_t  byte1;       /* FIN bit and opcode as in first byte of frame */
+     uint8_t  payload[0];
+} __attribute__((packed));
+
+/*
+ * Compact record, once both ends agreed on them in LOCAL records with
+ * TLV 0xE6: the first octet of a websocket frame as in an entry, then
+ * connection id and payload length as LEB128 varints, then payload.
+ * Full records still start with the PP2 signature, whose first octet
+ * 0x0D is no valid first octet of a compact record.
+ */
+
+/*
+ * Open and close records, iff configured: full records without payload
+ * telling the backend of an upgraded websocket and what it asked for,
+ * with TLV 0xE7 and those of its header fields present, and of its end,
+ * with TLV 0xE8. No records of a connection precede its open record
+ * nor follow its close record.
+ *
+ * Control records from the backend: records without payload carrying
+ * TLV 0xE0 and any of TLVs 0xE8, which closes the client with that
+ * status and makes the others moot, 0xEC, 0xED, 0xEE and 0xEF. Either
+ * PROXY or LOCAL; addresses, if any, are ignored.
+ */
+
+/*
+ * Flow control, once both ends agreed on it in LOCAL records with TLV
+ * 0xEF giving the window, wsd marking where it starts with another.
+ * Either end may send as much payload for a connection as the other
+ * granted it, the window to begin with; records without payload with
+ * TLVs 0xE0 and 0xEF grant more. Clients whose credit ran out aren't
+ * read from, and the backend gets credit back for clients that took
+ * what it sent.
+ */
+
 int pp2_open();
 int pp2_close(sk_t *sk);
 int pp2_recv(sk_t *sk);
 int pp2_decode_frame(sk_t *sk);
 int pp2_encode_frame(sk_t *sk, wsframe_t *wsf);
 int pp2_nop(sk_t *ignored, const bool ignored_too);
+void pp2_put_local(skb_t *dst,
+                   const uint8_t type,
+                   const char *value,
+                   const uint16_t len);
+int pp2_get_local(const skb_t *src, const uint8_t type, unsigned int *len);
+void pp2_offer_compact(sk_t *sk);
+void pp2_offer_flow(sk_t *sk, const unsigned int window);
+bool pp2_paused(const sk_t *sk);
+int pp2_encode_credit(sk_t *sk);
+int pp2_check_open(http_req_t *req);
+int pp2_encode_open(sk_t *sk, http_req_t *req);
+int pp2_encode_close(sk_t *sk);
+int pp2_batch_open(const int usec);
+void pp2_batch_close();
+bool pp2_batching();
 
 #endif /* #ifndef __PP2_H__ */
@@ -0,0 +1,322 @@
+/*
+ *  Copyright (C) 2020 Michael Goldschmidt
+ *
+ *  This file is part of wsd/wscat.
+ *
+ *  wsd/wscat is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  wsd/wscat is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with wsd/wscat.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <sys/epoll.h>
+
+#include "common.h"
+#include "pp2.h"
+#include "pp2z.h"
+
+#define PP2Z_OFF     0          /* Plain, declined or not offered         */
+#define PP2Z_OFFERED 1          /* Waiting for the backend's answer       */
+#define PP2Z_ON      2
+
+#define PP2Z_WINDOW_BITS 15
+#define PP2Z_MEM_LEVEL   8
+
+extern unsigned int wsd_errno;
+extern const wsd_config_t *wsd_cfg;
+
+/* There is but one backend link; see pp2sk */
+static struct {
+     int          state;
+     unsigned int hello_left;   /* Octets of offer yet to be written      */
+     z_stream     tx;
+     z_stream     rx;
+     skb_t       *txbuf;        /* Deflated, yet to be written            */
+     skb_t       *rxbuf;        /* Read, yet to be inflated               */
+} pp2z;
+
+static pp2z_stats_t stats;
+
+static int answer(sk_t *sk);
+static long inflate_link(sk_t *sk);
+static void deflate_link(sk_t *sk);
+
+/*
+ * Queues offer of compression as the first record to the backend and
+ * takes over reading from and writing to sk until answered.
+ */
+int
+pp2z_offer(sk_t *sk, const int level)
+{
+     memset(&pp2z, 0, sizeof(pp2z));
+     if (!(pp2z.txbuf = skb_alloc(SKB_SIZE))
+         || !(pp2z.rxbuf = skb_alloc(SKB_SIZE)))
+          goto error;
+
+     if (Z_OK != deflateInit2(&pp2z.tx,
+                              level,
+                              Z_DEFLATED,
+                              -PP2Z_WINDOW_BITS,
+                              PP2Z_MEM_LEVEL,
+                              Z_DEFAULT_STRATEGY)
+         || Z_OK != inflateInit2(&pp2z.rx, -PP2Z_WINDOW_BITS)) {
+          wsd_errno = WSD_ENOMEM;
+          goto error;
+     }
+
+     AZ(skb_rdsz(sk->sendbuf));
+     pp2_put_local(sk->sendbuf,
+                   PP2_TYPE_LINK_DEFLATE,
+                   PP2Z_METHOD,
+                   strlen(PP2Z_METHOD));
+     pp2z.hello_left = skb_rdsz(sk->sendbuf);
+     pp2z.state = PP2Z_OFFERED;
+
+     sk->ops->read = pp2z_read;
+     sk->ops->write = pp2z_write;
+     sk->ops->recv = pp2z_recv;
+     sk->events |= EPOLLOUT;
+     return 0;
+
+error:
+     pp2z_close();
+     return (-1);
+}
+
+void
+pp2z_close()
+{
+     deflateEnd(&pp2z.tx);
+     inflateEnd(&pp2z.rx);
+     free(pp2z.txbuf);
+     free(pp2z.rxbuf);
+     memset(&pp2z, 0, sizeof(pp2z));
+}
+
+/* Reads what the backend sent as is, to be inflated by pp2z_recv() */
+int
+pp2z_read(sk_t *sk)
+{
+     A(0 <= sk->fd);
+
+     if (0 == skb_wrsz(pp2z.rxbuf)) {
+          turn_off_events(sk, EPOLLIN);
+          wsd_errno = WSD_EAGAIN;
+          return (-1);
+     }
+
+     int len = read(sk->fd,
+                    &pp2z.rxbuf->data[pp2z.rxbuf->wrpos],
+                    skb_wrsz(pp2z.rxbuf));
+     if (0 >= len) {
+          wsd_errno = WSD_CHECKERRNO;
+          return (-1);
+     }
+
+     if (LOG_VVVERBOSE <= wsd_cfg->verbose) {
+          printf("%s:%d: %s: read %d byte(s) from %d\n",
+                 __FILE__,
+                 __LINE__,
+                 __func__,
+                 len,
+                 sk->fd);
+     }
+
+     pp2z.rxbuf->wrpos += len;
+     stats.wire_rx += len;
+     return 0;
+}
+
+/*
+ * Writes the offer, then nothing until answered; from then on deflates
+ * records queued since the last write and writes them.
+ */
+int
+pp2z_write(sk_t *sk)
+{
+     skb_t *b = pp2z.txbuf;
+     unsigned int len = skb_rdsz(b);
+     if (PP2Z_OFFERED == pp2z.state) {
+          b = sk->sendbuf;
+          len = pp2z.hello_left;
+     } else {
+          deflate_link(sk);
+          len = skb_rdsz(b);
+     }
+
+     if (0 == len) {
+          turn_off_events(sk, EPOLLOUT);
+          wsd_errno = WSD_EAGAIN;
+          return (-1);
+     }
+
+     int n = write(sk->fd, &b->data[b->rdpos], len);
+     if (0 > n) {
+          wsd_errno = WSD_CHECKERRNO;
+          return (-1);
+     }
+
+     if (LOG_VVVERBOSE <= wsd_cfg->verbose) {
+          printf("%s:%d: %s: wrote %d byte(s) to %d\n",
+                 __FILE__,
+                 __LINE__,
+                 __func__,
+                 n,
+                 sk->fd);
+     }
+
+     if (PP2Z_OFFERED == pp2z.state)
+          pp2z.hello_left -= n;
+     stats.wire_tx += n;
+     b->rdpos += n;
+     skb_compact(b);
+     return 0;
+}
+
+/* Inflates what was read and passes it on to pp2_recv() */
+int
+pp2z_recv(sk_t *sk)
+{
+     if (PP2Z_OFFERED == pp2z.state && 0 > answer(sk))
+          return (-1);
+
+     /* Declined; what was read after the answer is plain */
+     if (PP2Z_ON != pp2z.state) {
+          if (0 == skb_rdsz(sk->recvbuf)) {
+               wsd_errno = WSD_EINPUT;
+               return (-1);
+          }
+          return pp2_recv(sk);
+     }
+
+     int rv;
+     long n;
+     do {
+          if (0 > (n = inflate_link(sk)))
+               return (-1);
+
+          if (0 == skb_rdsz(sk->recvbuf)) {
+               wsd_errno = WSD_EINPUT;
+               return (-1);
+          }
+
+          rv = pp2_recv(sk);
+     } while (0 > rv && WSD_EINPUT == wsd_errno && n);
+
+     return rv;
+}
+
+const pp2z_stats_t *
+pp2z_stats()
+{
+     return &stats;
+}
+
+/* Takes the backend's answer to the offer off the link */
+int
+answer(sk_t *sk)
+{
+     unsigned int len = 0;
+     int rv = pp2_get_local(pp2z.rxbuf, PP2_TYPE_LINK_DEFLATE, &len);
+     if (0 > rv && WSD_EINPUT == wsd_errno)
+          return (-1);
+
+     if (1 == rv) {
+          pp2z.rxbuf->rdpos += len;
+          skb_compact(pp2z.rxbuf);
+          pp2z.state = PP2Z_ON;
+          syslog(LOG_INFO, "Backend link compressed");
+     } else {
+          /* Any other LOCAL record is consumed, anything else passed on */
+          if (0 == rv)
+               pp2z.rxbuf->rdpos += len;
+          A(skb_wrsz(sk->recvbuf) >= skb_rdsz(pp2z.rxbuf));
+          skb_copy(sk->recvbuf, pp2z.rxbuf, skb_rdsz(pp2z.rxbuf));
+          sk->ops->read = sk_read;
+          sk->ops->write = sk_write;
+          sk->ops->recv = pp2_recv;
+          pp2z_close();
+          syslog(LOG_INFO, "Backend link not compressed");
+     }
+
+     if (0 < skb_rdsz(sk->sendbuf) && !(sk->events & EPOLLOUT))
+          turn_on_events(sk, EPOLLOUT);
+
+     return 0;
+}
+
+/* Inflates into receive buffer of sk; returns number of octets */
+long
+inflate_link(sk_t *sk)
+{
+     skb_t *src = pp2z.rxbuf, *dst = sk->recvbuf;
+     if (0 == skb_rdsz(src) || 0 == skb_wrsz(dst))
+          return 0;
+
+     z_stream *z = &pp2z.rx;
+     z->next_in = (Bytef*)&src->data[src->rdpos];
+     z->avail_in = skb_rdsz(src);
+     z->next_out = (Bytef*)&dst->data[dst->wrpos];
+     z->avail_out = skb_wrsz(dst);
+
+     int rv = inflate(z, Z_SYNC_FLUSH);
+     if (Z_STREAM_END == rv)
+          rv = inflateReset(z);
+     if (Z_OK != rv && Z_BUF_ERROR != rv) {
+          syslog(LOG_ERR, "Backend link: bad deflate data");
+          wsd_errno = WSD_EBADREQ;
+          return (-1);
+     }
+
+     long n = skb_wrsz(dst) - z->avail_out;
+     src->rdpos += skb_rdsz(src) - z->avail_in;
+     skb_compact(src);
+     dst->wrpos += n;
+     stats.plain_rx += n;
+
+     /* Room again for pp2z_read() */
+     if (skb_wrsz(src) && !(sk->events & EPOLLIN))
+          turn_on_events(sk, EPOLLIN);
+
+     return n;
+}
+
+/* Deflates records queued as one batch, as far as there is room */
+void
+deflate_link(sk_t *sk)
+{
+     skb_t *src = sk->sendbuf, *dst = pp2z.txbuf;
+     if (0 == skb_wrsz(dst))
+          return;
+
+     z_stream *z = &pp2z.tx;
+     z->next_in = (Bytef*)&src->data[src->rdpos];
+     z->avail_in = skb_rdsz(src);
+     z->next_out = (Bytef*)&dst->data[dst->wrpos];
+     z->avail_out = skb_wrsz(dst);
+
+     /* Z_BUF_ERROR iff flushed already and nothing since */
+     int rv = deflate(z, Z_SYNC_FLUSH);
+     A(Z_OK == rv || Z_BUF_ERROR == rv);
+
+     unsigned int n = skb_rdsz(src) - z->avail_in;
+     stats.plain_tx += n;
+     src->rdpos += n;
+     skb_compact(src);
+     dst->wrpos += skb_wrsz(dst) - z->avail_out;
+}
@@ -0,0 +1,31 @@
+#ifndef __PP2Z_H__
+#define __PP2Z_H__
+
+#include "types.h"
+
+/*
+ * Compressed link to the backend. Right after connecting, wsd offers
+ * compression in a LOCAL record with TLV 0xE3 and holds back records
+ * until the backend answers. If the answer is a LOCAL record with TLV
+ * 0xE3 too, whatever either end sends from then on is one raw deflate
+ * stream, flushed with Z_SYNC_FLUSH after every batch of records written
+ * at once. Any other answer leaves the link plain.
+ */
+
+#define PP2Z_METHOD "deflate"
+
+typedef struct {
+     unsigned long int plain_tx;  /* Octets of records sent               */
+     unsigned long int wire_tx;   /* Octets they took on the wire         */
+     unsigned long int plain_rx;  /* Octets of records received           */
+     unsigned long int wire_rx;   /* Octets they took on the wire         */
+} pp2z_stats_t;
+
+int pp2z_offer(sk_t *sk, const int level);
+void pp2z_close();
+int pp2z_read(sk_t *sk);
+int pp2z_write(sk_t *sk);
+int pp2z_recv(sk_t *sk);
+const pp2z_stats_t *pp2z_stats();
+
+#endif /* #ifndef __PP2Z_H__ */
@@ -0,0 +1,228 @@
+/*
+ *  Copyright (C) 2020 Michael Goldschmidt
+ *
+ *  This file is part of wsd/wscat.
+ *
+ *  wsd/wscat is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  wsd/wscat is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with wsd/wscat.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <string.h>
+
+#include "config.h"
+#include "types.h"
+#include "sha1.h"
+
+#define ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+extern unsigned int wsd_errno;
+
+static void blocks_scalar(uint32_t *state, const unsigned char *p, size_t n);
+
+/* Implementation of block compression; see sha1_select() */
+static void (*blocks)(uint32_t *state,
+                      const unsigned char *p,
+                      size_t n) = blocks_scalar;
+
+/* Compresses n blocks at p into state; see section 6.1 RFC3174 */
+void
+blocks_scalar(uint32_t *state, const unsigned char *p, size_t n)
+{
+     for (; n; n--, p += SHA1_BLOCK_LEN) {
+          uint32_t w[80];
+          for (unsigned int i = 0; i < 16; i++)
+               w[i] = (uint32_t)p[4 * i] << 24
+                    | (uint32_t)p[4 * i + 1] << 16
+                    | (uint32_t)p[4 * i + 2] << 8
+                    | (uint32_t)p[4 * i + 3];
+          for (unsigned int i = 16; i < 80; i++)
+               w[i] = ROL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+          uint32_t a = state[0], b = state[1], c = state[2];
+          uint32_t d = state[3], e = state[4];
+          for (unsigned int i = 0; i < 80; i++) {
+               uint32_t f;
+               if (20 > i)
+                    f = ((b & c) | (~b & d)) + 0x5a827999;
+               else if (40 > i)
+                    f = (b ^ c ^ d) + 0x6ed9eba1;
+               else if (60 > i)
+                    f = ((b & c) | (b & d) | (c & d)) + 0x8f1bbcdc;
+               else
+                    f = (b ^ c ^ d) + 0xca62c1d6;
+
+               uint32_t t = ROL(a, 5) + f + e + w[i];
+               e = d;
+               d = c;
+               c = ROL(b, 30);
+               b = a;
+               a = t;
+          }
+
+          state[0] += a;
+          state[1] += b;
+          state[2] += c;
+          state[3] += d;
+          state[4] += e;
+     }
+}
+
+#if defined(HAVE_IMMINTRIN_H) && defined(__x86_64__)
+#define SHA1_SIMD
+#include <immintrin.h>
+
+/*
+ * Four rounds with function f: schedules the message words four rounds
+ * ahead while the current ones are hashed. Operands rotate between
+ * invocations; E alternates between two registers.
+ */
+#define ROUNDS4(ea, eb, m0, m1, m2, m3, f)              \
+     ea = _mm_sha1nexte_epu32(ea, m0);                  \
+     eb = abcd;                                         \
+     m1 = _mm_sha1msg2_epu32(m1, m0);                   \
+     abcd = _mm_sha1rnds4_epu32(abcd, ea, f);           \
+     m3 = _mm_sha1msg1_epu32(m3, m0);                   \
+     m2 = _mm_xor_si128(m2, m0);
+
+static void blocks_shani(uint32_t *state, const unsigned char *p, size_t n);
+
+__attribute__((target("sha,sse4.1")))
+void
+blocks_shani(uint32_t *state, const unsigned char *p, size_t n)
+{
+     const __m128i bswap = _mm_set_epi64x(0x0001020304050607ULL,
+                                          0x08090a0b0c0d0e0fULL);
+     __m128i abcd = _mm_shuffle_epi32(
+          _mm_loadu_si128((const __m128i*)state), 0x1b);
+     __m128i e0 = _mm_set_epi32(state[4], 0, 0, 0), e1;
+     __m128i m0, m1, m2, m3;
+
+     for (; n; n--, p += SHA1_BLOCK_LEN) {
+          __m128i abcd_save = abcd, e0_save = e0;
+
+          m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)p), bswap);
+          m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 16)),
+                                bswap);
+          m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 32)),
+                                bswap);
+          m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 48)),
+                                bswap);
+
+          /* Rounds 0-15, message words as loaded */
+          e0 = _mm_add_epi32(e0, m0);
+          e1 = abcd;
+          abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+          e1 = _mm_sha1nexte_epu32(e1, m1);
+          e0 = abcd;
+          abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+          m0 = _mm_sha1msg1_epu32(m0, m1);
+
+          e0 = _mm_sha1nexte_epu32(e0, m2);
+          e1 = abcd;
+          abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+          m1 = _mm_sha1msg1_epu32(m1, m2);
+          m0 = _mm_xor_si128(m0, m2);
+
+          ROUNDS4(e1, e0, m3, m0, m1, m2, 0);
+
+          /* Rounds 16-79 */
+          ROUNDS4(e0, e1, m0, m1, m2, m3, 0);
+          ROUNDS4(e1, e0, m1, m2, m3, m0, 1);
+          ROUNDS4(e0, e1, m2, m3, m0, m1, 1);
+          ROUNDS4(e1, e0, m3, m0, m1, m2, 1);
+          ROUNDS4(e0, e1, m0, m1, m2, m3, 1);
+          ROUNDS4(e1, e0, m1, m2, m3, m0, 1);
+          ROUNDS4(e0, e1, m2, m3, m0, m1, 2);
+          ROUNDS4(e1, e0, m3, m0, m1, m2, 2);
+          ROUNDS4(e0, e1, m0, m1, m2, m3, 2);
+          ROUNDS4(e1, e0, m1, m2, m3, m0, 2);
+          ROUNDS4(e0, e1, m2, m3, m0, m1, 2);
+          ROUNDS4(e1, e0, m3, m0, m1, m2, 3);
+          ROUNDS4(e0, e1, m0, m1, m2, m3, 3);
+          ROUNDS4(e1, e0, m1, m2, m3, m0, 3);
+          ROUNDS4(e0, e1, m2, m3, m0, m1, 3);
+          ROUNDS4(e1, e0, m3, m0, m1, m2, 3);
+
+          e0 = _mm_sha1nexte_epu32(e0, e0_save);
+          abcd = _mm_add_epi32(abcd, abcd_save);
+     }
+
+     _mm_storeu_si128((__m128i*)state, _mm_shuffle_epi32(abcd, 0x1b));
+     state[4] = _mm_extract_epi32(e0, 3);
+}
+#endif /* #if defined(HAVE_IMMINTRIN_H) && defined(__x86_64__) */
+
+__attribute__((constructor))
+static void
+sha1_init()
+{
+     sha1_select(SHA1_SHANI);
+}
+
+/* Selects implementation of sha1(); fails if CPU lacks support */
+int
+sha1_select(unsigned int impl)
+{
+     switch (impl) {
+     case SHA1_SCALAR:
+          blocks = blocks_scalar;
+          return 0;
+#ifdef SHA1_SIMD
+     case SHA1_SHANI:
+          if (!__builtin_cpu_supports("sha")
+              || !__builtin_cpu_supports("sse4.1"))
+               break;
+          blocks = blocks_shani;
+          return 0;
+#endif
+     }
+
+     wsd_errno = WSD_EINPUT;
+     return (-1);
+}
+
+void
+sha1(const void *data, size_t len, unsigned char *md)
+{
+     uint32_t state[5] = {
+          0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0
+     };
+
+     size_t full = len / SHA1_BLOCK_LEN;
+     blocks(state, data, full);
+
+     /* Remaining bytes, 0x80, zeros and bit length fill one or two blocks */
+     unsigned char tail[2 * SHA1_BLOCK_LEN];
+     size_t rest = len - full * SHA1_BLOCK_LEN;
+     size_t tail_len = rest + 9 > SHA1_BLOCK_LEN
+          ? 2 * SHA1_BLOCK_LEN
+          : SHA1_BLOCK_LEN;
+     memcpy(tail, (const unsigned char*)data + full * SHA1_BLOCK_LEN, rest);
+     tail[rest] = 0x80;
+     memset(&tail[rest + 1], 0, tail_len - rest - 1);
+
+     uint64_t bits = (uint64_t)len << 3;
+     for (unsigned int i = 0; i < 8; i++)
+          tail[tail_len - 1 - i] = bits >> (8 * i);
+
+     blocks(state, tail, tail_len / SHA1_BLOCK_LEN);
+
+     for (unsigned int i = 0; i < 5; i++) {
+          md[4 * i] = state[i] >> 24;
+          md[4 * i + 1] = state[i] >> 16;
+          md[4 * i + 2] = state[i] >> 8;
+          md[4 * i + 3] = state[i];
+     }
+}
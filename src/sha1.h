@@ -0,0 +1,23 @@
+#ifndef __SHA1_H__
+#define __SHA1_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * SHA-1 (RFC3174) of small, contiguous input, as websocket opening
+ * handshakes need; no streaming, no allocation. Blocks are compressed
+ * with the SHA extensions where the CPU has them.
+ */
+
+#define SHA1_DIGEST_LEN 20
+#define SHA1_BLOCK_LEN  64
+
+/* Implementations of sha1(); the fastest supported is the default */
+#define SHA1_SCALAR     0
+#define SHA1_SHANI      1
+
+void sha1(const void *data, size_t len, unsigned char *md);
+int sha1_select(unsigned int impl);
+
+#endif /* #ifndef __SHA1_H__ */
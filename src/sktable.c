@@ -0,0 +1,137 @@
+/*
+ *  Copyright (C) 2020 Michael Goldschmidt
+ *
+ *  This file is part of wsd/wscat.
+ *
+ *  wsd/wscat is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  wsd/wscat is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with wsd/wscat.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "sktable.h"
+
+#define SKTABLE_MIN_SIZE 1024
+#define SKTABLE_MAX_SIZE (1U << 24)
+#define SKTABLE_GEN_MASK 0x7fffffff /* Keeps ids positive as long int  */
+
+extern unsigned int wsd_errno;
+
+static int grow(sktable_t *t, unsigned int size);
+
+/* Sizes table for size descriptors; pass the open file limit */
+int
+sktable_init(sktable_t *t, unsigned int size)
+{
+     memset(t, 0, sizeof(sktable_t));
+
+     if (size < SKTABLE_MIN_SIZE)
+          size = SKTABLE_MIN_SIZE;
+     else if (size > SKTABLE_MAX_SIZE)
+          size = SKTABLE_MAX_SIZE;
+
+     return grow(t, size);
+}
+
+void
+sktable_free(sktable_t *t)
+{
+     if (t->slots)
+          free(t->slots);
+
+     memset(t, 0, sizeof(sktable_t));
+}
+
+/* Puts socket into the slot of its descriptor and assigns its id */
+int
+sktable_add(sktable_t *t, sk_t *sk)
+{
+     A(0 <= sk->fd);
+
+     uint32_t i = sk->fd;
+     if (i >= t->size && 0 > grow(t, i + 1))
+          return (-1);
+
+     sktable_slot_t *slot = &t->slots[i];
+     A(NULL == slot->sk);
+     slot->sk = sk;
+     t->num++;
+     if (i >= t->hi)
+          t->hi = i + 1;
+
+     sk->hash = SKTABLE_ID(i, slot->gen);
+
+     return 0;
+}
+
+int
+sktable_del(sktable_t *t, const sk_t *sk)
+{
+     uint32_t i = SKTABLE_SLOT(sk->hash);
+     if (i >= t->size || t->slots[i].sk != sk) {
+          wsd_errno = WSD_EINPUT;
+          return (-1);
+     }
+
+     /* Invalidate the id before the descriptor can be reused */
+     sktable_slot_t *slot = &t->slots[i];
+     slot->sk = NULL;
+     slot->gen = (slot->gen + 1) & SKTABLE_GEN_MASK;
+     t->num--;
+
+     while (t->hi && NULL == t->slots[t->hi - 1].sk)
+          t->hi--;
+
+     return 0;
+}
+
+inline sk_t *
+sktable_get(const sktable_t *t, const uint64_t id)
+{
+     uint32_t i = SKTABLE_SLOT(id);
+     if (i >= t->hi || t->slots[i].gen != SKTABLE_GEN(id))
+          return NULL;
+
+     return t->slots[i].sk;
+}
+
+int
+grow(sktable_t *t, unsigned int size)
+{
+     if (size > SKTABLE_MAX_SIZE) {
+          wsd_errno = WSD_ENOMEM;
+          return (-1);
+     }
+
+     /* Round up to power of two */
+     unsigned int n = SKTABLE_MIN_SIZE;
+     while (n < size)
+          n <<= 1;
+
+     /* Initially calloc; leaves pages untouched until first used */
+     sktable_slot_t *slots = t->slots ?
+          realloc(t->slots, n * sizeof(sktable_slot_t)) :
+          calloc(n, sizeof(sktable_slot_t));
+     if (!slots) {
+          wsd_errno = WSD_ENOMEM;
+          return (-1);
+     }
+     memset(&slots[t->size], 0, (n - t->size) * sizeof(sktable_slot_t));
+
+     t->slots = slots;
+     t->size = n;
+
+     return 0;
+}
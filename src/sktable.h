@@ -0,0 +1,44 @@
+#ifndef __SKTABLE_H__
+#define __SKTABLE_H__
+
+#include <stdint.h>
+#include "types.h"
+
+/*
+ * Table of sockets indexed by file descriptor that hands out their
+ * connection ids. An id is the descriptor in its low 32 bits and the
+ * slot's generation in its high bits. Freeing a slot bumps its
+ * generation, so an id never refers to a later socket reusing the same
+ * descriptor, and looking up an id is a direct index plus a generation
+ * check; no hashing, no probing. Descriptors are dense, so walking the
+ * table visits every socket in a single sequential pass.
+ */
+
+#define SKTABLE_SLOT(id) ((uint32_t)((id) & 0xffffffff))
+#define SKTABLE_GEN(id)  ((uint32_t)((id) >> 32))
+#define SKTABLE_ID(slot, gen) (((uint64_t)(gen) << 32) | (slot))
+
+/* Iterates over every socket; safe against deleting the current one */
+#define sktable_for_each(t, pos, i)                                     \
+     for ((i) = 0; (i) < (t)->hi; (i)++)                                \
+          if (((pos) = (t)->slots[(i)].sk))
+
+typedef struct {
+     sk_t     *sk;
+     uint32_t  gen;             /* Generation, bumped on every free       */
+} sktable_slot_t;
+
+typedef struct {
+     sktable_slot_t *slots;
+     unsigned int    size;      /* Number of slots                        */
+     unsigned int    num;       /* Number of slots in use                 */
+     unsigned int    hi;        /* One past highest slot in use           */
+} sktable_t;
+
+int sktable_init(sktable_t *t, unsigned int size);
+void sktable_free(sktable_t *t);
+int sktable_add(sktable_t *t, sk_t *sk);
+int sktable_del(sktable_t *t, const sk_t *sk);
+sk_t *sktable_get(const sktable_t *t, const uint64_t id);
+
+#endif /* #ifndef __SKTABLE_H__ */
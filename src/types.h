@@ -3,6 +3,8 @@
 
 #include "config.h"
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <time.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -73,47 +75,111 @@ typedef struct {
      char              byte2;
      unsigned long int payload_len;
      unsigned int      masking_key;
+     const char       *payload;  /* Iff not at rdpos of receive buffer */
 } wsframe_t;
 
+/*
+ * Frame being received: header decoded once, payload unmasked as it
+ * arrives; see ws_decode_frame()
+ */
+typedef struct {
+     unsigned long int len;     /* Payload length                           */
+     unsigned long int remaining;/* Payload bytes yet to dispatch           */
+     unsigned int      ready;   /* Bytes at rdpos unmasked, yet to dispatch */
+     unsigned int      masking_key;
+     char              byte1;
+     bool              pending; /* Header decoded, payload yet to dispatch  */
+} wsrx_t;
+
 struct sk;
 
+#define SKB_SIZE           1048576 /* Websocket and PP2 buffers          */
+#define SKB_HANDSHAKE_SIZE 8192    /* Buffers until upgraded             */
+#define SKB_CTL_SIZE       512     /* Control frames once upgraded       */
+
 /* socket buffer */
 typedef struct {
      unsigned int rdpos;
      unsigned int wrpos;
-     char         data[1048576];
+     unsigned int size;
+     char         data[];
 } skb_t;
 
 struct proto;
 struct ops;
+struct http_parser;
+
+#define CACHE_LINE_SIZE 64
 
-/* Structure describing file descriptor, state, operations and protocol. */
+/* IPv4 addresses and ports in network byte order, laid out as in PP2 */
+typedef struct {
+     uint32_t src_addr;
+     uint32_t dst_addr;
+     uint16_t src_port;
+     uint16_t dst_port;
+} ipv4_addr_t;
+
+/*
+ * Structure describing file descriptor, state, operations and protocol.
+ * Fields touched for every event, read, write and frame come first and
+ * fill two cache lines: the first is read on every event, the second
+ * holds the state of reads and frame codecs. The rest is read on
+ * accept, close and timeout checks, or once a feature it belongs to is
+ * on, and starts on the third line. Allocate with sk_alloc().
+ */
 struct sk {
      int                fd;
-     unsigned long int  hash;
      unsigned int       events;
+     unsigned long int  hash;            /* Connection id, see sktable.h     */
      skb_t             *sendbuf;
      skb_t             *recvbuf;
-     struct hlist_node  hash_node;       /* Hash table of every open socket  */
-     struct list_head   work_node;       /* List of work pending             */
-     struct list_head   sk_node;         /* List of every open socket        */
      struct proto      *proto;
      struct ops        *ops;
-     uint8_t            retries;
-     unsigned char      close_on_write:1;/* Close socket once sendbuf empty  */
-     unsigned char      close:1;         /* Close socket                     */
-     unsigned char      closing:1;       /* Closing handshake in progress    */
-     struct timespec    ts_last_io;      /* Records time of last I/O         */
+     ipv4_addr_t        addr;            /* Peer and local address iff socket*/
+     uint32_t           work_idx:24;     /* Index into work queue + 1 iff set*/
+     uint32_t           linked:1;        /* Backend had a full record, pp2.c */
+     uint32_t           announced:1;     /* Backend had an open record, pp2.c*/
+     uint32_t           tx_frag:1;       /* Sending fragmented message       */
+     uint32_t           rx_frag:1;       /* Forwarding fragmented message    */
+     uint32_t           io:1;            /* I/O since last timeout check     */
+     uint32_t           close_on_write:1;/* Close socket once sendbuf empty  */
+     uint32_t           close:1;         /* Close socket                     */
+     uint32_t           closing:1;       /* Closing handshake in progress    */
+
+     /* Reads and frame codecs */
+     wsrx_t             rx;              /* Frame being received             */
+     skb_t             *ctlbuf;          /* Control frames iff upgraded, wsd */
+     long int           credit;          /* Payload backend takes, see pp2.h */
+     unsigned int       tx_left;         /* Rest of frame being written      */
+     unsigned int       owed;            /* Payload to credit backend for    */
+     unsigned int       rate;            /* Octets/s it may send iff not 0   */
+     bool               low_prio;        /* Leaves half the link to others   */
+
+     /* Cold */
+     struct timespec    ts_last_io       /* Records time of last I/O         */
+     __attribute__((aligned(CACHE_LINE_SIZE)));
+     struct timespec    ts_ping;         /* Last ping sent iff unanswered    */
+     struct pmd        *pmd;             /* permessage-deflate iff agreed on */
      struct timespec    ts_closing_handshake_start;
-     struct sockaddr_in src_addr;        /* Source address iff socket        */
-     struct sockaddr_in dst_addr;        /* Destination address iff socket   */
+     uint8_t            retries;
+     uint16_t           close_code;      /* Status of first close frame      */
+     long int           allowance;       /* Octets it may send now iff rate  */
+     struct timespec    ts_rate;         /* Last refill of allowance         */
+     struct http_parser *hp;             /* Upgrade request parse iff pending*/
+     struct list_head   handshakes;      /* Pending opening handshakes       */
+     struct timespec    ts_accept;       /* Start of opening handshake       */
 #ifdef HAVE_LIBSSL
      SSL_CTX           *sslctx;
      SSL               *ssl;
 #endif
-};
+} __attribute__((aligned(CACHE_LINE_SIZE)));
 typedef struct sk sk_t;
 
+_Static_assert(offsetof(sk_t, rx) == CACHE_LINE_SIZE,
+               "fields read on every event must fill one cache line");
+_Static_assert(offsetof(sk_t, ts_last_io) == 2 * CACHE_LINE_SIZE,
+               "hot fields of struct sk must fill two cache lines");
+
 struct proto {
      int (*decode_handshake)(sk_t *sk, http_req_t *req);
      int (*decode_frame)(sk_t *sk);                 /* Decodes single frame  */
@@ -135,6 +201,7 @@ typedef struct {
      uid_t       uid;
      int         lfd;          /* Listening socket fd iff wsd                */
      int         lport;        /* Listening port iff wsd                     */
+     int         backlog;      /* Listen backlog iff wsd                     */
      char       *fport;        /* Forwarding port iff wsd                    */
      char      **fhostname;    /* Forwarding hostname iff wsd                */
      uint8_t     fhostname_num;/* Number of forwarding hostnames (-h options)*/
@@ -144,6 +211,18 @@ typedef struct {
      int         idle_timeout; /* Idle timeout (ms) after read/write op      */
      int         ping_interval;/* Ping interval (ms)                         */
      int         closing_handshake_timeout;
+     int         handshake_timeout;/* Opening handshake deadline (ms) iff wsd */
+     unsigned int handshake_workers;/* Handshake pool threads iff wsd, 0 none */
+     unsigned long int max_frame_len;/* Fragment larger messages iff wsd, 0 no */
+     int         deflate_level;/* permessage-deflate iff wsd and not 0       */
+     int         deflate_mode; /* Memory mode of permessage-deflate iff wsd  */
+     int         deflate_idle_timeout;/* Release contexts after (ms), -1 no */
+     int         link_level;   /* Deflate backend link iff wsd and not 0    */
+     int         batch_usec;   /* Batch records to backend (us) iff not 0   */
+     bool        compact_link; /* Offer compact records to backend iff wsd  */
+     bool        lifecycle;    /* Open and close records to backend iff wsd */
+     unsigned int window;      /* Flow control credit iff wsd and not 0     */
+     unsigned int max_fds;     /* Open file limit (RLIMIT_NOFILE) iff wsd    */
      char       *user_agent;
      char       *request_target;/* Request target; see section 5.3.1 RFC7230 */
      const char *sec_ws_proto;
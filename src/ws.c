@@ -31,13 +31,16 @@
 /* TODO */
 #endif
 
+#include <time.h>
 #include <sys/epoll.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include "config.h"
 #include "common.h"
 #include "ws.h"
 #include "ws_wsd.h"
 #include "pp2.h"
+#include "pmd.h"
 
 /* see RFC6455 section 5.2 */
 #define WS_PAYLOAD_7BITS       1
@@ -48,12 +51,32 @@
 #define set_payload_bits(byte, val) (byte |= (0x7f & val))
 #define MASKING_KEY(p)              *((unsigned int*)(p))
 
+/* Control frames jump the queue once upgraded; see ws_write() */
+#define ctl_skb(sk)                 ((sk)->ctlbuf ? (sk)->ctlbuf : (sk)->sendbuf)
+
 extern int epfd;
 extern sk_t *pp2sk;
 extern unsigned int wsd_errno;
 extern const wsd_config_t *wsd_cfg;
 
+unsigned long int ws_ping_rtt[WS_PING_RTT_BUCKETS];
+
+/* Payload on its way between zlib and a buffer; see RFC7692 */
+static char inflated[WS_STREAM_CHUNK];
+static char *deflated = NULL;
+static unsigned long int deflated_size = 0;
+
+static int decode_header(sk_t *sk);
+static void unmask_ready(sk_t *sk);
 static int dispatch_payload(sk_t *sk, wsframe_t *wsf);
+static int stream_payload(sk_t *sk);
+static int inflate_payload(sk_t *sk);
+static long fragment(unsigned long int len,
+                     unsigned long int *max,
+                     unsigned long int *num);
+static unsigned long int frame_len(const char *p);
+static void drop_after_close(sk_t *sk);
+static void record_ping_rtt(sk_t *sk);
 static int encode_ping_pong_frame(skb_t *sk,
                                   const int opcode,
                                   const bool do_mask,
@@ -70,15 +93,22 @@ ws_encode_frame(sk_t *sk, wsframe_t *wsf)
           printf("%s:%d: %s: fd=%d\n", __FILE__, __LINE__, __func__, sk->fd);
      }
 
-     long frame_len = ws_calculate_frame_length(wsf->payload_len);
-     A(0 < frame_len);
+     const char *payload = &pp2sk->recvbuf->data[pp2sk->recvbuf->rdpos];
+     unsigned long int len = wsf->payload_len, max, num;
+
+     /* Worst case must fit before deflating; the context moves on */
+     if (sk->pmd)
+          len = pmd_deflate_bound(sk->pmd, wsf->payload_len);
+
+     long frame_len = fragment(len, &max, &num);
 
      if (LOG_VVVERBOSE <= wsd_cfg->verbose) {
-          printf("\t%s:%d: frame len=%d, payload len=%lu\n",
+          printf("\t%s:%d: frame len=%ld, payload len=%lu, frames=%lu\n",
                  __func__,
                  __LINE__,
                  frame_len,
-                 wsf->payload_len);
+                 wsf->payload_len,
+                 num);
      }
 
      if (skb_wrsz(sk->sendbuf) < frame_len) {
@@ -97,19 +127,63 @@ ws_encode_frame(sk_t *sk, wsframe_t *wsf)
           return (-1);
      }
 
-     set_fin_bit(wsf->byte1);
-     set_opcode(wsf->byte1, WS_TEXT_FRAME);
-     skb_put(sk->sendbuf, wsf->byte1);
-     AZ(ws_set_payload_len(sk->sendbuf, wsf->payload_len, 0));
+     if (sk->pmd) {
+          char *p = deflated_size < len ? realloc(deflated, len) : deflated;
+          if (p) {
+               deflated = p;
+               if (deflated_size < len)
+                    deflated_size = len;
+          }
 
-     if (LOG_VERBOSE <= wsd_cfg->verbose)
-          ws_printf(stderr, wsf, "TX", sk->hash);
+          long n = p ? pmd_deflate(sk->pmd,
+                                   payload,
+                                   wsf->payload_len,
+                                   deflated,
+                                   len,
+                                   fin_bit(wsf->byte1)) : -1;
+          if (0 > n) {
+               /* Out of memory; drop record, not the backend, and fail */
+               pp2sk->recvbuf->rdpos += wsf->payload_len;
+               skb_compact(pp2sk->recvbuf);
+               if (!sk->closing)
+                    ws_start_closing_handshake(sk, WS_1011, false);
+               return 0;
+          }
+
+          payload = deflated;
+          len = n;
+          fragment(len, &max, &num);
+     }
 
-     unsigned long k = wsf->payload_len;
-     while (k--)
-          sk->sendbuf->data[sk->sendbuf->wrpos++] =
-               pp2sk->recvbuf->data[pp2sk->recvbuf->rdpos++];
+     unsigned long int last = len - (num - 1) * max;
+     for (unsigned long int i = 0; i < num; i++) {
+          wsframe_t frag;
+          memset(&frag, 0, sizeof(wsframe_t));
+          frag.payload_len = i + 1 < num ? max : last;
+          if (i + 1 == num && fin_bit(wsf->byte1))
+               set_fin_bit(frag.byte1);
+
+          /* Opcode goes in first frame of message only; see section 5.4 */
+          if (!sk->tx_frag) {
+               set_opcode(frag.byte1, OPCODE(wsf->byte1));
+               if (sk->pmd)
+                    set_rsv1_bit(frag.byte1); /* Compressed; RFC7692 */
+          }
+          sk->tx_frag = fin_bit(frag.byte1) ? 0 : 1;
+          skb_put(sk->sendbuf, frag.byte1);
+          AZ(ws_set_payload_len(sk->sendbuf, frag.payload_len, 0));
+
+          if (LOG_VERBOSE <= wsd_cfg->verbose)
+               ws_printf(stderr, &frag, "TX", sk->hash);
+
+          memcpy(&sk->sendbuf->data[sk->sendbuf->wrpos],
+                 payload,
+                 frag.payload_len);
+          sk->sendbuf->wrpos += frag.payload_len;
+          payload += frag.payload_len;
+     }
 
+     pp2sk->recvbuf->rdpos += wsf->payload_len;
      skb_compact(pp2sk->recvbuf);
 
      if (!(sk->events & EPOLLOUT)) {
@@ -123,6 +197,181 @@ ws_encode_frame(sk_t *sk, wsframe_t *wsf)
      return 0;
 }
 
+/*
+ * Length of frames carrying len bytes of payload, headers included,
+ * with at most *max bytes each; see section 5.4 RFC6455
+ */
+long
+fragment(unsigned long int len,
+         unsigned long int *max,
+         unsigned long int *num)
+{
+     *max = wsd_cfg->max_frame_len;
+     if (0 == *max || *max > len)
+          *max = len;
+
+     *num = *max ? (len + *max - 1) / *max : 1;
+     unsigned long int last = len - (*num - 1) * *max;
+     long frame_len = (*num - 1) * (1 + ws_calculate_frame_length(*max))
+          + 1 + ws_calculate_frame_length(last);
+     A(0 < frame_len);
+
+     return frame_len;
+}
+
+/*
+ * Writes queued frames. Control frames in ctlbuf go out as soon as the
+ * data frame being written, if any, is done, rather than behind all the
+ * data queued in sendbuf; one writev(2) covers the rest of that frame,
+ * the control frames and the data after them, unless closing, when no
+ * data follows the close frame.
+ */
+int
+ws_write(sk_t *sk)
+{
+     skb_t *b = sk->sendbuf, *ctl = sk->ctlbuf;
+     drop_after_close(sk);
+
+     unsigned long int head = sk->tx_left;
+     unsigned int ctl_len = skb_rdsz(ctl);
+     unsigned long int tail = skb_rdsz(b) - head;
+
+     /* Nothing goes after a close frame; see section 5.5.1 RFC6455 */
+     if (sk->closing || sk->close_on_write)
+          tail = 0;
+
+     if (0 == head + ctl_len + tail) {
+          turn_off_events(sk, EPOLLOUT);
+          wsd_errno = WSD_EAGAIN;
+          return (-1);
+     }
+
+     struct iovec iov[3];
+     iov[0].iov_base = &b->data[b->rdpos];
+     iov[0].iov_len = head;
+     iov[1].iov_base = &ctl->data[ctl->rdpos];
+     iov[1].iov_len = ctl_len;
+     iov[2].iov_base = &b->data[b->rdpos + head];
+     iov[2].iov_len = tail;
+
+     ssize_t len = writev(sk->fd, iov, 3);
+     if (0 > len) {
+          wsd_errno = WSD_CHECKERRNO;
+          return (-1);
+     }
+
+     if (LOG_VVVERBOSE <= wsd_cfg->verbose) {
+          printf("%s:%d: %s: wrote %ld byte(s) to %d\n",
+                 __FILE__,
+                 __LINE__,
+                 __func__,
+                 len,
+                 sk->fd);
+     }
+
+     unsigned long int left = (unsigned long int)len;
+     unsigned long int n = left < head ? left : head;
+     b->rdpos += n;
+     sk->tx_left -= n;
+     left -= n;
+
+     n = left < ctl_len ? left : ctl_len;
+     ctl->rdpos += n;
+     left -= n;
+
+     /* Into data after control frames; find where the last frame ends */
+     while (left) {
+          if (0 == sk->tx_left)
+               sk->tx_left = (unsigned int)frame_len(&b->data[b->rdpos]);
+          n = left < sk->tx_left ? left : sk->tx_left;
+          b->rdpos += n;
+          sk->tx_left -= n;
+          left -= n;
+     }
+
+     drop_after_close(sk);
+     skb_compact(b);
+     skb_compact(ctl);
+
+     return 0;
+}
+
+/* Length of frame at p, header included; see section 5.2 RFC6455 */
+unsigned long int
+frame_len(const char *p)
+{
+     unsigned long int len = PAYLOAD_LEN(p[1]), hdr_len = 2;
+     if (126 == len) {
+          uint16_t k;
+          memcpy(&k, &p[2], sizeof(k));
+          len = be16toh(k);
+          hdr_len += sizeof(k);
+     } else if (127 == len) {
+          uint64_t k;
+          memcpy(&k, &p[2], sizeof(k));
+          len = be64toh(k);
+          hdr_len += sizeof(k);
+     }
+
+     if (MASK_BIT(p[1]))
+          hdr_len += sizeof(unsigned int);
+
+     return hdr_len + len;
+}
+
+/*
+ * Discards data queued behind a close frame once the close frame and
+ * the data frame it followed are out; see section 5.5.1 RFC6455.
+ */
+void
+drop_after_close(sk_t *sk)
+{
+     if ((sk->closing || sk->close_on_write)
+         && 0 == sk->tx_left
+         && 0 == skb_rdsz(sk->ctlbuf)) {
+          skb_reset(sk->sendbuf);
+     }
+}
+
+/* Counts round trip of last ping in its power of two of microseconds */
+void
+record_ping_rtt(sk_t *sk)
+{
+     struct timespec now;
+     AZ(clock_gettime(CLOCK_MONOTONIC, &now));
+     long us = (now.tv_sec - sk->ts_ping.tv_sec) * 1000000
+          + (now.tv_nsec - sk->ts_ping.tv_nsec) / 1000;
+
+     unsigned int i = 0;
+     while (1 < us && i < WS_PING_RTT_BUCKETS - 1) {
+          us >>= 1;
+          i++;
+     }
+     ws_ping_rtt[i]++;
+
+     sk->ts_ping.tv_sec = 0;
+     sk->ts_ping.tv_nsec = 0;
+}
+
+/*
+ * Reads and unmasks payload of the frame being received, if any, while
+ * it is still in cache; for large frames arriving in many reads every
+ * byte is touched once right after it lands in the receive buffer.
+ */
+int
+ws_read(sk_t *sk)
+{
+     int rv = sk_read(sk);
+     if (0 > rv)
+          return rv;
+
+     if (!sk->rx.pending && 0 > decode_header(sk))
+          return 0; /* Incomplete or invalid; ws_decode_frame() tells */
+
+     unmask_ready(sk);
+     return 0;
+}
+
 int
 ws_decode_frame(sk_t *sk)
 {
@@ -134,6 +383,49 @@ ws_decode_frame(sk_t *sk)
                  sk->fd);
      }
 
+     wsrx_t *rx = &sk->rx;
+     if (!rx->pending && 0 > decode_header(sk))
+          return (-1);
+
+     unmask_ready(sk);
+
+     /* Compressed messages inflate as they arrive, whatever their size */
+     if (sk->pmd && sk->pmd->rx_msg && !IS_CONTROL(rx->byte1))
+          return inflate_payload(sk);
+
+     /*
+      * Large data frames needn't fit the receive buffer: forward payload
+      * in chunks as it arrives, the header being consumed for good.
+      */
+     if (WS_STREAM_CHUNK < rx->len && !IS_CONTROL(rx->byte1))
+          return stream_payload(sk);
+
+     if (rx->ready < rx->remaining) {
+          wsd_errno = WSD_EINPUT;
+          return (-1);
+     }
+
+     wsframe_t wsf;
+     memset(&wsf, 0, sizeof(wsframe_t));
+     wsf.byte1 = rx->byte1;
+     wsf.payload_len = rx->len;
+
+     /* Kept pending on failure, to be dispatched again as is */
+     int rv = dispatch_payload(sk, &wsf);
+     if (0 > rv)
+          return rv;
+
+     memset(rx, 0, sizeof(wsrx_t));
+     return 0;
+}
+
+/*
+ * Decodes header of next frame into sk->rx and consumes it; nothing is
+ * consumed until the header is complete.
+ */
+int
+decode_header(sk_t *sk)
+{
      if (skb_rdsz(sk->recvbuf) < WS_MASKED_FRAME_LEN) {
           /* need WS_MASKED_FRAME_LEN bytes; see RFC6455 section 5.2. */
           wsd_errno = WSD_EINPUT;
@@ -147,23 +439,39 @@ ws_decode_frame(sk_t *sk)
      skb_get(sk->recvbuf, wsf.byte1);
      skb_get(sk->recvbuf, wsf.byte2);
 
+     /* RSV1 marks first frame of compressed message; see RFC7692 */
+     bool compressed = RSV1_BIT(wsf.byte1)
+          && sk->pmd
+          && !sk->pmd->rx_msg
+          && (WS_TEXT_FRAME == OPCODE(wsf.byte1)
+              || WS_BINARY_FRAME == OPCODE(wsf.byte1));
+
      /* see RFC6455 section 5.2 */
-     if (RSV1_BIT(wsf.byte1) != 0 ||
+     if ((RSV1_BIT(wsf.byte1) != 0 && !compressed) ||
          RSV2_BIT(wsf.byte1) != 0 ||
          RSV3_BIT(wsf.byte1) != 0 ||
          MASK_BIT(wsf.byte2) == 0) {
 
+          skb_rd_reset(sk->recvbuf, old_rdpos);
           wsd_errno = WSD_EBADREQ;
           return (-1);
      }
 
      wsf.payload_len = ws_decode_payload_len(sk->recvbuf, wsf.byte2);
-     if (0 > wsf.payload_len) {
+     if (ULONG_MAX == wsf.payload_len) {
+          skb_rd_reset(sk->recvbuf, old_rdpos);
+          return (-1);
+     }
+
+     /* Most significant bit must be 0; see RFC6455 section 5.2 */
+     if ((ULONG_MAX >> 1) < wsf.payload_len) {
           skb_rd_reset(sk->recvbuf, old_rdpos);
+          wsd_errno = WSD_EBADREQ;
           return (-1);
      }
 
      if (sizeof(wsf.masking_key) > skb_rdsz(sk->recvbuf)) {
+          skb_rd_reset(sk->recvbuf, old_rdpos);
           wsd_errno = WSD_EINPUT;
           return (-1);
      }
@@ -172,22 +480,158 @@ ws_decode_frame(sk_t *sk)
      if (LOG_VERBOSE <= wsd_cfg->verbose)
           ws_printf(stderr, &wsf, "RX", sk->hash);
 
-     /* TODO check that payload64 has left-most bit off */
+     sk->rx.len = wsf.payload_len;
+     sk->rx.remaining = wsf.payload_len;
+     sk->rx.ready = 0;
+     sk->rx.masking_key = wsf.masking_key;
+     sk->rx.byte1 = wsf.byte1;
+     sk->rx.pending = true;
+     if (compressed)
+          sk->pmd->rx_msg = true;
+     return 0;
+}
 
-     /* TODO introduce a practical maximum payload size */
+/* Unmasks payload of pending frame that arrived since last time */
+void
+unmask_ready(sk_t *sk)
+{
+     wsrx_t *rx = &sk->rx;
+     unsigned long int n = skb_rdsz(sk->recvbuf);
+     if (n > rx->remaining)
+          n = rx->remaining;
+     if (n <= rx->ready)
+          return;
+
+     ws_unmask(&sk->recvbuf->data[sk->recvbuf->rdpos + rx->ready],
+               n - rx->ready,
+               rx->masking_key,
+               rx->len - rx->remaining + rx->ready);
+     rx->ready = n;
+}
+
+/*
+ * Unmasks len bytes at p, the first of which is at offset in the
+ * payload; a word at a time with the key rotated to match offset.
+ */
+void
+ws_unmask(char *p,
+          unsigned long int len,
+          unsigned int masking_key,
+          unsigned long int offset)
+{
+     unsigned int r = (offset & 3) * 8;
+     unsigned int key = r ? masking_key >> r | masking_key << (32 - r)
+          : masking_key;
+     uint64_t key64 = (uint64_t)key << 32 | key;
+
+     unsigned long int i = 0;
+     for (; i + sizeof(key64) <= len; i += sizeof(key64)) {
+          uint64_t w;
+          memcpy(&w, &p[i], sizeof(w));
+          w ^= key64;
+          memcpy(&p[i], &w, sizeof(w));
+     }
+     for (; i < len; i++)
+          p[i] = unmask(p[i], i, key);
+}
 
-     if (wsf.payload_len > skb_rdsz(sk->recvbuf)) {
-          sk->recvbuf->rdpos = old_rdpos;
+/*
+ * Forwards unmasked payload of streamed frame received so far, up to
+ * WS_STREAM_CHUNK bytes. Every chunk but the last goes without the FIN
+ * bit, so the backend learns the message continues. Bytes the backend
+ * had no room for stay unmasked for next time.
+ */
+int
+stream_payload(sk_t *sk)
+{
+     wsrx_t *rx = &sk->rx;
+     AN(rx->remaining);
+
+     unsigned long int n = rx->ready;
+     if (n > WS_STREAM_CHUNK)
+          n = WS_STREAM_CHUNK;
+     if (0 == n) {
           wsd_errno = WSD_EINPUT;
           return (-1);
      }
 
-     unsigned int end = sk->recvbuf->rdpos + wsf.payload_len;
-     for (unsigned int i = sk->recvbuf->rdpos, j = 0; i < end; i++, j++)
-          sk->recvbuf->data[i] =
-               unmask(sk->recvbuf->data[i], j, wsf.masking_key);
+     wsframe_t wsf;
+     memset(&wsf, 0, sizeof(wsframe_t));
+     wsf.byte1 = n == rx->remaining ? rx->byte1 : rx->byte1 & 0x7f;
+     wsf.payload_len = n;
+
+     int rv = dispatch_payload(sk, &wsf);
+     if (0 > rv)
+          return rv;
+
+     rx->remaining -= n;
+     rx->ready -= n;
+     if (0 == rx->remaining)
+          memset(rx, 0, sizeof(wsrx_t));
+     return 0;
+}
+
+/*
+ * Inflates payload of compressed message received so far and forwards
+ * as much as the backend has room for in one PP2 record. Every record
+ * but the one completing the message goes without the FIN bit.
+ */
+int
+inflate_payload(sk_t *sk)
+{
+     wsrx_t *rx = &sk->rx;
+     skb_t *b = sk->recvbuf;
+
+     unsigned long int room = skb_wrsz(pp2sk->sendbuf);
+     if (PP2_MAX_HEADER_LEN >= room) {
+          wsd_errno = WSD_EAGAIN;
+          return (-1);
+     }
+     room -= PP2_MAX_HEADER_LEN;
+     if (room > sizeof(inflated))
+          room = sizeof(inflated);
+
+     bool fin = fin_bit(rx->byte1) && rx->ready == rx->remaining;
+     unsigned long int in = rx->ready, out = room;
+     int rv = pmd_inflate(sk->pmd, &b->data[b->rdpos], &in, inflated, &out, fin);
+     if (0 > rv)
+          return rv;
+
+     b->rdpos += in;
+     rx->remaining -= in;
+     rx->ready -= in;
+     skb_compact(b);
+
+     /* Opcode goes in first record, even if first frame inflates to none */
+     bool first = OPCODE(rx->byte1) && !sk->rx_frag && 0 == rx->remaining;
+     if (out || 1 == rv || first) {
+          wsframe_t wsf;
+          memset(&wsf, 0, sizeof(wsframe_t));
+          if (1 == rv)
+               set_fin_bit(wsf.byte1);
+          set_opcode(wsf.byte1, OPCODE(rx->byte1));
+          wsf.payload_len = out;
+          wsf.payload = inflated;
+          AZ(pp2sk->proto->encode_frame(sk, &wsf));
+     }
+
+     if (1 == rv) {
+          sk->pmd->rx_msg = false;
+          memset(rx, 0, sizeof(wsrx_t));
+          return 0;
+     }
+
+     /* Frame done, message continues in next */
+     if (0 == rx->remaining && !fin_bit(rx->byte1)) {
+          memset(rx, 0, sizeof(wsrx_t));
+          return 0;
+     }
+
+     if (in || out)
+          return 0;
 
-     return dispatch_payload(sk, &wsf);
+     wsd_errno = WSD_EINPUT;
+     return (-1);
 }
 
 int
@@ -204,11 +648,15 @@ dispatch_payload(sk_t *sk, wsframe_t *wsf)
           rv = ws_finish_closing_handshake(sk, false, wsf->payload_len);
           break;
      case WS_PING_FRAME:
+          skb_rd_forward(sk->recvbuf, wsf->payload_len);
           skb_compact(sk->recvbuf);
           rv = sk->proto->pong(sk, false);
           break;
      case WS_PONG_FRAME:
+          skb_rd_forward(sk->recvbuf, wsf->payload_len);
           skb_compact(sk->recvbuf);
+          if (sk->ts_ping.tv_sec || sk->ts_ping.tv_nsec)
+               record_ping_rtt(sk);
           rv = 0;
           break;
      default:
@@ -273,16 +721,21 @@ ws_finish_closing_handshake(sk_t *sk,
 
      unsigned short status = 0; /* Not used, see RFC6455 section 7.4.2. */ 
      if (WS_FRAME_STATUS_LEN <= len &&
-         WS_FRAME_STATUS_LEN <= skb_wrsz(sk->sendbuf)) {
+         WS_FRAME_STATUS_LEN <= skb_wrsz(ctl_skb(sk))) {
           skb_get(sk->recvbuf, status);
           status = be16toh(status);
      }
+     if (!sk->close_code)
+          sk->close_code = status ? status : WS_1005;
 
      int rv;
-     rv = encode_close_frame(sk->sendbuf, status, do_mask, sk->hash);
+     rv = encode_close_frame(ctl_skb(sk), status, do_mask, sk->hash);
      if (0 == rv) {
           sk->close_on_write = 1;
           sk->closing = 1;
+
+          if (!(sk->events & EPOLLOUT))
+               turn_on_events(sk, EPOLLOUT);
      }
 
      /* Don't process data after close frame, see RFC6455 section 5.5.1. */
@@ -378,8 +831,10 @@ int
 ws_start_closing_handshake(sk_t *sk, const int status, const bool do_mask)
 {
      AZ(sk->closing);
-     
-     int rv = encode_close_frame(sk->sendbuf, status, do_mask, sk->hash);
+     if (!sk->close_code)
+          sk->close_code = status;
+
+     int rv = encode_close_frame(ctl_skb(sk), status, do_mask, sk->hash);
      if (0 == rv) {
           sk->closing = 1;
 
@@ -395,10 +850,15 @@ ws_ping(sk_t *sk, const bool do_mask)
 {
      AZ(sk->closing);
 
-     int rv = encode_ping_pong_frame(sk->sendbuf, WS_PING_FRAME, do_mask, sk->hash);
-     if (0 == rv)
+     int rv = encode_ping_pong_frame(ctl_skb(sk),
+                                     WS_PING_FRAME,
+                                     do_mask,
+                                     sk->hash);
+     if (0 == rv) {
+          AZ(clock_gettime(CLOCK_MONOTONIC, &sk->ts_ping));
           if (!(sk->events & EPOLLOUT))
                turn_on_events(sk, EPOLLOUT);
+     }
 
      return rv;
 }
@@ -408,7 +868,10 @@ ws_pong(sk_t *sk, const bool do_mask)
 {
      AZ(sk->closing);
 
-     int rv = encode_ping_pong_frame(sk->sendbuf, WS_PONG_FRAME, do_mask, sk->hash);
+     int rv = encode_ping_pong_frame(ctl_skb(sk),
+                                     WS_PONG_FRAME,
+                                     do_mask,
+                                     sk->hash);
      if (0 == rv)
           if (!(sk->events & EPOLLOUT))
                turn_on_events(sk, EPOLLOUT);
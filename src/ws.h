@@ -22,20 +22,33 @@
 #define WS_VER                "Sec-WebSocket-Version: "
 #define WS_PROTO              "Sec-WebSocket-Protocol: "
 
+/* Data frames with larger payload are forwarded in chunks of this size */
+#define WS_STREAM_CHUNK       65536
+
 /* defined status codes, see RFC6455 section 7.4.1 */
 #define WS_1000 1000
+#define WS_1005 1005  /* No status in close frame; never sent */
+#define WS_1006 1006  /* Closed without close frame; never sent */
 #define WS_1011 1011
 
 #define set_fin_bit(byte)     (byte |= 0x80)
 #define set_opcode(byte, val) (byte |= (0xf & val))
 #define set_mask_bit(byte)    (byte |= 0x80)
+#define set_rsv1_bit(byte)    (byte |= 0x40)
 #define RSV1_BIT(byte)        (0x40 & byte)
 #define RSV2_BIT(byte)        (0x20 & byte)
 #define RSV3_BIT(byte)        (0x10 & byte)
 #define OPCODE(byte)          (0xf & byte)
+#define IS_CONTROL(byte)      (0x8 & byte)
 #define MASK_BIT(byte)        ((0x80 & byte) >> 7)
 #define PAYLOAD_LEN(byte)     (unsigned long int)(0x7f & byte)
 
+/* Ping round trips in powers of two of microseconds, last one open-ended */
+#define WS_PING_RTT_BUCKETS   24
+extern unsigned long int ws_ping_rtt[WS_PING_RTT_BUCKETS];
+
+int ws_read(sk_t *sk);
+int ws_write(sk_t *sk);
 int ws_decode_frame(sk_t *sk);
 int ws_encode_frame(sk_t *sk, wsframe_t *wsf);
 long ws_calculate_frame_length(const unsigned long len);
@@ -47,6 +60,10 @@ int ws_finish_closing_handshake(sk_t *sk,
                                 const bool do_mask,
                                 const unsigned long int len);
 unsigned long int ws_decode_payload_len(skb_t *buf, const char byte2);
+void ws_unmask(char *p,
+               unsigned long int len,
+               unsigned int masking_key,
+               unsigned long int offset);
 void ws_printf(FILE *stream,
                const wsframe_t *wsf,
                const char *prefix,
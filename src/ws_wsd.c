@@ -19,6 +19,8 @@
  */
 
 #include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <netdb.h>
 #include <unistd.h>
@@ -29,34 +31,77 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 
-#include <openssl/sha.h>
-#include <openssl/bio.h>
-#include <openssl/evp.h>
-#include <openssl/buffer.h>
-
 #include "ws_wsd.h"
 #include "common.h"
+#include "sha1.h"
 #include "pp2.h"
+#include "http.h"
+#include "pmd.h"
+#include "pp2z.h"
 #include "ws.h"
 
 #define HTTP_101  "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: "
 #define HTTP_400 "HTTP/1.1 400 Bad Request\r\nSec-WebSocket-Version: 13\r\nContent-Length: 0\r\n\r\n"
+#define HTTP_101_VER "\r\n" WS_VER "13\r\n"
 
-#define SCRATCH_SIZE 64
+/* Key and GUID hash in at most two blocks */
+#define WS_KEY_MAX_LEN (2 * SHA1_BLOCK_LEN - 9 - (sizeof(WS_GUID) - 1))
 
 extern unsigned int num;
 extern unsigned int wsd_errno;
 extern const wsd_config_t *wsd_cfg;
-extern struct list_head *sk_list;
 extern sk_t *pp2sk;
 
 static const char *FLD_SEC_WS_VER_VAL = "13";
 
+static const char b64[] =
+     "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/* Protocol line of 101 response iff configured; built by ws_wsd_init() */
+static char *http_101_proto = NULL;
+static unsigned int http_101_proto_len = 0;
+
 static bool is_valid_proto(const char *proto, http_req_t *hr);
 static bool is_valid_ver(http_req_t *hr);
-static int prepare_handshake(skb_t *b, http_req_t *hr);
-static int generate_accept_val(skb_t *b, http_req_t *hr);
+static int prepare_handshake(sk_t *sk, http_req_t *hr);
+static int accept_extensions(sk_t *sk, http_req_t *req, chunk_t *ext);
+static int check_handshake(sk_t *sk, http_req_t *req);
+static int upgrade(sk_t *sk, http_req_t *req);
+static int switch_to_ws(sk_t *sk);
+static void handshake_work(hsjob_t *job);
 static int sk_open(const char *hostname, const char *service);
+static int link_open();
+static int check_announce(sk_t *sk, http_req_t *req);
+static int announce(sk_t *sk, http_req_t *req);
+static int refuse(sk_t *sk);
+static int limited_read(sk_t *sk);
+static bool throttled(const sk_t *sk);
+static void resume_reading(sk_t *sk);
+static int credited_write(sk_t *sk);
+
+/* Precomputes what the 101 response has in common across handshakes */
+int
+ws_wsd_init(const wsd_config_t *cfg)
+{
+     pmd_init(cfg->deflate_level, cfg->deflate_mode);
+
+     free(http_101_proto);
+     http_101_proto = NULL;
+     http_101_proto_len = 0;
+
+     if (NULL == cfg->sec_ws_proto)
+          return 0;
+
+     http_101_proto_len = strlen(WS_PROTO) + strlen(cfg->sec_ws_proto) + 2;
+     if (!(http_101_proto = malloc(http_101_proto_len + 1))) {
+          http_101_proto_len = 0;
+          wsd_errno = WSD_ENOMEM;
+          return (-1);
+     }
+     sprintf(http_101_proto, "%s%s\r\n", WS_PROTO, cfg->sec_ws_proto);
+
+     return 0;
+}
 
 int
 ws_recv(sk_t *sk)
@@ -70,81 +115,338 @@ ws_recv(sk_t *sk)
                  skb_rdsz(sk->recvbuf));
      }
 
-     AN(skb_rdsz(sk->recvbuf));
-
-     int rv;
-     if (NULL == pp2sk) {
-          int retries = wsd_cfg->fhostname_num;
-          while (retries--) {
-               rv = sk_open(wsd_cfg->fhostname[num], wsd_cfg->fport);
-               if (0 > rv && wsd_errno == WSD_EAI) {
-                    next_host();
-                    continue;
-               }
-               break;
-          }
-          if (0 > rv)
-               return (-1);
+     /* ws_read() may have consumed nothing but a frame header */
+     A(skb_rdsz(sk->recvbuf) || sk->rx.pending);
+
+     if (0 > link_open())
+          return (-1);
+
+     /* Low priority clients leave the second half of the link to others */
+     if (sk->low_prio
+         && skb_rdsz(pp2sk->sendbuf) > pp2sk->sendbuf->size / 2) {
+          wsd_errno = WSD_EAGAIN;
+          return (-1);
      }
 
-     int frames = 0;
-     while (0 == (rv = sk->proto->decode_frame(sk)))
+     bool paused;
+     int rv = -1, frames = 0;
+     while (!(paused = pp2_paused(sk))
+            && 0 == (rv = sk->proto->decode_frame(sk)))
           frames++;
 
      if (frames) {
-          if (0 < skb_rdsz(pp2sk->sendbuf) && !(pp2sk->events & EPOLLOUT))
+          if (0 < skb_rdsz(pp2sk->sendbuf)
+              && !(pp2sk->events & EPOLLOUT)
+              && !pp2_batching())
                turn_on_events(pp2sk, EPOLLOUT);
 
-          if (!(sk->events & EPOLLIN) && sk->close_on_write)
-               turn_on_events(sk, EPOLLIN);
+          /* Room again in a receive buffer filled up, e.g. by a stream */
+          resume_reading(sk);
      }
 
      if (sk->close || sk->close_on_write)
           turn_off_events(sk, EPOLLIN);
 
-     if (sk->close_on_write && !(sk->events & EPOLLOUT))
+     /* Either way on_write() closes it, e.g. once it answered our close */
+     if ((sk->close || sk->close_on_write) && !(sk->events & EPOLLOUT))
           turn_on_events(sk, EPOLLOUT);
 
+     /* Out of credit; what it sent already waits for more */
+     if (paused) {
+          if (sk->events & EPOLLIN)
+               turn_off_events(sk, EPOLLIN);
+          wsd_errno = (skb_rdsz(sk->recvbuf) || sk->rx.pending)
+               ? WSD_EAGAIN : WSD_EINPUT;
+          return (-1);
+     }
+
      return rv;
 }
 
 int
 ws_decode_handshake(sk_t *sk, http_req_t *req)
 {
-     if (!is_valid_ver(req)) {
+     if (0 > check_handshake(sk, req))
+          return (-1);
 
-          if (0 == skb_put_strn(sk->sendbuf, HTTP_400, strlen(HTTP_400))) {
-               sk->close_on_write = 1;
-          }
+     return upgrade(sk, req);
+}
 
-          goto error;
+/*
+ * As ws_decode_handshake(), but computes the response on a worker of
+ * the handshake pool, leaving reads off until ws_finish_handshake().
+ * Done inline if the pool is backed up.
+ */
+int
+ws_decode_handshake_async(sk_t *sk, http_req_t *req)
+{
+     if (0 > check_handshake(sk, req))
+          return (-1);
+
+     trim(&(req->sec_ws_key));
+     trim(&(req->sec_ws_proto));
+
+     if (0 > check_announce(sk, req))
+          return refuse(sk);
+
+     /* As ws_accept_val() would; workers mustn't touch wsd_errno */
+     if (WS_KEY_MAX_LEN < req->sec_ws_key.len)
+          return upgrade(sk, req);
+
+     char ext_line[PMD_MAX_RESPONSE_LEN];
+     chunk_t ext = { ext_line, 0 };
+     if (0 > accept_extensions(sk, req, &ext))
+          return upgrade(sk, req);
+
+     hsjob_t *job = hsjob_alloc(sk->hash,
+                                &req->sec_ws_key,
+                                &req->sec_ws_proto,
+                                &ext,
+                                wsd_cfg->lifecycle ? req : NULL,
+                                ws_handshake_len(&req->sec_ws_proto, &ext));
+     if (!job)
+          return upgrade(sk, req);
+
+     job->work = handshake_work;
+     if (0 > hspool_submit(job)) {
+          free(job);
+          return upgrade(sk, req);
      }
 
+     /* Anything pipelined stays put until upgraded */
+     turn_off_events(sk, EPOLLIN);
+     skb_compact(sk->recvbuf);
+
+     wsd_errno = WSD_EINPUT;
+     return (-1);
+}
+
+/*
+ * Sends 101 response computed by a worker and switches sk to websocket
+ * mode; on failure, sends 500 instead and closes once written.
+ */
+int
+ws_finish_handshake(sk_t *sk, const hsjob_t *job)
+{
+     unsigned int wrpos = sk->sendbuf->wrpos;
+     http_req_t req = job->req;
+     if (0 > job->rv)
+          goto error_500;
+
+     /* The link may have gone or filled up meanwhile */
+     if (0 > check_announce(sk, &req))
+          goto error_500;
+
+     if (SKB_SIZE > sk->sendbuf->size
+         && 0 > skb_resize(&sk->sendbuf, SKB_SIZE))
+          goto error_500;
+
+     if (0 > skb_put_strn(sk->sendbuf, job->resp.p, job->resp.len))
+          goto error_500;
+
+     if (0 > switch_to_ws(sk)) {
+          sk->sendbuf->wrpos = wrpos;
+          goto error_500;
+     }
+     AZ(announce(sk, &req));
+
+     if (!(sk->events & EPOLLIN))
+          turn_on_events(sk, EPOLLIN);
+
+     return 0;
+
+error_500:
+     if (0 == skb_put_strn(sk->sendbuf, HTTP_500, strlen(HTTP_500))) {
+          sk->close_on_write = 1;
+     }
+
+     skb_reset(sk->recvbuf);
+     wsd_errno = WSD_EBADREQ;
+
+     if (!(sk->events & EPOLLOUT)) {
+          turn_on_events(sk, EPOLLOUT);
+     }
+
+     return (-1);
+}
+
+/*
+ * Length of 101 response to a request asking for proto, if any, with
+ * extensions agreed on in header line ext, if any
+ */
+unsigned int
+ws_handshake_len(const chunk_t *proto, const chunk_t *ext)
+{
+     /* Configured protocol is known to match; else echo back requested */
+     unsigned int proto_len = 0;
+     if (proto->len && http_101_proto)
+          proto_len = http_101_proto_len;
+     else if (proto->len)
+          proto_len = strlen(WS_PROTO) + proto->len + 2;
+
+     return sizeof(HTTP_101) - 1
+          + WS_ACCEPT_KEY_LEN
+          + sizeof(HTTP_101_VER) - 1
+          + proto_len
+          + ext->len
+          + 2;                  /* +2 `\r\n' */
+}
+
+/* Writes ws_handshake_len(proto, ext) bytes of 101 response to dst */
+int
+ws_handshake_response(char *dst,
+                      const chunk_t *key,
+                      const chunk_t *proto,
+                      const chunk_t *ext)
+{
+     char *p = dst;
+     memcpy(p, HTTP_101, sizeof(HTTP_101) - 1);
+     p += sizeof(HTTP_101) - 1;
+
+     if (0 > ws_accept_val(p, key))
+          return (-1);
+     p += WS_ACCEPT_KEY_LEN;
+
+     memcpy(p, HTTP_101_VER, sizeof(HTTP_101_VER) - 1);
+     p += sizeof(HTTP_101_VER) - 1;
+
+     if (proto->len && http_101_proto) {
+          memcpy(p, http_101_proto, http_101_proto_len);
+          p += http_101_proto_len;
+     } else if (proto->len) {
+          memcpy(p, WS_PROTO, strlen(WS_PROTO));
+          p += strlen(WS_PROTO);
+          memcpy(p, proto->p, proto->len);
+          p += proto->len;
+          *p++ = '\r';
+          *p++ = '\n';
+     }
+
+     memcpy(p, ext->p, ext->len);
+     p += ext->len;
+
+     /* terminating response as per RFC2616 section 6 */
+     *p++ = '\r';
+     *p++ = '\n';
+
+     A(p == dst + ws_handshake_len(proto, ext));
+
+     return 0;
+}
+
+/* Queues 400 response unless request is acceptable */
+int
+check_handshake(sk_t *sk, http_req_t *req)
+{
+     if (!is_valid_ver(req))
+          goto error;
+
      /* TODO check location */
 
      if (NULL != wsd_cfg->sec_ws_proto
-         && !is_valid_proto(wsd_cfg->sec_ws_proto, req)) {
-          
-          if (0 == skb_put_strn(sk->sendbuf, HTTP_400, strlen(HTTP_400))) {
-               sk->close_on_write = 1;
-          }
-
+         && !is_valid_proto(wsd_cfg->sec_ws_proto, req))
           goto error;
+
+     return 0;
+
+error:
+     if (0 == skb_put_strn(sk->sendbuf, HTTP_400, strlen(HTTP_400))) {
+          sk->close_on_write = 1;
+     }
+
+     skb_reset(sk->recvbuf);
+     wsd_errno = WSD_EBADREQ;
+
+     if (sk->close_on_write) {
+          turn_off_events(sk, EPOLLIN);
+          if (!(sk->events & EPOLLOUT)) {
+               turn_on_events(sk, EPOLLOUT);
+          }
      }
 
+     return (-1);
+}
+
+/* Responds to acceptable request and switches sk to websocket mode */
+int
+upgrade(sk_t *sk, http_req_t *req)
+{
      /* handshake syntactically and semantically correct */
 
      AN(skb_wrsz(sk->sendbuf));
 
-     if (0 > prepare_handshake(sk->sendbuf, req)) {
+     /*
+      * Buffers stay small until the upgrade; grow the send buffer now
+      * and the receive buffer once done with req, which points into it.
+      */
+     unsigned int wrpos = sk->sendbuf->wrpos;
+     if (SKB_SIZE > sk->sendbuf->size
+         && 0 > skb_resize(&sk->sendbuf, SKB_SIZE))
+          goto error_500;
+
+     if (0 > check_announce(sk, req))
+          goto error_500;
+
+     if (0 > prepare_handshake(sk, req))
+          goto error_500;
+
+     /* The switch compacts the receive buffer req points into */
+     char fields[SKB_HANDSHAKE_SIZE];
+     http_req_t open_req;
+     if (wsd_cfg->lifecycle) {
+          if (sizeof(fields) < http_open_fields_len(req))
+               goto error_500;
+          http_copy_open_fields(&open_req, req, fields);
+     }
 
-          if (0 == skb_put_strn(sk->sendbuf, HTTP_500, strlen(HTTP_500))) {
-               sk->close_on_write = 1;
+     if (0 > switch_to_ws(sk)) {
+          sk->sendbuf->wrpos = wrpos;
+          goto error_500;
+     }
+     AZ(announce(sk, &open_req));
+
+     /* Frames sent along with the request needn't wait for next read */
+     if (skb_rdsz(sk->recvbuf))
+          return ws_recv(sk);
+
+     return 0;
+
+error_500:
+     return refuse(sk);
+}
+
+/* Answers 500 and closes sk once written */
+int
+refuse(sk_t *sk)
+{
+     if (0 == skb_put_strn(sk->sendbuf, HTTP_500, strlen(HTTP_500))) {
+          sk->close_on_write = 1;
+     }
+
+     skb_reset(sk->recvbuf);
+     wsd_errno = WSD_EBADREQ;
+
+     if (sk->close_on_write) {
+          turn_off_events(sk, EPOLLIN);
+          if (!(sk->events & EPOLLOUT)) {
+               turn_on_events(sk, EPOLLOUT);
           }
-          
-          goto error;
      }
 
+     return (-1);
+}
+
+/* Follows 101 response queued in sendbuf */
+int
+switch_to_ws(sk_t *sk)
+{
+     if (SKB_SIZE > sk->recvbuf->size
+         && 0 > skb_resize(&sk->recvbuf, SKB_SIZE))
+          return (-1);
+
+     if (!sk->ctlbuf && !(sk->ctlbuf = skb_alloc(SKB_CTL_SIZE)))
+          return (-1);
+
      /* "switch" into websocket mode */
      sk->proto->decode_frame = ws_decode_frame;
      sk->proto->encode_frame = ws_encode_frame;
@@ -152,8 +454,13 @@ ws_decode_handshake(sk_t *sk, http_req_t *req)
      sk->proto->pong = ws_pong;
      sk->proto->start_closing_handshake = ws_start_closing_handshake;
      sk->ops->recv = ws_recv;
+     sk->ops->read = ws_read;
+     sk->ops->write = wsd_cfg->window ? credited_write : ws_write;
+     sk->credit = wsd_cfg->window;
+
+     /* 101 response goes out whole before any control frame */
+     sk->tx_left = skb_rdsz(sk->sendbuf);
 
-     AZ(skb_rdsz(sk->recvbuf));
      AN(skb_wrsz(sk->sendbuf));
 
      skb_compact(sk->recvbuf);
@@ -163,19 +470,156 @@ ws_decode_handshake(sk_t *sk, http_req_t *req)
      }
 
      return 0;
+}
 
-error:
-     skb_reset(sk->recvbuf);
-     wsd_errno = WSD_EBADREQ;
-
-     if (sk->close_on_write) {
-          turn_off_events(sk, EPOLLIN);
-          if (!(sk->events & EPOLLOUT)) {
-               turn_on_events(sk, EPOLLOUT);
+/* Opens link to backend unless open, trying each host in turn */
+int
+link_open()
+{
+     if (pp2sk)
+          return 0;
+
+     int rv = -1, retries = wsd_cfg->fhostname_num;
+     while (retries--) {
+          rv = sk_open(wsd_cfg->fhostname[num], wsd_cfg->fport);
+          if (0 > rv && wsd_errno == WSD_EAI) {
+               next_host();
+               continue;
           }
+          break;
      }
 
-     return (-1);
+     return rv;
+}
+
+/*
+ * Fails iff an open record for sk is due and the backend can't be told;
+ * such clients are refused before they are upgraded
+ */
+int
+check_announce(sk_t *sk, http_req_t *req)
+{
+     if (!wsd_cfg->lifecycle || sk->announced)
+          return 0;
+
+     if (0 > link_open())
+          return (-1);
+
+     return pp2_check_open(req);
+}
+
+/*
+ * Queues open record for sk iff configured and not done yet, once it is
+ * a websocket; check_announce() said it would fit
+ */
+int
+announce(sk_t *sk, http_req_t *req)
+{
+     if (!wsd_cfg->lifecycle || sk->announced)
+          return 0;
+
+     return pp2_encode_open(sk, req);
+}
+
+/*
+ * Limits what sk may send to rate octets per second, with bursts of up
+ * to a second's worth; 0 lifts the limit
+ */
+void
+ws_set_rate(sk_t *sk, const unsigned int rate)
+{
+     sk->rate = rate;
+     sk->allowance = rate;
+     AZ(clock_gettime(CLOCK_MONOTONIC, &sk->ts_rate));
+     sk->ops->read = rate ? limited_read : ws_read;
+     resume_reading(sk);
+}
+
+/* Adds to allowance of rate limited sk what it earned since last time */
+void
+ws_refill(sk_t *sk, const struct timespec *now)
+{
+     long int ms = (now->tv_sec - sk->ts_rate.tv_sec) * 1000
+          + (now->tv_nsec - sk->ts_rate.tv_nsec) / 1000000;
+     long int earned = (long int)sk->rate * ms / 1000;
+     if (0 >= earned)
+          return;
+
+     sk->allowance += earned;
+     if (sk->allowance > sk->rate)
+          sk->allowance = sk->rate;
+     sk->ts_rate = *now;
+     resume_reading(sk);
+}
+
+/* As ws_read(), charging what was read to the allowance of sk */
+int
+limited_read(sk_t *sk)
+{
+     unsigned int wrpos = sk->recvbuf->wrpos;
+     int rv = ws_read(sk);
+     sk->allowance -= sk->recvbuf->wrpos - wrpos;
+     if (throttled(sk) && (sk->events & EPOLLIN))
+          turn_off_events(sk, EPOLLIN);
+
+     return rv;
+}
+
+bool
+throttled(const sk_t *sk)
+{
+     return sk->rate && 0 >= sk->allowance;
+}
+
+/* Turns reads back on unless closing or held back on purpose */
+void
+resume_reading(sk_t *sk)
+{
+     if (!(sk->events & EPOLLIN)
+         && !sk->close_on_write
+         && !sk->close
+         && !throttled(sk)
+         && !pp2_paused(sk))
+          turn_on_events(sk, EPOLLIN);
+}
+
+/* Grants sk credit from the backend, reading again if it ran out */
+void
+ws_add_credit(sk_t *sk, const unsigned int credit)
+{
+     sk->credit += credit;
+     resume_reading(sk);
+}
+
+/*
+ * Gives the backend credit back for what it sent sk once at most half a
+ * window of it is left to write, so as to hold at most one and a half
+ * windows; a failure is retried on next timeout check
+ */
+void
+ws_credit_back(sk_t *sk)
+{
+     if (sk->owed && skb_rdsz(sk->sendbuf) <= wsd_cfg->window / 2)
+          (void)pp2_encode_credit(sk);
+}
+
+/* As ws_write(), then credits the backend for what went out */
+int
+credited_write(sk_t *sk)
+{
+     int rv = ws_write(sk);
+     ws_credit_back(sk);
+     return rv;
+}
+
+/* Runs on a worker of the handshake pool */
+void
+handshake_work(hsjob_t *job)
+{
+     job->rv = ws_handshake_response(job->resp.p,
+                                     &job->key,
+                                     &job->proto,
+                                     &job->ext);
 }
 
 bool
@@ -201,99 +645,100 @@ is_valid_proto(const char* proto, http_req_t *hr)
 }
 
 int
-prepare_handshake(skb_t *b, http_req_t *req)
+prepare_handshake(sk_t *sk, http_req_t *req)
 {
-     int len = strlen(HTTP_101);
-     if (skb_wrsz(b) < len)
-          return -1;
-     int old_wrpos = b->wrpos;
-     strcpy(&b->data[b->wrpos], HTTP_101);
-     b->wrpos += len;
-
-     len = WS_ACCEPT_KEY_LEN + 2; /* +2: `\r\n' */
-     if (skb_wrsz(b) < len)
-          goto error;
-     if (0 > generate_accept_val(b, req))
-          goto error;
-     len = strlen(WS_VER) + strlen(FLD_SEC_WS_VER_VAL) + 2; /* +2 `\r\n' */
-     if (skb_wrsz(b) < len)
-          goto error;
-     strcpy(&b->data[b->wrpos], WS_VER);
-     b->wrpos += strlen(WS_VER);
-     strcpy(&b->data[b->wrpos], FLD_SEC_WS_VER_VAL);
-     b->wrpos += strlen(FLD_SEC_WS_VER_VAL);
-     skb_put(b, (char)'\r');
-     skb_put(b, (char)'\n');
-
-     /* TODO for now echo back requested protocol */
+     trim(&(req->sec_ws_key));
      trim(&(req->sec_ws_proto));
-     len = strlen(WS_PROTO) + req->sec_ws_proto.len + 2; /* +2 `\r\n' */
+
+     char ext_line[PMD_MAX_RESPONSE_LEN];
+     chunk_t ext = { ext_line, 0 };
+     if (0 > accept_extensions(sk, req, &ext))
+          return (-1);
+
+     skb_t *b = sk->sendbuf;
+     unsigned int len = ws_handshake_len(&req->sec_ws_proto, &ext);
      if (skb_wrsz(b) < len)
-          goto error;
-     strcpy(&b->data[b->wrpos], WS_PROTO);
-     b->wrpos += strlen(WS_PROTO);
-     strncpy(&b->data[b->wrpos], req->sec_ws_proto.p, req->sec_ws_proto.len);
-     b->wrpos += req->sec_ws_proto.len;
-     skb_put(b, (char)'\r');
-     skb_put(b, (char)'\n');
+          return (-1);
 
-     /* terminating response as per RFC2616 section 6 */
-     if (skb_wrsz(b) < 2)
-          goto error;
-     skb_put(b, (char)'\r');
-     skb_put(b, (char)'\n');
+     if (0 > ws_handshake_response(&b->data[b->wrpos],
+                                   &req->sec_ws_key,
+                                   &req->sec_ws_proto,
+                                   &ext))
+          return (-1);
 
+     b->wrpos += len;
      return 0;
+}
 
-error:
-     b->wrpos = old_wrpos;
-     return (-1);
+/*
+ * Agrees on permessage-deflate iff enabled and offered, setting up
+ * sk->pmd and writing the response header line to ext->p, which has
+ * room for PMD_MAX_RESPONSE_LEN bytes. Offers that can't be honoured are
+ * declined, leaving ext->len 0; see section 9.1 RFC6455.
+ */
+int
+accept_extensions(sk_t *sk, http_req_t *req, chunk_t *ext)
+{
+     ext->len = 0;
+
+     /* Agreed on already iff handshake fell back to inline */
+     if (sk->pmd) {
+          pmd_free(sk->pmd);
+          sk->pmd = NULL;
+     }
+
+     if (0 == wsd_cfg->deflate_level || 0 == req->sec_ws_ext.len)
+          return 0;
+
+     pmd_params_t params;
+     if (0 > pmd_negotiate(&req->sec_ws_ext, true, &params))
+          return 0;
+
+     if (!(sk->pmd = pmd_alloc(&params, true)))
+          return (-1);
+
+     ext->len = pmd_response(ext->p, &params);
+     return 0;
 }
 
+/* Writes WS_ACCEPT_KEY_LEN characters of accept value for key to dst */
 int
-generate_accept_val(skb_t *b, http_req_t *hr)
+ws_accept_val(char *dst, const chunk_t *key)
 {
-     trim(&(hr->sec_ws_key));
+     if (WS_KEY_MAX_LEN < key->len) {
+          wsd_errno = WSD_EINPUT;
+          return (-1);
+     }
 
      /* concatenate as per RFC6455 section 4.2.2 */
-     char scratch[SCRATCH_SIZE];
-     memset(scratch, 0, SCRATCH_SIZE);
-     strncpy(scratch, hr->sec_ws_key.p, hr->sec_ws_key.len);
-     strcpy((char*)(scratch + hr->sec_ws_key.len), WS_GUID);
-
-     unsigned char *md = SHA1((unsigned char*)scratch,
-                              strlen(scratch),
-                              NULL);
-     A(md);
-
-     BIO *bio, *b64;
-     BUF_MEM *p;
-     b64 = BIO_new(BIO_f_base64());
-     bio = BIO_new(BIO_s_mem());
-     b64 = BIO_push(b64, bio);
-     BIO_write(b64, md, SHA_DIGEST_LENGTH);
-     (void)BIO_flush(b64);
-     BIO_get_mem_ptr(b64, &p);
-     memcpy(&b->data[b->wrpos], p->data, p->length - 1);
-     b->wrpos += p->length - 1;
-
-     BIO_free_all(b64);
-
-     skb_put(b, (char)'\r');
-     skb_put(b, (char)'\n');
-
-     return 1;
+     char scratch[WS_KEY_MAX_LEN + sizeof(WS_GUID) - 1];
+     memcpy(scratch, key->p, key->len);
+     memcpy(&scratch[key->len], WS_GUID, sizeof(WS_GUID) - 1);
+
+     unsigned char md[SHA1_DIGEST_LEN + 1];
+     sha1(scratch, key->len + sizeof(WS_GUID) - 1, md);
+     md[SHA1_DIGEST_LEN] = 0;
+
+     /* Base64 of 20 bytes: six full groups, then two bytes and a pad */
+     for (unsigned int i = 0; i < SHA1_DIGEST_LEN; i += 3) {
+          uint32_t v = md[i] << 16 | md[i + 1] << 8 | md[i + 2];
+          *dst++ = b64[v >> 18];
+          *dst++ = b64[(v >> 12) & 0x3f];
+          *dst++ = b64[(v >> 6) & 0x3f];
+          *dst++ = b64[v & 0x3f];
+     }
+     *(dst - 1) = '=';
+
+     return 0;
 }
 
 int
 sk_open(const char *hostname, const char *service)
 {
      AZ(pp2sk);
-     if (!(pp2sk = malloc(sizeof(sk_t)))) {
-          wsd_errno = WSD_ENOMEM;
+     if (!(pp2sk = sk_alloc())) {
           return (-1);
      }
-     memset(pp2sk, 0, sizeof(sk_t));
 
      int fd = socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK, 0);
      if (0 > fd) {
@@ -331,7 +776,7 @@ sk_open(const char *hostname, const char *service)
           goto error;
      }
 
-     if (0 > sk_init(pp2sk, fd, -1ULL))
+     if (0 > sk_init(pp2sk, fd, -1ULL, SKB_SIZE))
           goto error;
 
      pp2sk->ops->recv = pp2_recv;
@@ -340,7 +785,19 @@ sk_open(const char *hostname, const char *service)
      pp2sk->proto->encode_frame = pp2_encode_frame;
      pp2sk->proto->ping = pp2_nop;
      pp2sk->proto->ping = pp2_nop;
-     list_add_tail(&pp2sk->sk_node, sk_list);
+
+     if (wsd_cfg->batch_usec && 0 > pp2_batch_open(wsd_cfg->batch_usec))
+          goto error;
+
+     if (wsd_cfg->link_level && 0 > pp2z_offer(pp2sk, wsd_cfg->link_level))
+          goto error;
+
+     if (wsd_cfg->compact_link)
+          pp2_offer_compact(pp2sk);
+
+     if (wsd_cfg->window)
+          pp2_offer_flow(pp2sk, wsd_cfg->window);
+
      AZ(register_for_events(pp2sk));
      return 0;
 
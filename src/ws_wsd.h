@@ -3,8 +3,22 @@
 
 #include "types.h"
 #include "http.h"
+#include "hspool.h"
 
+int ws_wsd_init(const wsd_config_t *cfg);
 int ws_recv(sk_t *sk);
 int ws_decode_handshake(sk_t *sk, http_req_t *req);
+int ws_decode_handshake_async(sk_t *sk, http_req_t *req);
+int ws_finish_handshake(sk_t *sk, const hsjob_t *job);
+unsigned int ws_handshake_len(const chunk_t *proto, const chunk_t *ext);
+int ws_handshake_response(char *dst,
+                          const chunk_t *key,
+                          const chunk_t *proto,
+                          const chunk_t *ext);
+int ws_accept_val(char *dst, const chunk_t *key);
+void ws_set_rate(sk_t *sk, const unsigned int rate);
+void ws_refill(sk_t *sk, const struct timespec *now);
+void ws_add_credit(sk_t *sk, const unsigned int credit);
+void ws_credit_back(sk_t *sk);
 
 #endif /* #ifndef __WS_WSD_H__ */
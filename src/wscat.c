@@ -26,6 +26,7 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <netdb.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -39,6 +40,7 @@
 #include "types.h"
 #include "common.h"
 #include "parser.h"
+#include "pmd.h"
 #include "uri.h"
 
 #define skb_put_chunk(dst, src)                 \
@@ -64,6 +66,7 @@ static struct option long_opt[] = {
      {"json",                 required_argument, 0, 'j'},
      {"repeat-last",          required_argument, 0, 'R'},
      {"no-handshake",         no_argument,       0, 'N'},
+     {"deflate",              no_argument,       0, 'z'},
      {"verbose",              no_argument,       0, 'v'},
 #ifdef HAVE_LIBSSL
      {"no-check-certificate", no_argument,       0, 'x'},
@@ -71,11 +74,12 @@ static struct option long_opt[] = {
      {"help",                 no_argument,       0, 'h'},
      {0, 0, 0, 0}
 };
-static const char *optstring = "V:P:K:A:i:R:p:vhjNx";
+static const char *optstring = "V:P:K:A:i:R:p:vhjNzx";
 static sk_t *fdin = NULL;
 static sk_t *wssk = NULL;
 static bool is_json = false;
 static bool no_handshake = false;
+static bool offer_deflate = false;
 static int repeat_last_num = -1;
 static bool repeat_last_armed = false;
 static skb_t *last_input = NULL;
@@ -97,6 +101,7 @@ static int wssk_ws_encode_data_frame(skb_t *dst,
                                      skb_t *src,
                                      const unsigned int maxlen,
                                      const uint64_t hash);
+static int print_payload(sk_t *sk, unsigned long int len, const bool fin);
 static int repeat_last();
 static void try_repeating_last();
 static int on_iteration(const struct timespec *now);
@@ -120,6 +125,7 @@ main(int argc, char **argv)
      int opt;
      bool is_json_arg = false;
      bool no_handshake_arg = false;
+     bool deflate_arg = false;
      int repeat_last_num_arg = -1;
      int idle_timeout_arg = -1;
      int ping_interval_arg = -1;
@@ -171,6 +177,9 @@ main(int argc, char **argv)
           case 'N':
                no_handshake_arg = true;
                break;
+          case 'z':
+               deflate_arg = true;
+               break;
           case 'R':
                repeat_last_num_arg = atoi(optarg);
                break;
@@ -230,11 +239,11 @@ main(int argc, char **argv)
 
      is_json = is_json_arg;
      no_handshake = no_handshake_arg;
+     offer_deflate = deflate_arg;
 
      if (0 < repeat_last_num_arg) {
-          last_input = malloc(sizeof(skb_t));
+          last_input = skb_alloc(SKB_SIZE);
           A(last_input);
-          memset(last_input, 0, sizeof(skb_t));
           repeat_last_num = repeat_last_num_arg;
      }
 
@@ -333,6 +342,10 @@ create_http_req(sk_t *sk)
      req.sec_ws_ver.len = strlen(wsd_cfg->sec_ws_ver);
      req.user_agent.p = strdup(wsd_cfg->user_agent);
      req.user_agent.len = strlen(wsd_cfg->user_agent);
+     if (offer_deflate) {
+          req.sec_ws_ext.p = PMD_NAME "; client_max_window_bits";
+          req.sec_ws_ext.len = strlen(req.sec_ws_ext.p);
+     }
      
      AZ(skb_put_http_req(sk->sendbuf, &req));
 
@@ -388,15 +401,14 @@ wssk_init()
           return (-1);
      }
 
-     wssk = malloc(sizeof(sk_t));
+     wssk = sk_alloc();
      if (!wssk) {
-          perror("malloc");
+          perror("sk_alloc");
           AZ(close(fd));
           return (-1);
      }
-     memset(wssk, 0, sizeof(sk_t));
 
-     if (0 > sk_init(wssk, fd, 0ULL)) {
+     if (0 > sk_init(wssk, fd, 0ULL, SKB_SIZE)) {
           fprintf(stderr, "%s: sk_init: 0x%x\n", bin, wsd_errno);
           goto error;
      }
@@ -534,17 +546,35 @@ wssk_http_recv(sk_t *sk)
 
      /* TODO validate HTTP header fields */
 
+     /* Server may accept permessage-deflate, if offered; see RFC7692 */
+     if (hreq.sec_ws_ext.len) {
+          pmd_params_t params;
+          if (!offer_deflate
+              || 0 > pmd_negotiate(&hreq.sec_ws_ext, false, &params)) {
+               fprintf(stderr,
+                       "%s: unexpected extension: %.*s\n",
+                       bin,
+                       hreq.sec_ws_ext.len,
+                       hreq.sec_ws_ext.p);
+               goto error;
+          }
+
+          if (!(sk->pmd = pmd_alloc(&params, false))) {
+               perror("pmd_alloc");
+               goto error;
+          }
+     }
+
      sk->ops->recv = wssk_ws_recv;
      skb_reset(sk->recvbuf);
 
      /* Ready to speak websocket; read stdin. */
-     fdin = malloc(sizeof(sk_t));
+     fdin = sk_alloc();
      if (!fdin) {
-          perror("malloc");
+          perror("sk_alloc");
           exit(EXIT_FAILURE);
      }
-     memset(fdin, 0, sizeof(sk_t));
-     AZ(sk_init(fdin, 0, 0ULL));
+     AZ(sk_init(fdin, 0, 0ULL, SKB_SIZE));
      fdin->ops->recv = stdin_recv;
      fdin->ops->close = stdin_close;
      fdin->proto->decode_frame = stdin_decode_frame;
@@ -565,10 +595,48 @@ error:
 int
 wssk_ws_encode_frame(sk_t *sk, wsframe_t *wsf)
 {
-     return wssk_ws_encode_data_frame(wssk->sendbuf,
-                                      sk->recvbuf,
-                                      wsf->payload_len,
-                                      wssk->hash);
+     if (!wssk->pmd)
+          return wssk_ws_encode_data_frame(wssk->sendbuf,
+                                           sk->recvbuf,
+                                           wsf->payload_len,
+                                           wssk->hash);
+
+     /* Deflated input goes out as one message, RSV1 set; see RFC7692 */
+     unsigned int len = skb_rdsz(sk->recvbuf) < wsf->payload_len ?
+          skb_rdsz(sk->recvbuf) : wsf->payload_len;
+     unsigned long int bound = pmd_deflate_bound(wssk->pmd, len);
+     if (ws_calculate_frame_length(bound) + 5 > skb_wrsz(wssk->sendbuf)) {
+          wsd_errno = WSD_EAGAIN;
+          return (-1);
+     }
+
+     skb_t *b = skb_alloc(bound);
+     if (!b) {
+          wsd_errno = WSD_ENOMEM;
+          return (-1);
+     }
+
+     long n = pmd_deflate(wssk->pmd,
+                          &sk->recvbuf->data[sk->recvbuf->rdpos],
+                          len,
+                          b->data,
+                          bound,
+                          true);
+     if (0 > n) {
+          free(b);
+          return (-1);
+     }
+     sk->recvbuf->rdpos += len;
+     skb_compact(sk->recvbuf);
+     b->wrpos = n;
+
+     unsigned int wrpos = wssk->sendbuf->wrpos;
+     int rv = wssk_ws_encode_data_frame(wssk->sendbuf, b, n, wssk->hash);
+     if (0 == rv)
+          set_rsv1_bit(wssk->sendbuf->data[wrpos]);
+
+     free(b);
+     return rv;
 }
 
 int
@@ -781,9 +849,9 @@ repeat_last()
           return 0;
      }
 
-     sk_t *sk = malloc(sizeof(sk_t));
+     sk_t *sk = sk_alloc();
      A(sk);
-     AZ(sk_init(sk, -1, 0ULL));
+     AZ(sk_init(sk, -1, 0ULL, SKB_SIZE));
 
      int rv = 0;
      while (repeat_last_num) {
@@ -825,9 +893,11 @@ skb_put_http_req(skb_t *buf, http_req_t *req)
      skb_put_chunk(buf, req->host);
      skb_put_strn(buf, "\r\n", 2);
 
+#ifdef HAVE_LIBSSL
      if (wsd_cfg->tls)
           skb_put_strn(buf, "Origin: https://", 16);
      else
+#endif
           skb_put_strn(buf, "Origin: http://", 15);
      skb_put_chunk(buf, req->origin);
      skb_put_strn(buf, "\r\n", 2);
@@ -838,6 +908,12 @@ skb_put_http_req(skb_t *buf, http_req_t *req)
           skb_put_strn(buf, "\r\n", 2);
      }
 
+     if (req->sec_ws_ext.len) {
+          skb_put_strn(buf, PMD_EXT, strlen(PMD_EXT));
+          skb_put_chunk(buf, req->sec_ws_ext);
+          skb_put_strn(buf, "\r\n", 2);
+     }
+
      skb_put_strn(buf, "Pragma: no-cache\r\n", 18);
      skb_put_strn(buf, "Cache-Control: no-cache\r\n", 25);
      skb_put_strn(buf, "Sec-WebSocket-Key: ", 19);
@@ -868,6 +944,7 @@ Write to and read from remote system HOST via websocket protocol.\n\n\
   -j, --json             assume JSON-formatted input\n\
   -R, --repeat-last=N    repeat last input N times\n\
   -N, --no-handshake     do not start or finish a closing handshake\n\
+  -z, --deflate          offer permessage-deflate compression\n\
   -v, --verbose          be verbose (use multiple times for maximum effect)\n\
 "
 #ifdef HAVE_LIBSSL
@@ -886,6 +963,24 @@ Write to and read from remote system HOST via websocket protocol.\n\n\
 int
 wssk_ws_decode_frame(sk_t *sk)
 {
+     /* Rest of large data frame, printed as it arrives */
+     if (sk->rx.remaining) {
+          unsigned long int n = skb_rdsz(sk->recvbuf);
+          if (n > sk->rx.remaining)
+               n = sk->rx.remaining;
+          if (0 == n) {
+               wsd_errno = WSD_EINPUT;
+               return (-1);
+          }
+
+          bool fin = 0x80 & sk->rx.byte1 && n == sk->rx.remaining;
+          if (0 > print_payload(sk, n, fin))
+               return (-1);
+          skb_compact(sk->recvbuf);
+          sk->rx.remaining -= n;
+          return 0;
+     }
+
      if (skb_rdsz(sk->recvbuf) < WS_UNMASKED_FRAME_LEN) {
           wsd_errno = WSD_EINPUT;
           return (-1);
@@ -898,8 +993,15 @@ wssk_ws_decode_frame(sk_t *sk)
      skb_get(sk->recvbuf, wsf.byte1);
      skb_get(sk->recvbuf, wsf.byte2);
 
+     /* RSV1 marks first frame of compressed message; see RFC7692 */
+     bool compressed = RSV1_BIT(wsf.byte1)
+          && sk->pmd
+          && !sk->pmd->rx_msg
+          && (WS_TEXT_FRAME == OPCODE(wsf.byte1)
+              || WS_BINARY_FRAME == OPCODE(wsf.byte1));
+
      /* See section 5.2 RFC6455 */
-     if (RSV1_BIT(wsf.byte1) != 0 ||
+     if ((RSV1_BIT(wsf.byte1) != 0 && !compressed) ||
          RSV2_BIT(wsf.byte1) != 0 ||
          RSV3_BIT(wsf.byte1) != 0 ||
          MASK_BIT(wsf.byte2) != 0) {
@@ -909,7 +1011,7 @@ wssk_ws_decode_frame(sk_t *sk)
      }
 
      wsf.payload_len = ws_decode_payload_len(sk->recvbuf, wsf.byte2);
-     if (0 > wsf.payload_len) {
+     if (ULONG_MAX == wsf.payload_len) {
           skb_rd_reset(sk->recvbuf, old_rdpos);
           return (-1);
      }
@@ -917,8 +1019,19 @@ wssk_ws_decode_frame(sk_t *sk)
      if (LOG_VERBOSE <= wsd_cfg->verbose)
           ws_printf(stderr, &wsf, "RX", sk->hash);
 
+     if (compressed)
+          sk->pmd->rx_msg = true;
+
+     /* Large data frames needn't fit the buffer; print them as they arrive */
+     if (WS_STREAM_CHUNK < wsf.payload_len && !IS_CONTROL(wsf.byte1)) {
+          sk->rx.len = wsf.payload_len;
+          sk->rx.remaining = wsf.payload_len;
+          sk->rx.byte1 = wsf.byte1;
+          return wssk_ws_decode_frame(sk);
+     }
+
      /* Protect against really large frames */
-     if (wsf.payload_len > sizeof(sk->recvbuf->data)) {
+     if (wsf.payload_len > sk->recvbuf->size) {
           skb_rd_reset(sk->recvbuf, old_rdpos);
           wsd_errno = WSD_EBADREQ;
           return (-1);
@@ -937,7 +1050,7 @@ wssk_ws_decode_frame(sk_t *sk)
      case WS_TEXT_FRAME:
      case WS_BINARY_FRAME:
      case WS_FRAG_FRAME:
-          AZ(skb_print(stdout, sk->recvbuf, wsf.payload_len));
+          rv = print_payload(sk, wsf.payload_len, 0x80 & wsf.byte1);
           skb_compact(sk->recvbuf);
           break;
      case WS_CLOSE_FRAME:
@@ -962,6 +1075,44 @@ wssk_ws_decode_frame(sk_t *sk)
      return rv;
 }
 
+/* Prints len bytes of payload at rdpos, inflated iff compressed */
+int
+print_payload(sk_t *sk, unsigned long int len, const bool fin)
+{
+     if (!sk->pmd || !sk->pmd->rx_msg)
+          return skb_print(stdout, sk->recvbuf, len);
+
+     static char out[WS_STREAM_CHUNK];
+     int rv;
+     unsigned long int in, n;
+     do {
+          in = len;
+          n = sizeof(out);
+          rv = pmd_inflate(sk->pmd,
+                           &sk->recvbuf->data[sk->recvbuf->rdpos],
+                           &in,
+                           out,
+                           &n,
+                           fin);
+          if (0 > rv)
+               return (-1);
+
+          sk->recvbuf->rdpos += in;
+          len -= in;
+          fwrite(out, 1, n, stdout);
+     } while (len || sizeof(out) == n || (fin && 1 != rv));
+
+     if (1 == rv)
+          sk->pmd->rx_msg = false;
+
+     if (0 > fflush(stdout)) {
+          wsd_errno = WSD_CHECKERRNO;
+          return (-1);
+     }
+
+     return 0;
+}
+
 void
 wssk_ws_start_closing_handshake()
 {
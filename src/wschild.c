@@ -38,32 +38,65 @@
 #include <sys/socket.h>
 
 #include "common.h"
-#include "hashtable.h"
+#include "sktable.h"
 #include "wschild.h"
 #include "http.h"
 #include "ws_wsd.h"
 #include "ws.h"
+#include "hspool.h"
+#include "pmd.h"
+#include "pp2.h"
+#include "pp2z.h"
 
 #define DEFAULT_TIMEOUT 128
+#define MAX_ACCEPTS     128  /* Connections accepted per listener event */
+#define ACCEPT_RETRY    1000 /* Milliseconds accepting pauses at most    */
 
 extern bool done;
+extern sk_t *pp2sk;
 
-DEFINE_HASHTABLE(sk_hash, 4);
+sktable_t sk_table;                                  /* Table of clients */
+static sk_t *lsk = NULL;                             /* Listening socket */
+static sk_t *hsk = NULL;           /* Handshake pool's eventfd iff workers */
 const wsd_config_t *wsd_cfg = NULL;
 int epfd = -1;
 unsigned int wsd_errno = WSD_CHECKERRNO;
-struct list_head *sk_list = NULL;                    /* List of open sockets */
 
-static struct list_head *work_list = NULL;           /* List of pending work */
+/*
+ * Queue of sockets with pending work. A socket records its position in
+ * work_idx, so queueing and dequeueing only touch its hot cache line.
+ */
+static sk_t **work = NULL;
+static unsigned int work_num = 0, work_size = 0;
+
+/*
+ * Sockets yet to complete the opening handshake, oldest first. Every
+ * one has the same deadline relative to its accept, so expiry only
+ * ever looks at the head. Upgraded sockets are dropped as they reach
+ * the head rather than when upgraded.
+ */
+static struct list_head handshakes;
+
+static volatile sig_atomic_t report = 0;  /* Log statistics iff set */
 
 static void sigterm(int sig);
+static void sigusr1(int sig);
+static void log_ping_rtt();
+static void log_pmd_mem();
+static void log_link();
 static int sk_accept(int lfd);
+static int sk_setup(int fd, const struct sockaddr_in *src_addr);
 static int sk_close(sk_t *sk);
 static int post_read(sk_t *sk);
-static unsigned long int hash(struct sockaddr_in *saddr);
-static void list_init(struct list_head **list);
+static int hs_setup();
+static int hs_read(sk_t *sk);
+static int hs_recv(sk_t *sk);
+static int hs_close(sk_t *sk);
+static void work_del(sk_t *sk);
 static int on_iteration(const struct timespec *now);
 static void check_timeouts_for_each(const struct timespec *now);
+static void check_handshake_deadlines(const struct timespec *now);
+static void check_accept_pause(const struct timespec *now);
 static void check_timeouts(sk_t *sk, const struct timespec *now);
 static void try_recv();
 static int check_closing_handshake_timeout(const sk_t *sk,
@@ -75,25 +108,27 @@ wschild_main(const wsd_config_t *cfg)
 {
      wsd_cfg = cfg;
 
-     list_init(&work_list);
-     list_init(&sk_list);
-     hash_init(sk_hash);
+     AZ(sktable_init(&sk_table, wsd_cfg->max_fds));
+     init_list_head(&handshakes);
+     if (0 > ws_wsd_init(wsd_cfg))
+          return (-1);
 
      struct sigaction sac;
      memset(&sac, 0x0, sizeof(struct sigaction));
      sac.sa_handler = sigterm;
      AZ(sigaction(SIGTERM, &sac, NULL));
+     sac.sa_handler = sigusr1;
+     AZ(sigaction(SIGUSR1, &sac, NULL));
 
      epfd = epoll_create(1);
      A(epfd >= 0);
 
-     sk_t *lsk = malloc(sizeof(sk_t));
+     lsk = sk_alloc();
      if (!lsk) {
           return (-1);
      }
-     memset(lsk, 0, sizeof(sk_t));
 
-     if (0 > sk_init(lsk, wsd_cfg->lfd, 0ULL)) {
+     if (0 > sk_init(lsk, wsd_cfg->lfd, 0ULL, 0)) {
           free(lsk);
           return (-1);
      }
@@ -102,18 +137,33 @@ wschild_main(const wsd_config_t *cfg)
      lsk->ops->accept = sk_accept;
      lsk->ops->close = sk_close;
 
-     AZ(listen(lsk->fd, 4));
+     AZ(listen(lsk->fd, wsd_cfg->backlog));
      AZ(register_for_events(lsk));
 
+     if (wsd_cfg->handshake_workers && 0 > hs_setup())
+          return (-1);
+
      int rv = event_loop(on_iteration, post_read, DEFAULT_TIMEOUT);
 
      int num = 0;
-     sk_t *pos = NULL, *k = NULL;
-     list_for_each_entry_safe(pos, k, sk_list, sk_node) {
+     unsigned int i;
+     sk_t *pos = NULL;
+     sktable_for_each(&sk_table, pos, i) {
           pos->ops->close(pos);
           num++;
      }
+     if (pp2sk) {
+          pp2sk->ops->close(pp2sk);
+          num++;
+     }
      syslog(LOG_INFO, "Closed %d open socket(s)", num);
+     log_ping_rtt();
+     log_pmd_mem();
+     log_link();
+     if (hsk)
+          hsk->ops->close(hsk);
+     pp2_batch_close();
+     free(work);
 
      AZ(close(epfd));
      return rv;
@@ -122,17 +172,68 @@ wschild_main(const wsd_config_t *cfg)
 int
 on_iteration(const struct timespec *now) {
      try_recv();
+     check_handshake_deadlines(now);
      check_timeouts_for_each(now);
+     check_accept_pause(now);
+     if (report) {
+          report = 0;
+          log_ping_rtt();
+          log_pmd_mem();
+          log_link();
+     }
      return 0;
 }
 
 void
 check_timeouts_for_each(const struct timespec *now)
 {
-     sk_t *pos = NULL, *k = NULL;
-     list_for_each_entry_safe(pos, k, sk_list, sk_node) {
+     unsigned int i;
+     sk_t *pos = NULL;
+     sktable_for_each(&sk_table, pos, i) {
           check_timeouts(pos, now);
      }
+
+     if (pp2sk)
+          check_timeouts(pp2sk, now);
+}
+
+/*
+ * Resumes accepting paused for want of descriptors or memory, lest it
+ * stay paused with no socket left to close
+ */
+void
+check_accept_pause(const struct timespec *now)
+{
+     if (!(lsk->events & EPOLLIN)
+         && has_timed_out(&lsk->ts_last_io, now, ACCEPT_RETRY))
+          turn_on_events(lsk, EPOLLIN);
+}
+
+void
+check_handshake_deadlines(const struct timespec *now)
+{
+     sk_t *pos;
+     while ((pos = list_first_entry_or_null(&handshakes, sk_t, handshakes))) {
+          if (http_recv == pos->ops->recv
+              && !has_timed_out(&pos->ts_accept,
+                                now,
+                                wsd_cfg->handshake_timeout))
+               break;
+
+          list_del(&pos->handshakes);
+          list_entry_zero(&pos->handshakes);
+
+          /* Dropping upgraded socket off the list */
+          if (http_recv != pos->ops->recv)
+               continue;
+
+          if (LOG_VERBOSE <= wsd_cfg->verbose)
+               printf("%s: handshake timed out: hash=0x%lx, fd=%d\n",
+                      __func__,
+                      pos->hash,
+                      pos->fd);
+          AZ(pos->ops->close(pos));
+     }
 }
 
 void
@@ -152,6 +253,14 @@ check_timeouts(sk_t *sk, const struct timespec *now)
           }
      }
 
+     /* Closing handshake started by peer; arm timeout for our reply */
+     if (sk->closing
+         && 0 == sk->ts_closing_handshake_start.tv_sec
+         && 0 == sk->ts_closing_handshake_start.tv_nsec) {
+          sk->ts_closing_handshake_start.tv_sec = now->tv_sec;
+          sk->ts_closing_handshake_start.tv_nsec = now->tv_nsec;
+     }
+
      if (check_closing_handshake_timeout(sk,
                                          now,
                                          wsd_cfg->closing_handshake_timeout)) {
@@ -160,6 +269,15 @@ check_timeouts(sk_t *sk, const struct timespec *now)
           return;
      }
 
+     if (sk->pmd && check_timeout(sk, now, wsd_cfg->deflate_idle_timeout))
+          pmd_release(sk->pmd);
+
+     if (sk->rate)
+          ws_refill(sk, now);
+
+     if (sk->owed)
+          ws_credit_back(sk);
+
      if (check_timeout(sk, now, wsd_cfg->ping_interval))
           /* Ignoring return value; don't close socket on a failed ping. */
           sk->proto->ping(sk, false);
@@ -184,13 +302,17 @@ check_closing_handshake_timeout(const sk_t *sk,
 void
 try_recv()
 {
-     sk_t *pos = NULL, *k = NULL;
-     list_for_each_entry_safe(pos, k, work_list, work_node) {
+     unsigned int i, n;
+     for (i = 0; i < work_num; i++) {
+          sk_t *pos = work[i];
+          if (!pos)
+               continue;
+
           int rv = pos->ops->recv(pos);
           if (0 == rv) {
 
                /* All data received and processed */
-               list_del(&pos->work_node);
+               work_del(pos);
 
           } else if (0 > rv && wsd_errno == WSD_EINPUT) {
 
@@ -198,7 +320,7 @@ try_recv()
                 * No enough input; delete from work list.
                 * Next read puts it into work list again.
                 */
-               list_del(&pos->work_node);
+               work_del(pos);
 
           } else if (0 > rv && wsd_errno == WSD_EAGAIN) {
 
@@ -207,12 +329,22 @@ try_recv()
           } else if (0 > rv) {
 
                /* Fatal error. */
-               list_del(&pos->work_node);
+               work_del(pos);
                if (!pos->close_on_write) {
                     AZ(pos->ops->close(pos));
                }
           }
      }
+
+     /* Compact, keeping sockets to try again on next iteration in order */
+     for (i = 0, n = 0; i < work_num; i++) {
+          sk_t *pos = work[i];
+          if (pos) {
+               work[n++] = pos;
+               pos->work_idx = n;
+          }
+     }
+     work_num = n;
 }
 
 int
@@ -229,15 +361,17 @@ sk_close(sk_t *sk)
                  sk->fd);
      }
 
-     hash_del(&sk->hash_node);
-     list_del(&sk->sk_node);
+     /* Lost only if a whole buffer of records waits for the backend */
+     pp2_encode_close(sk);
 
-     sk_t *pos = NULL, *k = NULL;
-     list_for_each_entry_safe(pos, k, work_list, work_node) {
-          if (sk->fd == pos->fd) {
-               list_del(&pos->work_node);
-          }
-     }
+     AZ(sktable_del(&sk_table, sk));
+     work_del(sk);
+     if (list_entry_listed(sk->handshakes))
+          list_del(&sk->handshakes);
+
+     /* Descriptor freed; resume accepting if out of them before */
+     if (!(lsk->events & EPOLLIN))
+          turn_on_events(lsk, EPOLLIN);
 
      AZ(close(sk->fd));
      sk_destroy(sk);
@@ -251,12 +385,120 @@ sk_close(sk_t *sk)
 int
 post_read(sk_t *sk)
 {
-     sk_t *pos = NULL;
-     list_for_each_entry(pos, work_list, work_node) {
-          if (pos->fd == sk->fd)
-               return 0;
+     if (sk->work_idx)
+          return 0;
+
+     if (work_num == work_size) {
+          unsigned int size = work_size ? work_size * 2 : 1024;
+          sk_t **p = realloc(work, size * sizeof(sk_t*));
+          if (!p) {
+               wsd_errno = WSD_ENOMEM;
+               return (-1);
+          }
+          work = p;
+          work_size = size;
      }
-     list_add_tail(&sk->work_node, work_list);
+
+     work[work_num++] = sk;
+     sk->work_idx = work_num;
+     return 0;
+}
+
+void
+work_del(sk_t *sk)
+{
+     if (sk->work_idx) {
+          work[sk->work_idx - 1] = NULL;
+          sk->work_idx = 0;
+     }
+}
+
+/* Starts handshake pool and polls for the responses it computed */
+int
+hs_setup()
+{
+     if (0 > hspool_init(wsd_cfg->handshake_workers))
+          return (-1);
+
+     if (!(hsk = sk_alloc()) || 0 > sk_init(hsk, hspool_fd(), 0ULL, 0)) {
+          if (hsk) {
+               sk_destroy(hsk);
+               free(hsk);
+               hsk = NULL;
+          }
+          hspool_stop();
+          return (-1);
+     }
+
+     hsk->events = EPOLLIN;
+     hsk->ops->read = hs_read;
+     hsk->ops->recv = hs_recv;
+     hsk->ops->close = hs_close;
+     AZ(register_for_events(hsk));
+
+     syslog(LOG_INFO,
+            "Computing handshakes on %u thread(s)",
+            wsd_cfg->handshake_workers);
+     return 0;
+}
+
+int
+hs_read(sk_t *sk)
+{
+     uint64_t n;
+     if (0 > read(sk->fd, &n, sizeof(n)) && EAGAIN != errno) {
+          wsd_errno = WSD_CHECKERRNO;
+          return (-1);
+     }
+
+     return 0;
+}
+
+/* Completes handshakes the pool is done with */
+int
+hs_recv(sk_t *sk __attribute__((unused)))
+{
+     hsjob_t *job = hspool_done();
+     while (job) {
+          hsjob_t *next = job->next;
+
+          /* Socket may have closed meanwhile, e.g. on handshake timeout */
+          sk_t *pos = sktable_get(&sk_table, job->id);
+          if (pos) {
+               if (0 > ws_finish_handshake(pos, job)) {
+                    if (!pos->close_on_write)
+                         AZ(pos->ops->close(pos));
+               } else if (skb_rdsz(pos->recvbuf) && 0 > post_read(pos)) {
+                    /* Frames pipelined behind the request */
+                    AZ(pos->ops->close(pos));
+               }
+          }
+
+          free(job);
+          job = next;
+     }
+
+     return 0;
+}
+
+/* Stops handshake pool; responses not yet sent are dropped */
+int
+hs_close(sk_t *sk)
+{
+     AZ(epoll_ctl(epfd, EPOLL_CTL_DEL, sk->fd, NULL));
+     hspool_stop();
+
+     hsjob_t *job = hspool_done();
+     while (job) {
+          hsjob_t *next = job->next;
+          free(job);
+          job = next;
+     }
+
+     sk_destroy(sk);
+     free(sk);
+     hsk = NULL;
+
      return 0;
 }
 
@@ -266,55 +508,127 @@ sigterm(int sig)
      done = true;
 }
 
+void
+sigusr1(int sig __attribute__((unused)))
+{
+     report = 1;
+}
+
+/* Logs histogram of ping round trips, see ws_ping_rtt */
+void
+log_ping_rtt()
+{
+     unsigned long int num = 0;
+     for (unsigned int i = 0; i < WS_PING_RTT_BUCKETS; i++)
+          num += ws_ping_rtt[i];
+     syslog(LOG_INFO, "Ping round trips: %lu", num);
+
+     for (unsigned int i = 0; i < WS_PING_RTT_BUCKETS; i++) {
+          if (!ws_ping_rtt[i])
+               continue;
+          if (WS_PING_RTT_BUCKETS - 1 == i)
+               syslog(LOG_INFO,
+                      "  >= %lu us: %lu",
+                      1UL << i,
+                      ws_ping_rtt[i]);
+          else
+               syslog(LOG_INFO,
+                      "  < %lu us: %lu",
+                      1UL << (i + 1),
+                      ws_ping_rtt[i]);
+     }
+}
+
+/*
+ * Accepts pending connections until none are left or MAX_ACCEPTS were
+ * accepted; epoll reports the listener again if more are waiting. Never
+ * fails: a connection that cannot be set up is closed, and running out
+ * of descriptors or memory pauses accepting until a socket closes, or
+ * for ACCEPT_RETRY milliseconds at most.
+ */
 int
 sk_accept(int lfd)
 {
-     sk_t *sk = malloc(sizeof(sk_t));
-     if (!sk) {
-          wsd_errno = WSD_CHECKERRNO;
-          return (-1);
+     int n;
+     for (n = 0; n < MAX_ACCEPTS; n++) {
+          struct sockaddr_in src_addr;
+          socklen_t saddr_len = sizeof(src_addr);
+          int fd = accept4(lfd,
+                           (struct sockaddr *)&src_addr,
+                           &saddr_len,
+                           SOCK_NONBLOCK);
+          if (0 > fd) {
+               if (EAGAIN == errno || EWOULDBLOCK == errno)
+                    break;
+
+               if (EMFILE == errno
+                   || ENFILE == errno
+                   || ENOBUFS == errno
+                   || ENOMEM == errno) {
+                    syslog(LOG_WARNING, "Pausing accept: %m");
+                    turn_off_events(lsk, EPOLLIN);
+                    AZ(clock_gettime(CLOCK_MONOTONIC, &lsk->ts_last_io));
+                    break;
+               }
+
+               /* Aborted connection or pending network error, accept(2) */
+               continue;
+          }
+
+          if (0 > sk_setup(fd, &src_addr))
+               AZ(close(fd));
      }
-     memset(sk, 0, sizeof(sk_t));
-
-     socklen_t saddr_len = sizeof(sk->src_addr);
-     int fd = accept4(lfd,
-                      (struct sockaddr *)&sk->src_addr,
-                      &saddr_len,
-                      SOCK_NONBLOCK);
-     if (0 > fd) {
-          free(sk);
+
+     return 0;
+}
+
+int
+sk_setup(int fd, const struct sockaddr_in *src_addr)
+{
+     struct sockaddr_in dst_addr;
+     socklen_t saddr_len = sizeof(dst_addr);
+     if (0 > getsockname(fd, (struct sockaddr *)&dst_addr, &saddr_len)) {
           wsd_errno = WSD_CHECKERRNO;
           return (-1);
      }
 
-     saddr_len = sizeof(sk->dst_addr);
-     if (0 > getsockname(fd, (struct sockaddr *)&sk->dst_addr, &saddr_len)) {
-          AZ(close(fd));
-          free(sk);
-          wsd_errno = WSD_CHECKERRNO;
+     sk_t *sk = sk_alloc();
+     if (!sk) {
           return (-1);
      }
 
-     if (0 > sk_init(sk, fd, hash(&sk->src_addr))) {
-          AZ(close(fd));
+     if (0 > sk_init(sk, fd, 0ULL, SKB_HANDSHAKE_SIZE)) {
+          sk_destroy(sk);
           free(sk);
-          wsd_errno = WSD_CHECKERRNO;
           return (-1);
      }
 
+     sk->addr.src_addr = src_addr->sin_addr.s_addr;
+     sk->addr.dst_addr = dst_addr.sin_addr.s_addr;
+     sk->addr.src_port = src_addr->sin_port;
+     sk->addr.dst_port = dst_addr.sin_port;
      sk->ops->recv = http_recv;
      sk->ops->close = sk_close;
-     sk->proto->decode_handshake = ws_decode_handshake;
+     sk->proto->decode_handshake = wsd_cfg->handshake_workers
+          ? ws_decode_handshake_async
+          : ws_decode_handshake;
+
+     if (0 > sktable_add(&sk_table, sk)) {
+          sk_destroy(sk);
+          free(sk);
+          return (-1);
+     }
 
      if (0 > register_for_events(sk)) {
-          AZ(close(fd));
+          AZ(sktable_del(&sk_table, sk));
+          sk_destroy(sk);
           free(sk);
           wsd_errno = WSD_CHECKERRNO;
           return (-1);
      }
 
-     hash_add(sk_hash, &sk->hash_node, sk->hash);
-     list_add_tail(&sk->sk_node, sk_list);
+     AZ(clock_gettime(CLOCK_MONOTONIC, &sk->ts_accept));
+     list_add_tail(&sk->handshakes, &handshakes);
 
      if (LOG_VVVERBOSE <= wsd_cfg->verbose) {
           printf("%s:%d: %s: hash=0x%lx, rdsz=%d, wrsz=%d\n",
@@ -329,25 +643,32 @@ sk_accept(int lfd)
      return 0;
 }
 
-unsigned long int
-hash(struct sockaddr_in *saddr) {
-     struct timespec ts;
-     memset((void*)&ts, 0, sizeof(ts));
-     AZ(clock_gettime(CLOCK_REALTIME_COARSE, &ts));
-
-     unsigned long int h = saddr->sin_addr.s_addr;
-     h <<= 16;
-     h |= saddr->sin_port;
-     h <<= 16;
-     h |= ((ts.tv_nsec &0x00000000ffff0000 >> 16));
-     return h;
+void
+log_pmd_mem()
+{
+     if (!wsd_cfg->deflate_level)
+          return;
+
+     unsigned int num;
+     unsigned long int mem = pmd_mem(&num);
+     syslog(LOG_INFO,
+            "Compression: %lu KiB for %u connection(s), %lu byte(s) each",
+            mem >> 10,
+            num,
+            num ? mem / num : 0);
 }
 
 void
-list_init(struct list_head **list)
+log_link()
 {
-     *list = malloc(sizeof(struct list_head));
-     AN(list);
-     memset(*list, 0, sizeof(struct list_head));
-     init_list_head(*list);
+     if (!wsd_cfg->link_level)
+          return;
+
+     const pp2z_stats_t *st = pp2z_stats();
+     syslog(LOG_INFO,
+            "Backend link: sent %lu KiB as %lu KiB, received %lu KiB as %lu KiB",
+            st->plain_tx >> 10,
+            st->wire_tx >> 10,
+            st->plain_rx >> 10,
+            st->wire_rx >> 10);
 }
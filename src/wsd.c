@@ -21,6 +21,7 @@
 #include "config.h"
 
 #include <stdlib.h>
+#include <limits.h>
 #include <syslog.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -32,21 +33,28 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include "wschild.h"
 #include "common.h"
+#include "pmd.h"
 
 #define DEFAULT_CLOSING_HANDSHAKE_TIMEOUT 8000   /* 8 seconds  */
 #define DEFAULT_IDLE_TIMEOUT              -1     /* disabled   */
+#define DEFAULT_HANDSHAKE_TIMEOUT         10000  /* 10 seconds */
 #define DEFAULT_FORWARD_PORT              "6085"
 #define DEFAULT_FORWARD_HOST              "127.0.0.1"
 #define DEFAULT_LISTENING_PORT            6084
 #define DEFAULT_MAX_HOSTNAMES             16
+#define DEFAULT_BACKLOG                   SOMAXCONN
+#define DEFER_ACCEPT_TIMEOUT              8      /* seconds    */
 
 static const char *ident = "wsd";
 static int drop_priv(uid_t new_uid);
 static int listen_sk_bind(const int port);
+static unsigned int raise_nofile_limit();
 static void print_help();
 
 int
@@ -59,6 +67,18 @@ main(int argc, char **argv)
      int i_arg = DEFAULT_IDLE_TIMEOUT;
      int v_arg = 0;
      int n_arg = -1;
+     int b_arg = DEFAULT_BACKLOG;
+     int t_arg = DEFAULT_HANDSHAKE_TIMEOUT;
+     int w_arg = 0;
+     long m_arg = 0;
+     int z_arg = 0;
+     int Z_arg = PMD_FULL;
+     int r_arg = -1;
+     int c_arg = 0;
+     int B_arg = 0;
+     bool s_arg = false;
+     bool l_arg = false;
+     long W_arg = 0;
      const char *f_arg = DEFAULT_FORWARD_PORT;
      const char *u_arg = NULL;
      const char *p_arg = NULL;
@@ -67,7 +87,7 @@ main(int argc, char **argv)
      char **h_arg = calloc(sizeof *h_arg, DEFAULT_MAX_HOSTNAMES);
      A(h_arg);
 
-     while ((opt = getopt(argc, argv, "h:p:P:o:f:u:i:n:dv?")) != -1) {
+     while ((opt = getopt(argc, argv, "h:p:P:o:f:u:i:n:b:t:w:m:z:Z:r:c:B:slW:dv?")) != -1) {
           switch (opt) {
           case 'h':
                if (h_arg_num >= DEFAULT_MAX_HOSTNAMES) {
@@ -94,6 +114,54 @@ main(int argc, char **argv)
           case 'n':
                n_arg = atoi(optarg);
                break;
+          case 'b':
+               b_arg = atoi(optarg);
+               break;
+          case 't':
+               t_arg = atoi(optarg);
+               break;
+          case 'w':
+               w_arg = atoi(optarg);
+               break;
+          case 'm':
+               m_arg = atol(optarg);
+               break;
+          case 'z':
+               z_arg = atoi(optarg);
+               break;
+          case 'Z':
+               if (0 == strcmp(optarg, "full")) {
+                    Z_arg = PMD_FULL;
+               } else if (0 == strcmp(optarg, "lean")) {
+                    Z_arg = PMD_LEAN;
+               } else if (0 == strcmp(optarg, "shared")) {
+                    Z_arg = PMD_SHARED;
+               } else {
+                    fprintf(stderr,
+                            "%s: bad compression memory mode: %s\n",
+                            argv[0],
+                            optarg);
+                    exit(EXIT_FAILURE);
+               }
+               break;
+          case 'r':
+               r_arg = atoi(optarg);
+               break;
+          case 'c':
+               c_arg = atoi(optarg);
+               break;
+          case 'B':
+               B_arg = atoi(optarg);
+               break;
+          case 's':
+               s_arg = true;
+               break;
+          case 'l':
+               l_arg = true;
+               break;
+          case 'W':
+               W_arg = atol(optarg);
+               break;
           case 'f':
                f_arg = optarg;
                break;
@@ -128,6 +196,36 @@ main(int argc, char **argv)
      if (0 > i_arg)
           i_arg = DEFAULT_IDLE_TIMEOUT;
 
+     if (0 >= b_arg)
+          b_arg = DEFAULT_BACKLOG;
+
+     if (0 >= t_arg)
+          t_arg = DEFAULT_HANDSHAKE_TIMEOUT;
+
+     if (0 > w_arg)
+          w_arg = 0;
+
+     if (0 > z_arg || 9 < z_arg) {
+          fprintf(stderr, "%s: bad compression level: %d\n", argv[0], z_arg);
+          exit(EXIT_FAILURE);
+     }
+
+     if (0 > c_arg || 9 < c_arg) {
+          fprintf(stderr, "%s: bad compression level: %d\n", argv[0], c_arg);
+          exit(EXIT_FAILURE);
+     }
+
+     if (0 > B_arg || 999999 < B_arg) {
+          fprintf(stderr, "%s: bad batch deadline: %d\n", argv[0], B_arg);
+          exit(EXIT_FAILURE);
+     }
+
+     /* Twice the window must fit a send buffer; see ws_credit_back() */
+     if (0 > W_arg || SKB_SIZE / 2 < W_arg) {
+          fprintf(stderr, "%s: bad window: %ld\n", argv[0], W_arg);
+          exit(EXIT_FAILURE);
+     }
+
      struct passwd *pwent;
      if (NULL == (pwent = getpwnam(u_arg))) {
           fprintf(stderr, "%s: unknown user: %s\n", argv[0], u_arg);
@@ -158,6 +256,7 @@ main(int argc, char **argv)
      memset(&cfg, 0x0, sizeof(wsd_config_t));
      cfg.uid = pwent->pw_uid;
      cfg.lport = o_arg;
+     cfg.backlog = b_arg;
      cfg.fport = strdup(f_arg);
      cfg.fhostname = h_arg;
      cfg.fhostname_num = h_arg_num;
@@ -168,6 +267,17 @@ main(int argc, char **argv)
      cfg.idle_timeout = i_arg;
      cfg.ping_interval = n_arg * 1000; /* convert sec to ms */
      cfg.closing_handshake_timeout = DEFAULT_CLOSING_HANDSHAKE_TIMEOUT;
+     cfg.handshake_timeout = t_arg;
+     cfg.handshake_workers = w_arg;
+     cfg.max_frame_len = 0 < m_arg ? m_arg : 0;
+     cfg.deflate_level = z_arg;
+     cfg.deflate_mode = Z_arg;
+     cfg.deflate_idle_timeout = 0 < r_arg ? r_arg : -1;
+     cfg.link_level = c_arg;
+     cfg.batch_usec = B_arg;
+     cfg.compact_link = s_arg;
+     cfg.lifecycle = l_arg;
+     cfg.window = W_arg;
 
      pid_t pid = 0;
      if (!cfg.no_fork) {
@@ -217,6 +327,8 @@ main(int argc, char **argv)
                exit(EXIT_FAILURE);
           }
 
+          cfg.max_fds = raise_nofile_limit();
+
           if (0 == getuid()) {
                if (0 > drop_priv(cfg.uid)) {
                     AZ(close(cfg.lfd));
@@ -251,6 +363,27 @@ drop_priv(uid_t new_uid)
      return 0;
 }
 
+/* Raises soft limit of open files to hard limit; returns resulting limit */
+unsigned int
+raise_nofile_limit()
+{
+     struct rlimit rl;
+     ERREXIT(0 > getrlimit(RLIMIT_NOFILE, &rl), "getrlimit");
+
+     if (rl.rlim_cur < rl.rlim_max) {
+          rlim_t cur = rl.rlim_cur;
+          rl.rlim_cur = rl.rlim_max;
+          if (0 > setrlimit(RLIMIT_NOFILE, &rl)) {
+               syslog(LOG_WARNING, "Cannot raise open file limit: %m");
+               rl.rlim_cur = cur;
+          }
+     }
+
+     syslog(LOG_INFO, "Open file limit: %lu", (unsigned long)rl.rlim_cur);
+
+     return rl.rlim_cur > UINT_MAX ? UINT_MAX : (unsigned int)rl.rlim_cur;
+}
+
 int
 listen_sk_bind(const int port)
 {
@@ -277,6 +410,12 @@ listen_sk_bind(const int port)
      addr.sin_port = htons(port);
      AZ(bind(s, (struct sockaddr *)&addr, sizeof(struct sockaddr_in)));
 
+#ifdef TCP_DEFER_ACCEPT
+     /* Wake up for a connection once its upgrade request has arrived */
+     opt = DEFER_ACCEPT_TIMEOUT;
+     AZ(setsockopt(s, IPPROTO_TCP, TCP_DEFER_ACCEPT, &opt, sizeof(int)));
+#endif
+
      return s;
 }
 
@@ -295,6 +434,18 @@ Terminate websockets and multiplex their frames to some backend.\n\n\
   -d  do not fork and stay attached to terminal\n\
   -i  idle read/write timeout in milliseconds, disabled by default\n\
   -n  ping interval in seconds, defaults to none\n\
+  -b  backlog of pending connections, defaults to SOMAXCONN\n\
+  -t  opening handshake timeout in milliseconds, defaults to 10000\n\
+  -w  threads computing handshake responses, defaults to none (inline)\n\
+  -m  maximum payload of frames sent to clients in bytes, defaults to none\n\
+  -z  accept permessage-deflate at compression level 1 to 9, disabled by default\n\
+  -Z  memory mode of permessage-deflate: full, lean or shared, defaults to full\n\
+  -r  release compression state idle this many milliseconds, disabled by default\n\
+  -c  deflate link to backend at level 1 to 9 if it agrees, disabled by default\n\
+  -B  batch records to backend for up to this many microseconds, disabled by default\n\
+  -s  offer backend compact records after the first of each connection\n\
+  -l  tell backend when websockets open and close\n\
+  -W  flow control with this many bytes of credit per websocket, disabled by default\n\
   -v  be verbose (use multiple times for maximum effect)\n\
   -?  display this help and exit\n\n\
 ", stdout);
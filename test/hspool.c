@@ -0,0 +1,132 @@
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <assert.h>
+#include "hspool.h"
+#include "sktable.h"
+#include "ws.h"
+#include "ws_wsd.h"
+
+#define NUM_JOBS 20000
+
+sktable_t sk_table;
+const wsd_config_t *wsd_cfg = NULL;
+int epfd = -1;
+unsigned int wsd_errno = WSD_CHECKERRNO;
+
+static void
+count(hsjob_t *job)
+{
+     job->rv = (int)job->id;
+}
+
+static void
+respond(hsjob_t *job)
+{
+     job->rv = ws_handshake_response(job->resp.p,
+                                     &job->key,
+                                     &job->proto,
+                                     &job->ext);
+}
+
+/* Takes finished jobs until num are done, as the event loop would */
+static void
+collect(hsjob_t **jobs, unsigned int num)
+{
+     struct pollfd pfd = { hspool_fd(), POLLIN, 0 };
+     unsigned int n = 0;
+     while (n < num) {
+          assert(0 < poll(&pfd, 1, 10000));
+          uint64_t ev;
+          assert(sizeof(ev) == read(pfd.fd, &ev, sizeof(ev)));
+
+          hsjob_t *job;
+          for (job = hspool_done(); job; job = job->next, n++)
+               jobs[n] = job;
+     }
+     assert(NULL == hspool_done());
+}
+
+static void
+GIVEN_jobs_WHEN_submitted_round_robin_THEN_each_done_once()
+{
+     static hsjob_t *jobs[NUM_JOBS];
+     static char seen[NUM_JOBS];
+     chunk_t empty = { NULL, 0 };
+
+     assert(0 == hspool_init(3));
+     for (unsigned int i = 0; i < NUM_JOBS; i++) {
+          hsjob_t *job = hsjob_alloc(i, &empty, &empty, &empty, NULL, 0);
+          assert(job);
+          job->work = count;
+          if (0 == hspool_submit(job))
+               continue;
+
+          /* Deque full; as the event loop, handle it here */
+          assert(WSD_EAGAIN == wsd_errno);
+          count(job);
+          assert(i == job->rv);
+          free(job);
+          seen[i] = 1;
+     }
+
+     unsigned int inline_num = 0;
+     for (unsigned int i = 0; i < NUM_JOBS; i++)
+          inline_num += seen[i];
+     collect(jobs, NUM_JOBS - inline_num);
+
+     for (unsigned int i = 0; i < NUM_JOBS - inline_num; i++) {
+          assert(jobs[i]->id == (uint64_t)jobs[i]->rv);
+          assert(!seen[jobs[i]->id]);
+          seen[jobs[i]->id] = 1;
+          free(jobs[i]);
+     }
+     for (unsigned int i = 0; i < NUM_JOBS; i++)
+          assert(seen[i]);
+
+     hspool_stop();
+}
+
+static void
+GIVEN_upgrade_request_WHEN_done_by_worker_THEN_101_as_inline()
+{
+     chunk_t key = { "dGhlIHNhbXBsZSBub25jZQ==", 24 };
+     chunk_t proto = { "chat", 4 };
+     chunk_t ext = { NULL, 0 };
+     hsjob_t *job = hsjob_alloc(SKTABLE_ID(7, 1),
+                                &key,
+                                &proto,
+                                &ext,
+                                NULL,
+                                ws_handshake_len(&proto, &ext));
+     assert(job);
+     job->work = respond;
+
+     char expected[512];
+     memset(expected, 0, sizeof(expected));
+     unsigned int len = ws_handshake_len(&proto, &ext);
+     assert(sizeof(expected) > len);
+     assert(0 == ws_handshake_response(expected, &key, &proto, &ext));
+
+     assert(0 == hspool_init(1));
+     assert(0 == hspool_submit(job));
+     collect(&job, 1);
+     hspool_stop();
+
+     assert(SKTABLE_ID(7, 1) == job->id);
+     assert(0 == job->rv);
+     assert(len == job->resp.len);
+     assert(0 == memcmp(expected, job->resp.p, len));
+     assert(0 == strncmp("HTTP/1.1 101", job->resp.p, 12));
+     assert(strstr(expected, "s3pPLMBiTxaQ9kYGzzhZRbK+xOo=\r\n"));
+     assert(strstr(expected, "Sec-WebSocket-Protocol: chat\r\n\r\n"));
+     free(job);
+}
+
+int
+main()
+{
+     GIVEN_jobs_WHEN_submitted_round_robin_THEN_each_done_once();
+     GIVEN_upgrade_request_WHEN_done_by_worker_THEN_101_as_inline();
+     return 0;
+}
@@ -77,6 +77,166 @@ GIVEN_request_WHEN_parsing_THEN_recognised() {
      }
 }
 
+static void
+GIVEN_request_dribbled_WHEN_parsing_incrementally_THEN_same_fields()
+{
+     int fd;
+     for (int i = 0; i < NUM_SAMPLES; i++) {
+          assert(0 < (fd = open(samples[i], O_RDONLY)));
+
+          char buf[8192];
+          memset(buf, 0, sizeof(buf));
+          int n = read(fd, buf, 8191);
+          assert(0 < n);
+
+          /* Fields as parsed from the whole request */
+          chunk_t t;
+          http_req_t req;
+          memset(&req, 0, sizeof(http_req_t));
+          assert(0 < http_header_tok(buf, &t));
+          assert(0 == parse_request_line(&t, &req));
+          while (0 < http_header_tok(NULL, &t))
+               assert(0 <= parse_header_field(&t, &req));
+
+          /* One byte at a time */
+          http_parser_t hp;
+          memset(&hp, 0, sizeof(http_parser_t));
+          for (int len = 1; len < n; len++) {
+               assert(0 > http_parse(&hp, buf, len));
+               assert(WSD_EINPUT == wsd_errno);
+          }
+          assert(n == http_parse(&hp, buf, n));
+          assert(0 == memcmp(&req, &hp.req, sizeof(http_req_t)));
+
+          close(fd);
+     }
+}
+
+static void
+GIVEN_malformed_request_WHEN_parsing_incrementally_THEN_rejected()
+{
+     char *inputs[] = {
+          "GET / HTTP/1.1\r\nHost: a\r\nNo colon\r\n\r\n",
+          "GET / HTTP/1.1\r\nHost: a\rb\r\n\r\n",
+          "GET / HTTP/1.1\r\nHo\"st: a\r\n\r\n",
+          "GET / HTTP/1.0\r\nHost: a\r\n\r\n"
+     };
+
+     for (int i = 0; i < sizeof(inputs) / sizeof(inputs[0]); i++) {
+          http_parser_t hp;
+          memset(&hp, 0, sizeof(http_parser_t));
+          assert(0 > http_parse(&hp, inputs[i], strlen(inputs[i])));
+          assert(WSD_EINPUT != wsd_errno);
+     }
+}
+
+static void
+GIVEN_simd_span_WHEN_scanning_THEN_same_as_scalar()
+{
+     unsigned int classes[] = {
+          HTTP_START_LINE, HTTP_HEADER_FIELD, HTTP_FIELD_VALUE
+     };
+
+     /* Every byte value, each one at every position within a vector */
+     char all[256 + 64];
+     for (int i = 0; i < sizeof(all); i++)
+          all[i] = (char)i;
+
+     for (unsigned int impl = HTTP_SPAN_SSE42; impl <= HTTP_SPAN_AVX2; impl++) {
+          if (0 > http_span_select(impl))
+               continue;
+
+          for (int i = 0; i < NUM_SAMPLES + 1; i++) {
+               char buf[8192];
+               int n = sizeof(all);
+               if (NUM_SAMPLES > i) {
+                    int fd;
+                    assert(0 < (fd = open(samples[i], O_RDONLY)));
+                    assert(0 < (n = read(fd, buf, sizeof(buf))));
+                    close(fd);
+               } else {
+                    memcpy(buf, all, n);
+               }
+
+               for (int j = 0; j < 3; j++) {
+                    for (int k = 0; k < n; k++) {
+                         unsigned int simd;
+                         simd = http_span(&buf[k], n - k, classes[j]);
+                         assert(0 == http_span_select(HTTP_SPAN_SCALAR));
+                         assert(simd == http_span(&buf[k], n - k, classes[j]));
+                         assert(0 == http_span_select(impl));
+                    }
+               }
+          }
+
+          /* Whole requests parse the same */
+          GIVEN_request_dribbled_WHEN_parsing_incrementally_THEN_same_fields();
+          GIVEN_malformed_request_WHEN_parsing_incrementally_THEN_rejected();
+     }
+
+     assert(0 == http_span_select(HTTP_SPAN_SCALAR));
+     GIVEN_request_dribbled_WHEN_parsing_incrementally_THEN_same_fields();
+     GIVEN_malformed_request_WHEN_parsing_incrementally_THEN_rejected();
+}
+
+static void
+GIVEN_header_field_WHEN_dispatching_THEN_exact_name_assigned()
+{
+     char *fields[] = {
+          "host: a",
+          "Hostname: b",
+          "SEC-WEBSOCKET-KEY: c",
+          "Sec-WebSocket-Keys: d",
+          "Connection: e",
+          "connection: f",
+          "User-Agentx: g",
+          "Accept-Language: h"
+     };
+     int expected[] = { 1, 0, 1, 0, 1, 1, 0, 0 };
+
+     http_req_t req;
+     memset(&req, 0, sizeof(http_req_t));
+     for (int i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+          chunk_t tok;
+          tok.p = fields[i];
+          tok.len = strlen(fields[i]);
+          assert(expected[i] == parse_header_field(&tok, &req));
+     }
+
+     assert(0 == strncmp(" a", req.host.p, req.host.len));
+     assert(0 == strncmp(" c", req.sec_ws_key.p, req.sec_ws_key.len));
+     assert(0 == strncmp(" e", req.conn.p, req.conn.len));
+     assert(0 == strncmp(" f", req.conn2.p, req.conn2.len));
+     assert(0 == req.user_agent.len);
+
+     /* Every field of interest has a slot of its own */
+     char *names[] = {
+          "Upgrade: i", "Sec-WebSocket-Version: j",
+          "Sec-WebSocket-Protocol: k", "Sec-WebSocket-Extensions: l",
+          "Origin: m", "User-Agent: n"
+     };
+     for (int i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+          chunk_t tok;
+          tok.p = names[i];
+          tok.len = strlen(names[i]);
+          assert(1 == parse_header_field(&tok, &req));
+     }
+     assert(0 == strncmp(" i", req.upgrade.p, req.upgrade.len));
+     assert(0 == strncmp(" j", req.sec_ws_ver.p, req.sec_ws_ver.len));
+     assert(0 == strncmp(" k", req.sec_ws_proto.p, req.sec_ws_proto.len));
+     assert(0 == strncmp(" l", req.sec_ws_ext.p, req.sec_ws_ext.len));
+     assert(0 == strncmp(" m", req.origin.p, req.origin.len));
+     assert(0 == strncmp(" n", req.user_agent.p, req.user_agent.len));
+     assert(0 == strncmp(" a", req.host.p, req.host.len));
+
+     /* Colon is searched for within the field only */
+     chunk_t tok;
+     tok.p = "Host: a";
+     tok.len = 4;
+     assert(0 > parse_header_field(&tok, &req));
+     assert(WSD_ECHAR == wsd_errno);
+}
+
 static void
 GIVEN_field_value_WHEN_parsing_THEN_recognised()
 {
@@ -133,6 +293,10 @@ GIVEN_field_value_WHEN_parsing_THEN_recognised()
 int
 main() {
      GIVEN_request_WHEN_parsing_THEN_recognised();
+     GIVEN_request_dribbled_WHEN_parsing_incrementally_THEN_same_fields();
+     GIVEN_malformed_request_WHEN_parsing_incrementally_THEN_rejected();
+     GIVEN_simd_span_WHEN_scanning_THEN_same_as_scalar();
+     GIVEN_header_field_WHEN_dispatching_THEN_exact_name_assigned();
      GIVEN_field_value_WHEN_parsing_THEN_recognised();
      return 0;
 }
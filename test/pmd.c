@@ -0,0 +1,327 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "common.h"
+#include "sktable.h"
+#include "pmd.h"
+
+#define MSG_LEN 4096
+
+sktable_t sk_table;
+const wsd_config_t *wsd_cfg = NULL;
+int epfd = -1;
+unsigned int wsd_errno = WSD_CHECKERRNO;
+
+static int
+negotiate(const char *offers, pmd_params_t *params)
+{
+     chunk_t ext = { (char*)offers, strlen(offers) };
+     return pmd_negotiate(&ext, true, params);
+}
+
+/* Inflates msg in pieces of at most piece bytes, into as little room */
+static void
+inflate_msg(pmd_t *pmd,
+            const char *msg,
+            unsigned long int len,
+            unsigned int piece,
+            char *dst,
+            unsigned long int *dst_len)
+{
+     unsigned long int pos = 0, out = 0;
+     int rv;
+     do {
+          unsigned long int in = len - pos < piece ? len - pos : piece;
+          unsigned long int n = piece;
+          bool fin = pos + in == len;
+          rv = pmd_inflate(pmd, &msg[pos], &in, &dst[out], &n, fin);
+          assert(0 <= rv);
+          pos += in;
+          out += n;
+     } while (1 != rv);
+
+     assert(len == pos);
+     *dst_len = out;
+}
+
+static void
+GIVEN_offers_WHEN_negotiated_THEN_first_acceptable_agreed_on()
+{
+     pmd_params_t params;
+     assert(0 == negotiate("permessage-deflate", &params));
+     assert(!params.server_no_context_takeover);
+     assert(0 == params.server_max_window_bits);
+
+     assert(0 == negotiate(" x-webkit-deflate-frame, permessage-deflate ;"
+                           " server_no_context_takeover ;"
+                           " server_max_window_bits=\"10\";"
+                           " client_max_window_bits",
+                           &params));
+     assert(params.server_no_context_takeover);
+     assert(10 == params.server_max_window_bits);
+     assert(0 == params.client_max_window_bits);
+
+     char line[PMD_MAX_RESPONSE_LEN];
+     unsigned int len = pmd_response(line, &params);
+     assert(len == strlen(line));
+     assert(0 == strcmp(PMD_EXT "permessage-deflate;"
+                        " server_no_context_takeover;"
+                        " server_max_window_bits=10\r\n",
+                        line));
+
+     /* zlib can't deflate with a window of 256 bytes; take next offer */
+     assert(0 == negotiate("permessage-deflate; server_max_window_bits=8,"
+                           "permessage-deflate; client_no_context_takeover",
+                           &params));
+     assert(0 == params.server_max_window_bits);
+     assert(params.client_no_context_takeover);
+}
+
+static void
+GIVEN_bad_offers_WHEN_negotiated_THEN_declined()
+{
+     pmd_params_t params;
+     assert(0 > negotiate("", &params));
+     assert(0 > negotiate("x-webkit-deflate-frame", &params));
+     assert(0 > negotiate("permessage-deflate; foo", &params));
+     assert(0 > negotiate("permessage-deflate=1", &params));
+     assert(0 > negotiate("permessage-deflate; server_max_window_bits", &params));
+     assert(0 > negotiate("permessage-deflate; server_max_window_bits=16", &params));
+     assert(0 > negotiate("permessage-deflate; server_max_window_bits=09", &params));
+     assert(0 > negotiate("permessage-deflate; client_max_window_bits=7", &params));
+     assert(0 > negotiate("permessage-deflate;"
+                          " server_no_context_takeover;"
+                          " server_no_context_takeover",
+                          &params));
+     assert(0 > negotiate("permessage-deflate;"
+                          " server_no_context_takeover=1",
+                          &params));
+}
+
+static void
+GIVEN_messages_WHEN_deflated_THEN_inflated_by_peer_alike()
+{
+     char msg[MSG_LEN], deflated[2 * MSG_LEN], inflated[MSG_LEN];
+     for (unsigned int i = 0; i < MSG_LEN; i++)
+          msg[i] = "{\"id\":42,\"tick\":[1,2,3]}"[i % 24];
+
+     /* Both with the LZ77 window carried over and without */
+     for (unsigned int nct = 0; nct < 2; nct++) {
+          pmd_params_t params;
+          memset(&params, 0, sizeof(params));
+          params.server_no_context_takeover = nct;
+          pmd_t *server = pmd_alloc(&params, true);
+          pmd_t *client = pmd_alloc(&params, false);
+          assert(server && client);
+
+          long first = 0;
+          for (unsigned int i = 0; i < 3; i++) {
+               assert(sizeof(deflated) >= pmd_deflate_bound(server, MSG_LEN));
+               long n = pmd_deflate(server,
+                                    msg,
+                                    MSG_LEN,
+                                    deflated,
+                                    sizeof(deflated),
+                                    true);
+               assert(0 < n && MSG_LEN / 10 > n);
+
+               /* Later messages refer back to the first iff allowed */
+               if (i)
+                    assert(nct ? n == first : n < first);
+               else
+                    first = n;
+
+               unsigned long int len = 0;
+               inflate_msg(client, deflated, n, 7, inflated, &len);
+               assert(MSG_LEN == len);
+               assert(0 == memcmp(msg, inflated, MSG_LEN));
+
+               /* Without context takeover, each message stands alone */
+               if (nct) {
+                    pmd_t *fresh = pmd_alloc(&params, false);
+                    assert(fresh);
+                    inflate_msg(fresh, deflated, n, 1, inflated, &len);
+                    assert(MSG_LEN == len);
+                    assert(0 == memcmp(msg, inflated, MSG_LEN));
+                    pmd_free(fresh);
+               }
+          }
+
+          /* Empty message, a single empty stored block; section 7.2.3.6 */
+          long n = pmd_deflate(server, msg, 0, deflated, sizeof(deflated), true);
+          assert(1 == n && 0x00 == deflated[0]);
+          unsigned long int len = sizeof(inflated);
+          inflate_msg(client, deflated, n, 16, inflated, &len);
+          assert(0 == len);
+
+          pmd_free(server);
+          pmd_free(client);
+     }
+}
+
+static void
+GIVEN_memory_mode_WHEN_negotiated_THEN_parameters_narrowed()
+{
+     pmd_params_t params;
+     char line[PMD_MAX_RESPONSE_LEN];
+
+     pmd_init(Z_DEFAULT_COMPRESSION, PMD_LEAN);
+     assert(0 == negotiate("permessage-deflate; client_max_window_bits",
+                           &params));
+     assert(PMD_LEAN_WINDOW_BITS == params.server_max_window_bits);
+     assert(PMD_LEAN_WINDOW_BITS == params.client_max_window_bits);
+     pmd_response(line, &params);
+     assert(0 == strcmp(PMD_EXT "permessage-deflate;"
+                        " server_max_window_bits=10;"
+                        " client_max_window_bits=10\r\n",
+                        line));
+
+     /* Client's window can't be narrowed unless it says it can be */
+     assert(0 == negotiate("permessage-deflate; server_max_window_bits=9",
+                           &params));
+     assert(9 == params.server_max_window_bits);
+     assert(0 == params.client_max_window_bits);
+
+     pmd_init(Z_DEFAULT_COMPRESSION, PMD_SHARED);
+     assert(0 == negotiate("permessage-deflate; client_max_window_bits=12",
+                           &params));
+     pmd_response(line, &params);
+     assert(0 == strcmp(PMD_EXT "permessage-deflate;"
+                        " server_no_context_takeover;"
+                        " client_no_context_takeover\r\n",
+                        line));
+
+     pmd_init(Z_DEFAULT_COMPRESSION, PMD_FULL);
+}
+
+static void
+GIVEN_shared_mode_WHEN_records_interleave_THEN_each_inflated_alike()
+{
+     char msg[MSG_LEN], deflated[2][2 * MSG_LEN], inflated[MSG_LEN];
+     for (unsigned int i = 0; i < MSG_LEN; i++)
+          msg[i] = "{\"id\":42,\"tick\":[1,2,3]}"[i % 24];
+
+     pmd_params_t params;
+     memset(&params, 0, sizeof(params));
+     params.server_no_context_takeover = true;
+     params.client_no_context_takeover = true;
+
+     pmd_init(Z_DEFAULT_COMPRESSION, PMD_SHARED);
+     unsigned int num;
+     unsigned long int before = pmd_mem(&num);
+     pmd_t *server[2] = { pmd_alloc(&params, true), pmd_alloc(&params, true) };
+     assert(server[0] && server[1] && server[0]->shared);
+
+     /* Two messages in halves, one half of each after the other */
+     long n[2] = { 0, 0 };
+     for (unsigned int half = 0; half < 2; half++) {
+          for (unsigned int i = 0; i < 2; i++) {
+               long len = pmd_deflate(server[i],
+                                      &msg[half * MSG_LEN / 2],
+                                      MSG_LEN / 2,
+                                      &deflated[i][n[i]],
+                                      MSG_LEN,
+                                      half);
+               assert(0 < len);
+               n[i] += len;
+          }
+     }
+
+     pmd_init(Z_DEFAULT_COMPRESSION, PMD_FULL);
+     for (unsigned int i = 0; i < 2; i++) {
+          pmd_t *client = pmd_alloc(&params, false);
+          assert(client);
+          unsigned long int len = 0;
+          inflate_msg(client, deflated[i], n[i], 5, inflated, &len);
+          assert(MSG_LEN == len);
+          assert(0 == memcmp(msg, inflated, MSG_LEN));
+          pmd_free(client);
+     }
+
+     /* Inflater borrowed for the message only */
+     pmd_init(Z_DEFAULT_COMPRESSION, PMD_SHARED);
+     unsigned long int len = 0;
+     inflate_msg(server[0], deflated[1], n[1], 64, inflated, &len);
+     assert(MSG_LEN == len);
+     assert(!server[0]->tx && !server[0]->rx);
+
+     /* What stays behind is shared, pooled and no connection's */
+     pmd_free(server[0]);
+     pmd_free(server[1]);
+     assert(before < pmd_mem(&num));
+     assert(0 == num);
+     pmd_init(Z_DEFAULT_COMPRESSION, PMD_FULL);
+}
+
+static void
+GIVEN_idle_connection_WHEN_released_THEN_next_message_inflated_alike()
+{
+     char msg[MSG_LEN], deflated[2 * MSG_LEN], inflated[MSG_LEN];
+     for (unsigned int i = 0; i < MSG_LEN; i++)
+          msg[i] = "{\"id\":42,\"tick\":[1,2,3]}"[i % 24];
+
+     pmd_params_t params;
+     memset(&params, 0, sizeof(params));
+     pmd_t *server = pmd_alloc(&params, true);
+     pmd_t *client = pmd_alloc(&params, false);
+     assert(server && client);
+
+     for (unsigned int i = 0; i < 2; i++) {
+          long n = pmd_deflate(server,
+                               msg,
+                               MSG_LEN,
+                               deflated,
+                               sizeof(deflated),
+                               true);
+          assert(0 < n);
+
+          unsigned long int len = 0;
+          inflate_msg(client, deflated, n, 7, inflated, &len);
+          assert(MSG_LEN == len);
+          assert(0 == memcmp(msg, inflated, MSG_LEN));
+
+          n = pmd_deflate(client, msg, MSG_LEN, deflated, sizeof(deflated), true);
+          assert(0 < n);
+          inflate_msg(server, deflated, n, 7, inflated, &len);
+          assert(MSG_LEN == len);
+
+          /* Peer's window is kept; it may refer back to it */
+          unsigned long int active = pmd_mem(NULL);
+          pmd_release(server);
+          assert(!server->tx && server->rx);
+          assert(active > pmd_mem(NULL));
+          assert(PMD_LEAN_WINDOW_BITS == server->tx_bits);
+     }
+
+     pmd_free(server);
+     pmd_free(client);
+}
+
+static void
+GIVEN_garbage_WHEN_inflated_THEN_fails()
+{
+     pmd_params_t params;
+     memset(&params, 0, sizeof(params));
+     pmd_t *pmd = pmd_alloc(&params, true);
+     assert(pmd);
+
+     char garbage[] = { (char)0xff, (char)0xff, (char)0xff, (char)0xff };
+     char out[64];
+     unsigned long int in = sizeof(garbage), n = sizeof(out);
+     assert(0 > pmd_inflate(pmd, garbage, &in, out, &n, true));
+     assert(WSD_EBADREQ == wsd_errno);
+     pmd_free(pmd);
+}
+
+int
+main()
+{
+     GIVEN_offers_WHEN_negotiated_THEN_first_acceptable_agreed_on();
+     GIVEN_bad_offers_WHEN_negotiated_THEN_declined();
+     GIVEN_messages_WHEN_deflated_THEN_inflated_by_peer_alike();
+     GIVEN_memory_mode_WHEN_negotiated_THEN_parameters_narrowed();
+     GIVEN_shared_mode_WHEN_records_interleave_THEN_each_inflated_alike();
+     GIVEN_idle_connection_WHEN_released_THEN_next_message_inflated_alike();
+     GIVEN_garbage_WHEN_inflated_THEN_fails();
+     return 0;
+}
@@ -0,0 +1,434 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <endian.h>
+#include <assert.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include "common.h"
+#include "sktable.h"
+#include "pp2.h"
+#include "ws.h"
+
+sktable_t sk_table;
+const wsd_config_t *wsd_cfg = NULL;
+int epfd = -1;
+unsigned int wsd_errno = WSD_CHECKERRNO;
+
+extern sk_t *pp2sk;
+
+static sk_t *
+open_sk(int *peer, unsigned long int hash)
+{
+     int sv[2];
+     assert(0 == socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv));
+     sk_t *sk = sk_alloc();
+     assert(sk);
+     assert(0 == sk_init(sk, sv[0], hash, SKB_SIZE));
+     sk->events = EPOLLIN | EPOLLOUT;
+     assert(0 == register_for_events(sk));
+     *peer = sv[1];
+     return sk;
+}
+
+static void
+forward(sk_t *sk, char byte1, const char *payload)
+{
+     wsframe_t wsf;
+     memset(&wsf, 0, sizeof(wsf));
+     wsf.byte1 = byte1;
+     wsf.payload = payload;
+     wsf.payload_len = strlen(payload);
+     assert(0 == pp2_encode_frame(sk, &wsf));
+}
+
+/* Length of PP2 header after the first 16 bytes */
+static unsigned int
+hdr_len(const char *p)
+{
+     return (unsigned char)p[14] << 8 | (unsigned char)p[15];
+}
+
+/* Records the client sent, as if the backend echoed them */
+static void
+echo()
+{
+     skb_t *b = pp2sk->sendbuf;
+     skb_copy(pp2sk->recvbuf, b, skb_rdsz(b));
+     skb_reset(b);
+     while (0 == pp2_decode_frame(pp2sk))
+          ;
+     assert(0 == skb_rdsz(pp2sk->recvbuf));
+}
+
+/* Control record from the backend with a single TLV for client sk */
+static void
+put_control(const sk_t *sk, uint8_t type, const void *value, uint8_t len)
+{
+     skb_t *b = pp2sk->recvbuf;
+     const char hdr[] = "\r\n\r\n\x00\r\nQUIT\n\x20\x00";
+     memcpy(&b->data[b->wrpos], hdr, 14);
+     b->data[b->wrpos + 14] = 0;
+     b->data[b->wrpos + 15] = 3 + 8 + 3 + len;
+     b->wrpos += 16;
+
+     char *p = &b->data[b->wrpos];
+     p[0] = (char)PP2_TYPE_CONNHASH;
+     p[1] = 0;
+     p[2] = 8;
+     memcpy(&p[3], &sk->hash, 8);
+     p[11] = (char)type;
+     p[12] = 0;
+     p[13] = len;
+     memcpy(&p[14], value, len);
+     b->wrpos += 14 + len;
+}
+
+/* As switch_to_ws() leaves sk, as far as records for it go */
+static void
+as_websocket(sk_t *sk)
+{
+     sk->proto->encode_frame = ws_encode_frame;
+     sk->ctlbuf = skb_alloc(SKB_CTL_SIZE);
+     assert(sk->ctlbuf);
+}
+
+static void
+close_sk(sk_t *sk, int peer)
+{
+     if (sk->hash)
+          sktable_del(&sk_table, sk);
+     close(sk->fd);
+     close(peer);
+     sk_destroy(sk);
+     free(sk);
+}
+
+static void
+GIVEN_binary_and_text_messages_WHEN_echoed_by_backend_THEN_opcodes_kept()
+{
+     int pp2peer, peer;
+     pp2sk = open_sk(&pp2peer, 0ULL);
+     sk_t *sk = open_sk(&peer, 42ULL);
+     as_websocket(sk);
+     assert(0 == sktable_add(&sk_table, sk));
+
+     /* Fragmented binary message, then a text one */
+     forward(sk, WS_BINARY_FRAME, "abc");
+     forward(sk, (char)(0x80 | WS_FRAG_FRAME), "de");
+     forward(sk, (char)(0x80 | WS_TEXT_FRAME), "f");
+
+     /* Opcode in first record of binary message only */
+     const char *p = pp2sk->sendbuf->data;
+     assert(30 + 3 + 4 == hdr_len(p));
+     assert(WS_BINARY_FRAME == p[16 + 30 + 3 + 3]);
+     p += 16 + hdr_len(p) + 3;
+     assert(30 == hdr_len(p));
+     p += 16 + hdr_len(p) + 2;
+     assert(30 == hdr_len(p));
+
+     echo();
+     const char expected[] = "\x02\x03" "abc" "\x80\x02" "de" "\x81\x01" "f";
+     assert(sizeof(expected) - 1 == skb_rdsz(sk->sendbuf));
+     assert(0 == memcmp(sk->sendbuf->data, expected, sizeof(expected) - 1));
+
+     close_sk(sk, peer);
+     close_sk(pp2sk, pp2peer);
+}
+
+static void
+GIVEN_batching_WHEN_two_clients_send_THEN_one_record_for_both()
+{
+     int pp2peer, peer, peer2;
+     pp2sk = open_sk(&pp2peer, 0ULL);
+     sk_t *sk = open_sk(&peer, 42ULL), *sk2 = open_sk(&peer2, 43ULL);
+     as_websocket(sk);
+     as_websocket(sk2);
+     assert(0 == sktable_add(&sk_table, sk));
+     assert(0 == sktable_add(&sk_table, sk2));
+     assert(0 == pp2_batch_open(1000));
+
+     forward(sk, (char)(0x80 | WS_BINARY_FRAME), "ab");
+     forward(sk2, (char)(0x80 | WS_TEXT_FRAME), "cde");
+     assert(pp2_batching());
+
+     /* LOCAL header, TLVs 0xE5 and 0xE1, then the entries */
+     const char *p = pp2sk->sendbuf->data;
+     unsigned int len = 2 * sizeof(struct pp2_entry) + 2 + 3;
+     assert(0x20 == p[12] && 3 + 7 == hdr_len(p));
+     assert(PP2_TYPE_BATCH == (unsigned char)p[16]);
+     assert(0 == memcmp(&p[16 + 3 + 3], &len, sizeof(len)));
+     assert(16 + hdr_len(p) + len == skb_rdsz(pp2sk->sendbuf));
+
+     echo();
+     assert(4 == skb_rdsz(sk->sendbuf));
+     assert(0 == memcmp(sk->sendbuf->data, "\x82\x02" "ab", 4));
+     assert(5 == skb_rdsz(sk2->sendbuf));
+     assert(0 == memcmp(sk2->sendbuf->data, "\x81\x03" "cde", 5));
+
+     pp2_batch_close();
+     close_sk(sk, peer);
+     close_sk(sk2, peer2);
+     close_sk(pp2sk, pp2peer);
+}
+
+static void
+GIVEN_compact_records_offered_WHEN_agreed_on_THEN_full_record_first()
+{
+     wsd_config_t cfg;
+     memset(&cfg, 0, sizeof(cfg));
+     cfg.compact_link = true;
+     const wsd_config_t *old_cfg = wsd_cfg;
+     wsd_cfg = &cfg;
+
+     int pp2peer, peer;
+     pp2sk = open_sk(&pp2peer, 0ULL);
+     sk_t *sk = open_sk(&peer, 42ULL);
+     as_websocket(sk);
+     assert(0 == sktable_add(&sk_table, sk));
+
+     pp2_offer_compact(pp2sk);
+     assert(0x20 == pp2sk->sendbuf->data[12]);
+     skb_reset(pp2sk->sendbuf);
+
+     /* Backend agrees */
+     pp2_put_local(pp2sk->recvbuf, PP2_TYPE_COMPACT, "", 0);
+     assert(0 == pp2_decode_frame(pp2sk));
+     skb_reset(pp2sk->recvbuf);
+
+     forward(sk, (char)(0x80 | WS_TEXT_FRAME), "ab");
+     unsigned int full = 16 + 30 + 2;
+     assert(full == skb_rdsz(pp2sk->sendbuf));
+
+     /* Switch, then flags, id as varint, length and payload */
+     forward(sk, (char)(0x80 | WS_BINARY_FRAME), "cd");
+     const char *p = &pp2sk->sendbuf->data[full];
+     assert(0x20 == p[12] && PP2_TYPE_COMPACT == (unsigned char)p[16]);
+     p += 16 + 3;
+     assert((char)0x82 == *p++);
+     unsigned long int id = 0;
+     for (int shift = 0; ; shift += 7, p++) {
+          id |= (unsigned long int)(0x7f & *p) << shift;
+          if (!(0x80 & *p))
+               break;
+     }
+     assert(sk->hash == id);
+     assert(0 == memcmp(++p, "\x02" "cd", 3));
+     assert(&pp2sk->sendbuf->data[skb_rdsz(pp2sk->sendbuf)] == p + 3);
+
+     echo();
+     assert(0 == memcmp(sk->sendbuf->data, "\x81\x02" "ab" "\x82\x02" "cd", 8));
+
+     close_sk(sk, peer);
+     close(pp2peer);
+     pp2_close(pp2sk);
+     wsd_cfg = old_cfg;
+}
+
+static void
+GIVEN_upgraded_client_WHEN_it_comes_and_goes_THEN_open_and_close_records()
+{
+     int pp2peer, peer;
+     pp2sk = open_sk(&pp2peer, 0ULL);
+     sk_t *sk = open_sk(&peer, 42ULL);
+     sk->proto->encode_frame = ws_encode_frame;
+     assert(0 == sktable_add(&sk_table, sk));
+
+     char target[] = "/chat", host[] = " example.com", proto[] = "chat";
+     http_req_t req;
+     memset(&req, 0, sizeof(req));
+     req.req_target = (chunk_t){ target, strlen(target) };
+     req.host = (chunk_t){ host, strlen(host) };
+     req.sec_ws_proto = (chunk_t){ proto, strlen(proto) };
+
+     /* Fields present only, trimmed, and no payload */
+     assert(0 == pp2_encode_open(sk, &req));
+     assert(sk->announced);
+     const char *p = pp2sk->sendbuf->data;
+     assert(30 + 3 + 5 + 3 + 11 + 3 + 4 == hdr_len(p));
+     p += 16 + 30;
+     assert(PP2_TYPE_OPEN == (unsigned char)p[0]);
+     assert(0 == memcmp(&p[3], "/chat", 5));
+     p += 3 + 5;
+     assert(PP2_TYPE_AUTHORITY == p[0]);
+     assert(0 == memcmp(&p[3], "example.com", 11));
+     p += 3 + 11;
+     assert(PP2_TYPE_SUBPROTOCOL == (unsigned char)p[0]);
+
+     /* Status of first close frame, big endian */
+     unsigned int open_len = skb_rdsz(pp2sk->sendbuf);
+     sk->close_code = 1001;
+     assert(0 == pp2_encode_close(sk));
+     assert(!sk->announced);
+     p = &pp2sk->sendbuf->data[open_len];
+     assert(30 + 3 + 2 == hdr_len(p));
+     assert(0 == memcmp(&p[16 + 30], "\xe8\x00\x02\x03\xe9", 5));
+
+     /* Not announced, so nothing to close */
+     unsigned int len = skb_rdsz(pp2sk->sendbuf);
+     assert(0 == pp2_encode_close(sk));
+     assert(len == skb_rdsz(pp2sk->sendbuf));
+
+     /* Nothing for the client if echoed */
+     echo();
+     assert(0 == skb_rdsz(sk->sendbuf));
+
+     close_sk(sk, peer);
+     close_sk(pp2sk, pp2peer);
+}
+
+static void
+GIVEN_client_not_upgraded_WHEN_backend_sends_data_THEN_dropped()
+{
+     int pp2peer, peer;
+     pp2sk = open_sk(&pp2peer, 0ULL);
+     sk_t *sk = open_sk(&peer, 42ULL);
+     assert(0 == sktable_add(&sk_table, sk));
+
+     char target[] = "/";
+     http_req_t req;
+     memset(&req, 0, sizeof(req));
+     req.req_target = (chunk_t){ target, strlen(target) };
+     assert(0 == pp2_encode_open(sk, &req));
+     skb_reset(pp2sk->sendbuf);
+
+     /* Still in HTTP mode, without any frame encoder */
+     assert(!sk->ctlbuf && !sk->proto->encode_frame);
+     forward(sk, (char)(0x80 | WS_TEXT_FRAME), "early");
+     echo();
+     assert(0 == skb_rdsz(sk->sendbuf));
+
+     close_sk(sk, peer);
+     close_sk(pp2sk, pp2peer);
+}
+
+static void
+GIVEN_upgraded_client_WHEN_backend_sends_controls_THEN_applied()
+{
+     int pp2peer, peer;
+     pp2sk = open_sk(&pp2peer, 0ULL);
+     sk_t *sk = open_sk(&peer, 42ULL);
+     sk->proto->ping = ws_ping;
+     sk->proto->start_closing_handshake = ws_start_closing_handshake;
+     sk->ctlbuf = skb_alloc(SKB_CTL_SIZE);
+     assert(sk->ctlbuf);
+     assert(0 == sktable_add(&sk_table, sk));
+
+     unsigned int rate = 1000;
+     uint8_t low = 1;
+     put_control(sk, PP2_TYPE_PING, "", 0);
+     put_control(sk, PP2_TYPE_RATE, &rate, sizeof(rate));
+     put_control(sk, PP2_TYPE_PRIORITY, &low, 1);
+     while (0 == pp2_decode_frame(pp2sk))
+          ;
+     assert(0 == skb_rdsz(pp2sk->recvbuf));
+     assert(0x89 == (unsigned char)sk->ctlbuf->data[0]);
+     assert(1000 == sk->rate && 1000 == sk->allowance);
+     assert(sk->low_prio);
+
+     skb_reset(sk->ctlbuf);
+     uint16_t status = htobe16(4000);
+     put_control(sk, PP2_TYPE_CLOSE, &status, 2);
+     assert(0 == pp2_decode_frame(pp2sk));
+     assert(sk->closing && 4000 == sk->close_code);
+     assert(0 == memcmp(sk->ctlbuf->data, "\x88\x02\x0f\xa0", 4));
+     assert(!sk->close);
+
+     /* Dropped for status no close frame may carry */
+     status = htobe16(1006);
+     put_control(sk, PP2_TYPE_CLOSE, &status, 2);
+     assert(0 == pp2_decode_frame(pp2sk));
+     assert(sk->close && 4000 == sk->close_code);
+
+     close_sk(sk, peer);
+     close_sk(pp2sk, pp2peer);
+}
+
+static void
+GIVEN_flow_control_agreed_on_WHEN_credit_used_up_THEN_paused()
+{
+     wsd_config_t cfg;
+     memset(&cfg, 0, sizeof(cfg));
+     cfg.window = 100;
+     const wsd_config_t *old_cfg = wsd_cfg;
+     wsd_cfg = &cfg;
+
+     int pp2peer, peer;
+     pp2sk = open_sk(&pp2peer, 0ULL);
+     sk_t *sk = open_sk(&peer, 42ULL);
+     as_websocket(sk);
+     assert(0 == sktable_add(&sk_table, sk));
+
+     pp2_offer_flow(pp2sk, cfg.window);
+     const char *p = pp2sk->sendbuf->data;
+     assert(0x20 == p[12] && PP2_TYPE_CREDIT == (unsigned char)p[16]);
+     skb_reset(pp2sk->sendbuf);
+     assert(!pp2_paused(sk));
+
+     /* Backend agrees; marked where credit starts counting */
+     pp2_put_local(pp2sk->recvbuf,
+                   PP2_TYPE_CREDIT,
+                   (char*)&cfg.window,
+                   sizeof(cfg.window));
+     assert(0 == pp2_decode_frame(pp2sk));
+     assert(0 == skb_rdsz(pp2sk->recvbuf));
+     assert(PP2_TYPE_CREDIT == (unsigned char)pp2sk->sendbuf->data[16]);
+     assert(100 == sk->credit);
+     skb_reset(pp2sk->sendbuf);
+
+     char payload[61];
+     memset(payload, 'x', 60);
+     payload[60] = 0;
+     forward(sk, (char)(0x80 | WS_TEXT_FRAME), payload);
+     assert(40 == sk->credit && !pp2_paused(sk));
+     forward(sk, (char)(0x80 | WS_TEXT_FRAME), payload);
+     assert(-20 == sk->credit && pp2_paused(sk));
+
+     unsigned int grant = 50;
+     put_control(sk, PP2_TYPE_CREDIT, &grant, sizeof(grant));
+     assert(0 == pp2_decode_frame(pp2sk));
+     assert(30 == sk->credit && !pp2_paused(sk));
+     skb_reset(pp2sk->recvbuf);
+
+     /* Backend gets back what the client took */
+     echo();
+     assert(120 == sk->owed);
+     assert(0 == pp2_encode_credit(sk));
+     assert(0 == sk->owed);
+     p = pp2sk->sendbuf->data;
+     assert(30 + 3 + 4 == hdr_len(p));
+     assert(0 == memcmp(&p[16 + 30], "\xef\x00\x04\x78\x00\x00\x00", 7));
+
+     /* Nothing owed, nothing sent */
+     unsigned int len = skb_rdsz(pp2sk->sendbuf);
+     assert(0 == pp2_encode_credit(sk));
+     assert(len == skb_rdsz(pp2sk->sendbuf));
+
+     close_sk(sk, peer);
+     close(pp2peer);
+     pp2_close(pp2sk);
+     wsd_cfg = old_cfg;
+}
+
+int
+main()
+{
+     wsd_config_t cfg;
+     memset(&cfg, 0, sizeof(cfg));
+     wsd_cfg = &cfg;
+     epfd = epoll_create(1);
+     assert(0 <= epfd);
+     assert(0 == sktable_init(&sk_table, 16));
+
+     GIVEN_binary_and_text_messages_WHEN_echoed_by_backend_THEN_opcodes_kept();
+     GIVEN_batching_WHEN_two_clients_send_THEN_one_record_for_both();
+     GIVEN_compact_records_offered_WHEN_agreed_on_THEN_full_record_first();
+     GIVEN_upgraded_client_WHEN_it_comes_and_goes_THEN_open_and_close_records();
+     GIVEN_client_not_upgraded_WHEN_backend_sends_data_THEN_dropped();
+     GIVEN_upgraded_client_WHEN_backend_sends_controls_THEN_applied();
+     GIVEN_flow_control_agreed_on_WHEN_credit_used_up_THEN_paused();
+
+     sktable_free(&sk_table);
+     close(epfd);
+     return 0;
+}
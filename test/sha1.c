@@ -0,0 +1,110 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "sha1.h"
+#include "sktable.h"
+#include "ws.h"
+#include "ws_wsd.h"
+
+sktable_t sk_table;
+const wsd_config_t *wsd_cfg = NULL;
+int epfd = -1;
+unsigned int wsd_errno = WSD_CHECKERRNO;
+
+static const char *hex = "0123456789abcdef";
+
+static void
+to_hex(const unsigned char *md, char *s)
+{
+     for (int i = 0; i < SHA1_DIGEST_LEN; i++) {
+          s[2 * i] = hex[md[i] >> 4];
+          s[2 * i + 1] = hex[md[i] & 0xf];
+     }
+     s[2 * SHA1_DIGEST_LEN] = '\0';
+}
+
+static void
+GIVEN_test_vectors_WHEN_hashing_THEN_digest_as_in_rfc3174()
+{
+     char *inputs[] = {
+          "abc",
+          "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+          "dGhlIHNhbXBsZSBub25jZQ==258EAFA5-E914-47DA-95CA-C5AB0DC85B11",
+          ""
+     };
+     char *digests[] = {
+          "a9993e364706816aba3e25717850c26c9cd0d89d",
+          "84983e441c3bd26ebaae4aa1f95129e5e54670f1",
+          "b37a4f2cc0624f1690f64606cf385945b2bec4ea",
+          "da39a3ee5e6b4b0d3255bfef95601890afd80709"
+     };
+
+     for (unsigned int impl = SHA1_SCALAR; impl <= SHA1_SHANI; impl++) {
+          if (0 > sha1_select(impl))
+               continue;
+
+          for (int i = 0; i < sizeof(inputs) / sizeof(inputs[0]); i++) {
+               unsigned char md[SHA1_DIGEST_LEN];
+               char s[2 * SHA1_DIGEST_LEN + 1];
+               sha1(inputs[i], strlen(inputs[i]), md);
+               to_hex(md, s);
+               assert(0 == strcmp(digests[i], s));
+          }
+     }
+}
+
+static void
+GIVEN_any_length_WHEN_hashing_THEN_same_digest_with_sha_extensions()
+{
+     if (0 > sha1_select(SHA1_SHANI))
+          return;
+
+     /* Around one and two block boundaries, padding spills over */
+     unsigned char data[300];
+     for (int i = 0; i < sizeof(data); i++)
+          data[i] = i * 7;
+
+     for (int len = 0; len <= sizeof(data); len++) {
+          unsigned char md[SHA1_DIGEST_LEN], expected[SHA1_DIGEST_LEN];
+          assert(0 == sha1_select(SHA1_SCALAR));
+          sha1(data, len, expected);
+          assert(0 == sha1_select(SHA1_SHANI));
+          sha1(data, len, md);
+          assert(0 == memcmp(expected, md, SHA1_DIGEST_LEN));
+     }
+}
+
+static void
+GIVEN_rfc6455_key_WHEN_accepting_THEN_accept_value_as_in_rfc()
+{
+     chunk_t key;
+     key.p = "dGhlIHNhbXBsZSBub25jZQ==";
+     key.len = strlen(key.p);
+
+     for (unsigned int impl = SHA1_SCALAR; impl <= SHA1_SHANI; impl++) {
+          if (0 > sha1_select(impl))
+               continue;
+
+          char val[WS_ACCEPT_KEY_LEN + 1];
+          memset(val, 0, sizeof(val));
+          assert(0 == ws_accept_val(val, &key));
+          assert(0 == strcmp("s3pPLMBiTxaQ9kYGzzhZRbK+xOo=", val));
+     }
+
+     /* Keys are 24 bytes; much longer ones don't fit the scratch buffer */
+     char big[256];
+     memset(big, 'A', sizeof(big));
+     key.p = big;
+     key.len = sizeof(big);
+     assert(0 > ws_accept_val(big, &key));
+     assert(WSD_EINPUT == wsd_errno);
+}
+
+int
+main()
+{
+     GIVEN_test_vectors_WHEN_hashing_THEN_digest_as_in_rfc3174();
+     GIVEN_any_length_WHEN_hashing_THEN_same_digest_with_sha_extensions();
+     GIVEN_rfc6455_key_WHEN_accepting_THEN_accept_value_as_in_rfc();
+     return 0;
+}
@@ -0,0 +1,109 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "sktable.h"
+
+#define NUM_SK 100000
+
+unsigned int wsd_errno = WSD_CHECKERRNO;
+
+static void
+GIVEN_many_sockets_WHEN_adding_THEN_each_found_by_id()
+{
+     sktable_t t;
+     assert(0 == sktable_init(&t, 0));
+
+     sk_t *sks = calloc(NUM_SK, sizeof(sk_t));
+     assert(sks);
+     for (unsigned int i = 0; i < NUM_SK; i++) {
+          sks[i].fd = i;
+          assert(0 == sktable_add(&t, &sks[i]));
+     }
+
+     assert(NUM_SK == t.num);
+     assert(NUM_SK == t.hi);
+     for (unsigned int i = 0; i < NUM_SK; i++) {
+          assert(&sks[i] == sktable_get(&t, sks[i].hash));
+          assert(i == SKTABLE_SLOT(sks[i].hash));
+          assert(0 <= (long int)sks[i].hash);
+     }
+
+     assert(NULL == sktable_get(&t, SKTABLE_ID(t.size, 0)));
+
+     sktable_free(&t);
+     free(sks);
+}
+
+static void
+GIVEN_sparse_fds_WHEN_iterating_THEN_visited_in_fd_order()
+{
+     sktable_t t;
+     assert(0 == sktable_init(&t, 0));
+
+     sk_t sks[4];
+     memset(sks, 0, sizeof(sks));
+     int fds[] = { 9, 4, 70000, 5 };
+     for (unsigned int i = 0; i < 4; i++) {
+          sks[i].fd = fds[i];
+          assert(0 == sktable_add(&t, &sks[i]));
+     }
+
+     /* Descriptor beyond initial size grows the table */
+     assert(70000 < t.size);
+
+     unsigned int i, n = 0;
+     int prev = -1;
+     sk_t *pos = NULL;
+     sktable_for_each(&t, pos, i) {
+          assert(prev < pos->fd);
+          prev = pos->fd;
+          assert(0 == sktable_del(&t, pos));
+          n++;
+     }
+
+     assert(4 == n);
+     assert(0 == t.num);
+     assert(0 == t.hi);
+
+     sktable_free(&t);
+}
+
+static void
+GIVEN_closed_socket_WHEN_fd_reused_THEN_old_id_not_found()
+{
+     sktable_t t;
+     assert(0 == sktable_init(&t, 0));
+
+     sk_t a, b;
+     memset(&a, 0, sizeof(sk_t));
+     memset(&b, 0, sizeof(sk_t));
+     a.fd = b.fd = 7;
+
+     assert(0 == sktable_add(&t, &a));
+     uint64_t stale = a.hash;
+     assert(0 == sktable_del(&t, &a));
+     assert(NULL == sktable_get(&t, stale));
+
+     /* Same descriptor, next generation */
+     assert(0 == sktable_add(&t, &b));
+     assert(SKTABLE_SLOT(stale) == SKTABLE_SLOT(b.hash));
+     assert(SKTABLE_GEN(stale) != SKTABLE_GEN(b.hash));
+     assert(NULL == sktable_get(&t, stale));
+     assert(&b == sktable_get(&t, b.hash));
+
+     /* Deleting twice is an error */
+     assert(0 == sktable_del(&t, &b));
+     assert(0 > sktable_del(&t, &b));
+     assert(WSD_EINPUT == wsd_errno);
+
+     sktable_free(&t);
+}
+
+int
+main()
+{
+     GIVEN_many_sockets_WHEN_adding_THEN_each_found_by_id();
+     GIVEN_sparse_fds_WHEN_iterating_THEN_visited_in_fd_order();
+     GIVEN_closed_socket_WHEN_fd_reused_THEN_old_id_not_found();
+     return 0;
+}
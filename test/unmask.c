@@ -0,0 +1,42 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "common.h"
+#include "sktable.h"
+#include "ws.h"
+#include "ws_wsd.h"
+
+#define PAYLOAD_LEN 100
+
+sktable_t sk_table;
+const wsd_config_t *wsd_cfg = NULL;
+int epfd = -1;
+unsigned int wsd_errno = WSD_CHECKERRNO;
+
+static void
+GIVEN_payload_WHEN_unmasked_in_pieces_THEN_same_as_bytewise()
+{
+     unsigned int key = 0x37fa213d;
+     char payload[PAYLOAD_LEN], expected[PAYLOAD_LEN], actual[PAYLOAD_LEN];
+     for (unsigned int i = 0; i < PAYLOAD_LEN; i++) {
+          payload[i] = (char)(i * 7 + 1);
+          expected[i] = unmask(payload[i], i, key);
+     }
+
+     /* Pieces of every length, starting at every offset modulo 8 */
+     for (unsigned int piece = 1; piece < 20; piece++) {
+          memcpy(actual, payload, PAYLOAD_LEN);
+          for (unsigned int i = 0; i < PAYLOAD_LEN; i += piece) {
+               unsigned int n = PAYLOAD_LEN - i < piece ? PAYLOAD_LEN - i : piece;
+               ws_unmask(&actual[i], n, key, i);
+          }
+          assert(0 == memcmp(expected, actual, PAYLOAD_LEN));
+     }
+}
+
+int
+main()
+{
+     GIVEN_payload_WHEN_unmasked_in_pieces_THEN_same_as_bytewise();
+     return 0;
+}
@@ -0,0 +1,181 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <sys/socket.h>
+#include "common.h"
+#include "sktable.h"
+#include "ws.h"
+#include "ws_wsd.h"
+
+#define PAYLOAD_LEN 100000
+#define FRAME_LEN   (10 + PAYLOAD_LEN)
+
+sktable_t sk_table;
+const wsd_config_t *wsd_cfg = NULL;
+int epfd = -1;
+unsigned int wsd_errno = WSD_CHECKERRNO;
+
+extern sk_t *pp2sk;
+
+/* Unmasked binary frame with 64 bit length; see section 5.2 RFC6455 */
+static void
+put_frame(skb_t *b, char c)
+{
+     skb_put(b, (char)0x82);
+     skb_put(b, (char)127);
+     skb_put(b, (unsigned long)htobe64(PAYLOAD_LEN));
+     memset(&b->data[b->wrpos], c, PAYLOAD_LEN);
+     b->wrpos += PAYLOAD_LEN;
+}
+
+/* Record from the backend for sk, as pp2_decode_frame() passes it on */
+static void
+encode_record(sk_t *sk, char byte1, const char *payload)
+{
+     wsframe_t wsf;
+     memset(&wsf, 0, sizeof(wsf));
+     wsf.byte1 = byte1;
+     wsf.payload_len = strlen(payload);
+     assert(0 == skb_put_strn(pp2sk->recvbuf, payload, wsf.payload_len));
+     assert(0 == ws_encode_frame(sk, &wsf));
+     assert(0 == skb_rdsz(pp2sk->recvbuf));
+}
+
+static void
+GIVEN_max_frame_len_WHEN_message_spans_records_THEN_fragmented()
+{
+     wsd_config_t cfg;
+     memset(&cfg, 0, sizeof(cfg));
+     cfg.max_frame_len = 4;
+     wsd_cfg = &cfg;
+
+     pp2sk = sk_alloc();
+     assert(pp2sk);
+     assert(0 == sk_init(pp2sk, -1, 0ULL, SKB_SIZE));
+     pp2sk->events = EPOLLIN;
+     sk_t *sk = sk_alloc();
+     assert(sk);
+     assert(0 == sk_init(sk, -1, 0ULL, SKB_SIZE));
+     sk->events = EPOLLIN | EPOLLOUT;
+
+     /* Opcode in first fragment only, FIN in last only */
+     encode_record(sk, (char)WS_TEXT_FRAME, "abcdefghij");
+     assert(sk->tx_frag);
+     encode_record(sk, (char)0x80, "klmno");
+     assert(!sk->tx_frag);
+     encode_record(sk, (char)(0x80 | WS_BINARY_FRAME), "pq");
+
+     const char out[] = "\x01\x04" "abcd" "\x00\x04" "efgh" "\x00\x02" "ij"
+          "\x00\x04" "klmn" "\x80\x01" "o"
+          "\x82\x02" "pq";
+     assert(sizeof(out) - 1 == skb_rdsz(sk->sendbuf));
+     assert(0 == memcmp(sk->sendbuf->data, out, sizeof(out) - 1));
+
+     sk_destroy(sk);
+     free(sk);
+     sk_destroy(pp2sk);
+     free(pp2sk);
+     pp2sk = NULL;
+}
+
+static void
+GIVEN_data_frame_partly_written_WHEN_pong_queued_THEN_sent_right_after_it()
+{
+     wsd_config_t cfg;
+     memset(&cfg, 0, sizeof(cfg));
+     wsd_cfg = &cfg;
+
+     int sv[2], small = 4096;
+     assert(0 == socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv));
+     assert(0 == setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &small, sizeof(small)));
+
+     sk_t *sk = sk_alloc();
+     assert(sk);
+     assert(0 == sk_init(sk, sv[0], 0ULL, SKB_SIZE));
+     assert((sk->ctlbuf = skb_alloc(SKB_CTL_SIZE)));
+     sk->events |= EPOLLOUT;
+     put_frame(sk->sendbuf, 'a');
+     put_frame(sk->sendbuf, 'b');
+
+     assert(0 == ws_write(sk));
+     assert(0 < sk->tx_left && FRAME_LEN > sk->tx_left);
+     assert(0 == ws_pong(sk, false));
+
+     static char out[2 * FRAME_LEN + 2];
+     unsigned int len = 0;
+     while (len < sizeof(out)) {
+          ssize_t n = read(sv[1], &out[len], sizeof(out) - len);
+          if (0 < n)
+               len += n;
+          else if (0 > ws_write(sk))
+               assert(WSD_EAGAIN == wsd_errno);
+     }
+     assert(0 == skb_rdsz(sk->sendbuf) && 0 == skb_rdsz(sk->ctlbuf));
+
+     assert('a' == out[FRAME_LEN - 1]);
+     assert((char)0x8a == out[FRAME_LEN] && 0 == out[FRAME_LEN + 1]);
+     assert((char)0x82 == out[FRAME_LEN + 2]);
+     assert('b' == out[sizeof(out) - 1]);
+
+     sk_destroy(sk);
+     free(sk);
+     close(sv[0]);
+     close(sv[1]);
+}
+
+static void
+GIVEN_data_frame_partly_written_WHEN_close_queued_THEN_nothing_after_it()
+{
+     wsd_config_t cfg;
+     memset(&cfg, 0, sizeof(cfg));
+     wsd_cfg = &cfg;
+
+     int sv[2], small = 4096;
+     assert(0 == socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv));
+     assert(0 == setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &small, sizeof(small)));
+
+     sk_t *sk = sk_alloc();
+     assert(sk);
+     assert(0 == sk_init(sk, sv[0], 0ULL, SKB_SIZE));
+     assert((sk->ctlbuf = skb_alloc(SKB_CTL_SIZE)));
+     sk->events |= EPOLLOUT;
+     put_frame(sk->sendbuf, 'a');
+     put_frame(sk->sendbuf, 'b');
+
+     assert(0 == ws_write(sk));
+     assert(0 < sk->tx_left && FRAME_LEN > sk->tx_left);
+     assert(0 == ws_start_closing_handshake(sk, WS_1000, false));
+     put_frame(sk->sendbuf, 'c');
+
+     /* Rest of the frame in flight, then the close frame only */
+     static char out[FRAME_LEN + 4];
+     unsigned int len = 0;
+     while (len < sizeof(out)) {
+          ssize_t n = read(sv[1], &out[len], sizeof(out) - len);
+          if (0 < n)
+               len += n;
+          else if (0 > ws_write(sk))
+               assert(WSD_EAGAIN == wsd_errno);
+     }
+     assert(0 == skb_rdsz(sk->sendbuf) && 0 == skb_rdsz(sk->ctlbuf));
+     assert(0 == sk->tx_left);
+
+     assert('a' == out[FRAME_LEN - 1]);
+     assert(0 == memcmp(&out[FRAME_LEN], "\x88\x02\x03\xe8", 4));
+     assert(0 > read(sv[1], out, 1));
+
+     sk_destroy(sk);
+     free(sk);
+     close(sv[0]);
+     close(sv[1]);
+}
+
+int
+main()
+{
+     GIVEN_data_frame_partly_written_WHEN_pong_queued_THEN_sent_right_after_it();
+     GIVEN_data_frame_partly_written_WHEN_close_queued_THEN_nothing_after_it();
+     GIVEN_max_frame_len_WHEN_message_spans_records_THEN_fragmented();
+     return 0;
+}